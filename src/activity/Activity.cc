@@ -1,21 +1,150 @@
 #include <iostream>
 #include <time.h>
+#include <stdint.h>
+#include <algorithm>
+#include <typeinfo>
+
+#ifdef FWK_ATOMIC_REFS
+#include <pthread.h>
+#endif
+#ifdef ACTIVITY_TELEMETRY
+#include <cxxabi.h>
+#include <stdlib.h>
+#endif
 
 #include "logging.h"
+#include "fwk/Exception.h"
 #include "activity/Activity.h"
 
 namespace Activity{
 
+/*
+ * Journal
+ *
+ */
+
+#ifdef FWK_ATOMIC_REFS
+__thread Journal* Journal::current_ = NULL;
+#else
+Journal* Journal::current_ = NULL;
+#endif
+
+// journals number their marks from distinct bases
+static uint64_t journals = 0;
+
+Journal::Journal() : epoch_(++journals << 40) {}
+
+Journal::~Journal() {
+    entriesDel();
+}
+
+void Journal::markIs(Tick tick) {
+    if (!marks_.empty() && marks_.back().first == tick) return;
+    marks_.push_back(make_pair(tick, entries_.size()));
+    epoch_++;
+}
+
+void Journal::rollbackIs(Tick tick) {
+    size_t mark = marks_.size();
+    while (mark > 0 && marks_[mark - 1].first >= tick) mark--;
+    if (mark == marks_.size()) return;
+    size_t first = marks_[mark].second;
+    for (size_t i = entries_.size(); i > first; i--) {
+        entries_[i - 1]->undo();
+        delete entries_[i - 1];
+    }
+    entries_.resize(first);
+    marks_.resize(mark);
+    // records made from now on belong to a new mark
+    epoch_++;
+}
+
+void Journal::entriesDel() {
+    for (size_t i = 0; i < entries_.size(); i++) delete entries_[i];
+    entries_.clear();
+    marks_.clear();
+    epoch_++;
+}
+
+/*
+ * Activity
+ *
+ */
+
+/* The fields of an activity as they were before the current mark */
+class Activity::State : public Journal::Entry {
+public:
+    State(Activity* activity) :
+        activity_(activity), status_(activity->status_), nextTime_(activity->nextTime_),
+        tick_(activity->tick_), sequence_(activity->sequence_), notifiee_(activity->notifiee_),
+        priority_(activity->priority_), period_(activity->period_), handle_(activity->handle_),
+        queued_(activity->queued_), coroutine_(activity->coroutine_) {}
+    void undo() {
+        activity_->status_ = status_;
+        activity_->nextTime_ = nextTime_;
+        activity_->tick_ = tick_;
+        activity_->sequence_ = sequence_;
+        activity_->notifiee_ = notifiee_;
+        activity_->priority_ = priority_;
+        activity_->period_ = period_;
+        activity_->handle_ = handle_;
+        activity_->queued_ = queued_;
+        activity_->coroutine_ = coroutine_;
+        // the queues are rebuilt from the restored activities
+        activity_->manager_->restored_.push_back(activity_);
+    }
+private:
+    ActivityPtr activity_;
+    Status status_;
+    Time nextTime_;
+    Tick tick_;
+    uint64_t sequence_;
+    NotifieePtr notifiee_;
+    Priority priority_;
+    Time period_;
+    ActivityHandle handle_;
+    bool queued_;
+    bool coroutine_;
+};
+
 Activity::Activity(string name, ManagerPtr manager) : 
-    NamedInterface(name), status_(Activity::uninit()), nextTime_(0.0), notifiee_(NULL),
-    manager_(manager), priority_(1)
+    NamedInterface(name), status_(Activity::uninit()), nextTime_(0.0), tick_(0), sequence_(0), notifiee_(NULL),
+    manager_(manager), priority_(1), period_(0.0), handle_(noHandle), queued_(false), coroutine_(false), savedEpoch_(0)
 {}
 
+void Activity::save(){
+    Journal* journal = Journal::current();
+    if (journal == NULL || savedEpoch_ == journal->epoch()) return;
+    savedEpoch_ = journal->epoch();
+    journal->entryIs(new State(this));
+}
+
+/* Return a pooled activity to its freshly constructed state */
+void Activity::reset(){
+    save();
+    status_ = uninit();
+    nextTime_ = 0.0;
+    tick_ = 0;
+    sequence_ = 0;
+    notifiee_ = NULL;
+    priority_ = 1;
+    period_ = 0.0;
+    queued_ = false;
+    coroutine_ = false;
+}
+
 void Activity::priorityIs(Priority priority){
+    save();
     priority_=priority;
 }
 
+void Activity::periodIs(Time period){
+    save();
+    period_=period;
+}
+
 void Activity::statusIs(Activity::Status status){
+    save();
     status_ = status;
     if (notifiee_ != NULL) {
         notifiee_->onStatus();
@@ -23,25 +152,686 @@ void Activity::statusIs(Activity::Status status){
 }
 
 void Activity::nextTimeIs(Time t){
+    save();
     nextTime_ = t;
+    tick_ = t.tick();
     if (notifiee_ != NULL) {
         notifiee_->onNextTime();
     }
 }
 
+/* Resume the coroutine once; unless it went back to sleep the activity is
+ * left free, and returned to the pool if the body has ended */
+void Activity::coroutineRun(){
+    Coroutine* coroutine = static_cast<Coroutine*>(notifiee_.ptr());
+    save();
+    status_ = executing();
+    coroutine->resume();
+    if (status_ != executing()) return;
+    status_ = free();
+    if (coroutine->done()) manager_->activityDel(handle_);
+}
+
 void Activity::lastNotifieeIs(Activity::Notifiee* n){
+    save();
     notifiee_ = n;
     n->notifierIs(this);
 }
 
+/*
+ * WallTime
+ *
+ */
+
+WallTime WallTime::now() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return WallTime((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+WallTime WallTime::nowPlus(double seconds) {
+    if (!(seconds < 1e10)) return never();
+    if (!(seconds > 0)) return now();
+    return WallTime(now().value() + (uint64_t)(seconds * 1e9));
+}
+
+/*
+ * Telemetry
+ *
+ */
+
+Telemetry::Telemetry() : events(0), simulatedHours(0), nanoseconds(0) {
+    for (uint32_t i = 0; i < depthBuckets; i++) depth[i] = 0;
+}
+
+double Telemetry::hoursPerSecond() const {
+    return nanoseconds == 0 ? 0 : simulatedHours * 1e9 / nanoseconds;
+}
+
+void Telemetry::countsInc(const Telemetry& other) {
+    events += other.events;
+    for (map<string, Reactor>::const_iterator it = other.reactors.begin(); it != other.reactors.end(); ++it) {
+        Reactor& reactor = reactors[it->first];
+        reactor.events += it->second.events;
+        reactor.nanoseconds += it->second.nanoseconds;
+    }
+    for (uint32_t i = 0; i < depthBuckets; i++) depth[i] += other.depth[i];
+}
+
+#ifdef ACTIVITY_TELEMETRY
+/* Class name of a reactor without its namespaces */
+static string reactorName(const std::type_info* type) {
+    if (type == NULL) return "none";
+    int status;
+    char* demangled = abi::__cxa_demangle(type->name(), NULL, NULL, &status);
+    string name = status == 0 ? demangled : type->name();
+    free(demangled);
+    size_t scope = name.rfind("::");
+    return scope == string::npos ? name : name.substr(scope + 2);
+}
+#endif
+
+/*
+ * Coroutine
+ *
+ */
+
+// frames are kept on free lists by size, in steps of frameAlign bytes
+static const size_t frameAlign = 16;
+static const size_t frameSizes = 32;
+#ifdef FWK_ATOMIC_REFS
+static __thread void* freeFrames[frameSizes];
+#else
+static void* freeFrames[frameSizes];
+#endif
+
+void* Coroutine::operator new(size_t size) {
+    size_t slot = (size + frameAlign - 1) / frameAlign;
+    if (slot >= frameSizes) return ::operator new(size);
+    void* frame = freeFrames[slot];
+    if (frame == NULL) return ::operator new(slot * frameAlign);
+    freeFrames[slot] = *(void**)frame;
+    return frame;
+}
+
+void Coroutine::operator delete(void* frame, size_t size) {
+    size_t slot = (size + frameAlign - 1) / frameAlign;
+    if (slot >= frameSizes) {
+        ::operator delete(frame);
+        return;
+    }
+    *(void**)frame = freeFrames[slot];
+    freeFrames[slot] = frame;
+}
+
+void Coroutine::lineIs(int line) {
+    Journal::save(this, line_);
+    line_ = line;
+}
+
+void Coroutine::sleepIs(Time delay) {
+    Activity* activity = notifier_;
+    Manager* manager = activity->manager_.ptr();
+    activity->save();
+    activity->nextTime_ = manager->now().value() + delay.value();
+    activity->tick_ = activity->nextTime_.tick();
+    activity->status_ = Activity::nextTimeScheduled();
+    manager->lastActivityIs(activity);
+}
+
+void Coroutine::onStatusBatch(const vector<ActivityPtr>& batch) {
+    for (size_t i = 0; i < batch.size(); i++) {
+        ActivityPtr activity = batch[i];
+        // an earlier activity of the batch may have cancelled this one
+        if (activity->status() != Activity::nextTimeScheduled()) continue;
+        activity->coroutineRun();
+    }
+}
+
+/*
+ * Queue policies
+ *
+ */
+
+static bool isCancelled(const ActivityPtr& activity) {
+    return activity->status() == Activity::cancelled();
+}
+
+class Manager::HeapQueue : public Manager::Queue {
+public:
+    bool empty() const { return heap_.empty(); }
+    size_t size() const { return heap_.size(); }
+    ActivityPtr top() { return heap_.front(); }
+    void pop() {
+        pop_heap(heap_.begin(), heap_.end(), ActivityComp());
+        heap_.pop_back();
+    }
+    void push(ActivityPtr activity) {
+        heap_.push_back(activity);
+        push_heap(heap_.begin(), heap_.end(), ActivityComp());
+    }
+    size_t compact() {
+        size_t before = heap_.size();
+        heap_.erase(remove_if(heap_.begin(), heap_.end(), isCancelled), heap_.end());
+        make_heap(heap_.begin(), heap_.end(), ActivityComp());
+        return before - heap_.size();
+    }
+private:
+    vector<ActivityPtr> heap_;
+};
+
+/* Entry of the integer-keyed queues. The key packs (tick, priority) into
+ * one integer and the sequence number breaks ties, giving the same order as
+ * ActivityComp. Entries hold a manual reference instead of an ActivityPtr so
+ * moving them around the queue costs no reference counting.
+ */
+struct QueueEntry {
+    uint64_t key;
+    uint64_t sequence;
+    Activity* activity;
+};
+
+static const uint64_t maxTicks = 0x00ffffffffffffffULL;
+
+static inline uint64_t ticks(uint64_t key) { return key >> 8; }
+
+static inline bool earlier(const QueueEntry& a, const QueueEntry& b) {
+    return a.key < b.key || (a.key == b.key && a.sequence < b.sequence);
+}
+static inline bool later(const QueueEntry& a, const QueueEntry& b) { return earlier(b, a); }
+
+/* Remove the entries of cancelled activities from b[from..], keeping the
+ * order of the rest, and return how many were removed.
+ */
+static size_t compactEntries(vector<QueueEntry>& b, size_t from = 0) {
+    size_t kept = from;
+    for (size_t i = from; i < b.size(); i++) {
+        if (b[i].activity->status() == Activity::cancelled()) {
+            b[i].activity->deleteRef();
+        } else {
+            b[kept++] = b[i];
+        }
+    }
+    size_t removed = b.size() - kept;
+    b.resize(kept);
+    return removed;
+}
+
+static QueueEntry queueEntry(ActivityPtr activity) {
+    QueueEntry entry;
+    Tick t = activity->tick();
+    uint64_t tick = 0;
+    // never-scheduled activities (e.g. a zero transfer rate) sit at +inf
+    if (t > (Tick)maxTicks) tick = maxTicks;
+    else if (t > 0) tick = (uint64_t)t;
+    entry.key = (tick << 8) | activity->priority().value();
+    entry.sequence = activity->sequence();
+    entry.activity = activity.ptr();
+    entry.activity->newRef();
+    return entry;
+}
+
+/* Monotone radix heap (Ahuja, Mehlhorn, Orlin, Tarjan). Relies on virtual
+ * time never going backwards: every pushed tick is at least the tick of the
+ * last activity taken off the queue. Keys are bucketed by the highest bit in
+ * which they differ from that last key, so each activity moves to a lower
+ * bucket at most 64 times over its lifetime and push/pop are amortized O(1).
+ * Bucket 0 holds the entries equal to the last key in sequence order and is
+ * consumed from the front; an entry pushed later within the same tick but
+ * at an earlier priority is inserted into it in order.
+ */
+class Manager::RadixHeapQueue : public Manager::Queue {
+public:
+    RadixHeapQueue() : last_(0), size_(0), head_(0), found_(false) {}
+    ~RadixHeapQueue() {
+        for (uint32_t b = 0; b < buckets; b++) {
+            for (size_t i = b == 0 ? head_ : 0; i < bucket_[b].size(); i++) {
+                bucket_[b][i].activity->deleteRef();
+            }
+        }
+    }
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+    ActivityPtr top() {
+        if (head_ < bucket_[0].size()) return bucket_[0][head_].activity;
+        if (!found_) locate();
+        return bucket_[foundBucket_][foundIndex_].activity;
+    }
+    void pop() {
+        if (head_ == bucket_[0].size()) redistribute();
+        Activity* activity = bucket_[0][head_].activity;
+        head_++;
+        size_--;
+        activity->deleteRef();
+    }
+    void push(ActivityPtr activity) {
+        QueueEntry entry = queueEntry(activity);
+        // an activity scheduled in the past runs as soon as possible
+        if (ticks(entry.key) < ticks(last_)) {
+            entry.key = (ticks(last_) << 8) | (entry.key & 0xff);
+        }
+        size_++;
+        // an earlier priority within the current tick goes ahead of the
+        // rest of bucket 0
+        if (entry.key < last_) {
+            vector<QueueEntry>& b = bucket_[0];
+            b.insert(upper_bound(b.begin() + head_, b.end(), entry, earlier), entry);
+            return;
+        }
+        uint32_t b = bucket(entry.key);
+        bucket_[b].push_back(entry);
+        // bucket 0 is taken first whatever was found beyond it
+        if (found_ && b != 0 && earlier(entry, bucket_[foundBucket_][foundIndex_])) {
+            foundBucket_ = b;
+            foundIndex_ = bucket_[b].size() - 1;
+        }
+    }
+    size_t compact() {
+        size_t removed = 0;
+        bucket_[0].erase(bucket_[0].begin(), bucket_[0].begin() + head_);
+        head_ = 0;
+        for (uint32_t b = 0; b < buckets; b++) removed += compactEntries(bucket_[b]);
+        size_ -= removed;
+        found_ = false;
+        return removed;
+    }
+private:
+    static const uint32_t buckets = 65;
+    uint32_t bucket(uint64_t key) const {
+        if (key == last_) return 0;
+        return 64 - __builtin_clzll(key ^ last_);
+    }
+    /* Find the earliest entry once bucket 0 is used up, leaving last_
+     * alone: a peek does not take anything off the queue, so entries
+     * earlier than the one found may still be pushed.
+     */
+    void locate() {
+        uint32_t b = 1;
+        while (bucket_[b].empty()) b++;
+        vector<QueueEntry>& source = bucket_[b];
+        foundBucket_ = b;
+        foundIndex_ = 0;
+        for (size_t i = 1; i < source.size(); i++) {
+            if (earlier(source[i], source[foundIndex_])) foundIndex_ = i;
+        }
+        found_ = true;
+    }
+    /* Move the smallest key to last_ and spread the bucket holding it over
+     * the lower buckets; afterwards bucket 0 holds every minimum entry.
+     */
+    void redistribute() {
+        bucket_[0].clear();
+        head_ = 0;
+        if (!found_) locate();
+        vector<QueueEntry>& source = bucket_[foundBucket_];
+        last_ = source[foundIndex_].key;
+        found_ = false;
+        for (size_t i = 0; i < source.size(); i++) {
+            bucket_[bucket(source[i].key)].push_back(source[i]);
+        }
+        source.clear();
+        sort(bucket_[0].begin(), bucket_[0].end(), earlier);
+    }
+    vector<QueueEntry> bucket_[buckets];
+    uint64_t last_;
+    size_t size_;
+    size_t head_;
+    // earliest entry outside bucket 0, valid while found_
+    bool found_;
+    uint32_t foundBucket_;
+    size_t foundIndex_;
+};
+
+/* Calendar queue (Brown 1988). Activities are hashed by time into a ring of
+ * day-sized buckets; dequeue walks the ring from the current day, so with a
+ * day width close to the typical gap between events both operations are
+ * O(1). The ring doubles or halves as the population crosses 2x or 1/2 the
+ * bucket count, and every resize re-estimates the day width from the gaps
+ * between the earliest pending events. Each bucket is kept sorted with its
+ * smallest key at the back.
+ */
+class Manager::CalendarQueue : public Manager::Queue {
+public:
+    CalendarQueue() : width_(1), lastTick_(0), size_(0), current_(none) {
+        bucketsIs(minBuckets);
+    }
+    ~CalendarQueue() {
+        for (size_t b = 0; b < bucket_.size(); b++) {
+            for (size_t i = 0; i < bucket_[b].size(); i++) {
+                bucket_[b][i].activity->deleteRef();
+            }
+        }
+    }
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+    ActivityPtr top() {
+        return bucket_[locate()].back().activity;
+    }
+    void pop() {
+        vector<QueueEntry>& b = bucket_[locate()];
+        Activity* activity = b.back().activity;
+        lastTick_ = ticks(b.back().key);
+        b.pop_back();
+        size_--;
+        current_ = none;
+        activity->deleteRef();
+        if (size_ < bucket_.size() / 2 && bucket_.size() > minBuckets) {
+            resize(bucket_.size() / 2);
+        }
+    }
+    void push(ActivityPtr activity) {
+        QueueEntry entry = queueEntry(activity);
+        // an activity scheduled in the past runs as soon as possible
+        if (ticks(entry.key) < lastTick_) {
+            entry.key = (lastTick_ << 8) | (entry.key & 0xff);
+        }
+        // a peek may have moved the current day past the entry; nothing
+        // earlier than the entry is left, so its day becomes the current one
+        uint64_t tick = ticks(entry.key);
+        if (tick < dayEnd_ - width_) {
+            day_ = bucket(tick);
+            dayEnd_ = (tick / width_ + 1) * width_;
+        }
+        insert(entry);
+        size_++;
+        current_ = none;
+        if (size_ > 2 * bucket_.size()) resize(2 * bucket_.size());
+    }
+    size_t compact() {
+        size_t removed = 0;
+        for (size_t b = 0; b < bucket_.size(); b++) removed += compactEntries(bucket_[b]);
+        size_ -= removed;
+        current_ = none;
+        size_t buckets = bucket_.size();
+        while (size_ < buckets / 2 && buckets > minBuckets) buckets /= 2;
+        if (buckets != bucket_.size()) resize(buckets);
+        return removed;
+    }
+private:
+    static const size_t minBuckets = 16;
+    static const size_t none = ~(size_t)0;
+    static const size_t sampleSize = 25;
+
+    size_t bucket(uint64_t tick) const { return (tick / width_) & (bucket_.size() - 1); }
+    void insert(const QueueEntry& entry) {
+        vector<QueueEntry>& b = bucket_[bucket(ticks(entry.key))];
+        b.insert(lower_bound(b.begin(), b.end(), entry, later), entry);
+    }
+    void bucketsIs(size_t buckets) {
+        bucket_.clear();
+        bucket_.resize(buckets);
+        day_ = bucket(lastTick_);
+        dayEnd_ = (lastTick_ / width_ + 1) * width_;
+    }
+
+    /* Find the bucket holding the smallest key, advancing the current day. */
+    size_t locate() {
+        if (current_ != none) return current_;
+        size_t mask = bucket_.size() - 1;
+        for (size_t n = 0; n <= mask; n++) {
+            vector<QueueEntry>& b = bucket_[day_];
+            if (!b.empty() && ticks(b.back().key) < dayEnd_) {
+                current_ = day_;
+                return current_;
+            }
+            day_ = (day_ + 1) & mask;
+            dayEnd_ += width_;
+        }
+        // nothing within a year of the current day: jump to the minimum
+        size_t best = none;
+        for (size_t i = 0; i <= mask; i++) {
+            if (bucket_[i].empty()) continue;
+            if (best == none || earlier(bucket_[i].back(), bucket_[best].back())) best = i;
+        }
+        uint64_t tick = ticks(bucket_[best].back().key);
+        day_ = best;
+        dayEnd_ = (tick / width_ + 1) * width_;
+        current_ = best;
+        return current_;
+    }
+
+    /* Rebuild the ring with a new bucket count and a day width of three
+     * times the average gap between the earliest pending events, ignoring
+     * gaps more than twice the average (Brown's estimate).
+     */
+    void resize(size_t buckets) {
+        vector<QueueEntry> entries;
+        entries.reserve(size_);
+        for (size_t b = 0; b < bucket_.size(); b++) {
+            entries.insert(entries.end(), bucket_[b].begin(), bucket_[b].end());
+        }
+        size_t n = entries.size() < sampleSize ? entries.size() : sampleSize;
+        partial_sort(entries.begin(), entries.begin() + n, entries.end(), earlier);
+        uint64_t total = 0, gaps = 0;
+        for (size_t i = 1; i < n; i++) {
+            total += ticks(entries[i].key) - ticks(entries[i-1].key);
+            gaps++;
+        }
+        if (gaps > 0 && total > 0) {
+            uint64_t average = total / gaps, trimmed = 0, kept = 0;
+            for (size_t i = 1; i < n; i++) {
+                uint64_t gap = ticks(entries[i].key) - ticks(entries[i-1].key);
+                if (gap <= 2 * average) { trimmed += gap; kept++; }
+            }
+            uint64_t width = kept > 0 ? 3 * trimmed / kept : 3 * average;
+            width_ = width > 0 ? width : 1;
+        }
+        bucketsIs(buckets);
+        for (size_t i = 0; i < entries.size(); i++) insert(entries[i]);
+        current_ = none;
+    }
+
+    vector< vector<QueueEntry> > bucket_;
+    uint64_t width_;
+    uint64_t lastTick_;
+    size_t size_;
+    size_t day_;
+    uint64_t dayEnd_;
+    size_t current_;
+};
+
+/* Hierarchical timing wheel (Varghese and Lauck) for the periodic
+ * activities. Five levels of 256 slots cover 2^40 ticks ahead of the cursor,
+ * the tick of the last activity taken off the wheel; later activities wait
+ * in an overflow list. An activity sits at the level of the highest byte in
+ * which its tick differs from the cursor, so a level-0 slot holds a single
+ * tick (kept as a heap on priority) and a slot of a higher level is only
+ * cascaded down when its earliest activity becomes the next to run. Bitmaps
+ * of the occupied slots make finding the next activity a few word scans.
+ */
+class Manager::TimingWheel : public Manager::Queue {
+public:
+    TimingWheel() : cursor_(0), size_(0), found_(false) {
+        for (uint32_t l = 0; l < levels; l++) {
+            for (uint32_t w = 0; w < words; w++) occupied_[l][w] = 0;
+        }
+    }
+    ~TimingWheel() {
+        for (uint32_t l = 0; l < levels; l++) {
+            for (uint32_t s = 0; s < slots; s++) release(slot_[l][s]);
+        }
+        release(overflow_);
+    }
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+    ActivityPtr top() {
+        locate();
+        return slot(foundLevel_, foundSlot_)[foundIndex_].activity;
+    }
+    void pop() {
+        locate();
+        if (foundLevel_ > 0) cascade();
+        cursor_ = ticks(foundKey_);
+        vector<QueueEntry>& b = slot(0, foundSlot_);
+        pop_heap(b.begin(), b.end(), later);
+        Activity* activity = b.back().activity;
+        b.pop_back();
+        if (b.empty()) occupiedIs(0, foundSlot_, false);
+        size_--;
+        found_ = false;
+        activity->deleteRef();
+    }
+    void push(ActivityPtr activity) {
+        QueueEntry entry = queueEntry(activity);
+        // an activity scheduled in the past runs as soon as possible
+        if (ticks(entry.key) < cursor_) {
+            entry.key = (cursor_ << 8) | (entry.key & 0xff);
+        }
+        place(entry);
+        size_++;
+        // a new entry has the largest sequence number, so only a smaller
+        // key can take the place of the cached earliest one
+        if (found_ && entry.key < foundKey_) found_ = false;
+    }
+    size_t compact() {
+        size_t removed = 0;
+        for (uint32_t l = 0; l < levels; l++) {
+            for (uint32_t s = 0; s < slots; s++) {
+                vector<QueueEntry>& b = slot_[l][s];
+                if (b.empty()) continue;
+                removed += compactEntries(b);
+                if (l == 0) make_heap(b.begin(), b.end(), later);
+                if (b.empty()) occupiedIs(l, s, false);
+            }
+        }
+        removed += compactEntries(overflow_);
+        size_ -= removed;
+        found_ = false;
+        return removed;
+    }
+private:
+    static const uint32_t levels = 5;
+    static const uint32_t bits = 8;
+    static const uint32_t slots = 1 << bits;
+    static const uint32_t words = slots / 64;
+    static void release(vector<QueueEntry>& b) {
+        for (size_t i = 0; i < b.size(); i++) b[i].activity->deleteRef();
+    }
+
+    // level `levels` is the overflow list, a single unordered slot
+    vector<QueueEntry>& slot(uint32_t level, uint32_t s) {
+        return level == levels ? overflow_ : slot_[level][s];
+    }
+    void occupiedIs(uint32_t level, uint32_t s, bool occupied) {
+        if (occupied) occupied_[level][s / 64] |= 1ULL << (s % 64);
+        else occupied_[level][s / 64] &= ~(1ULL << (s % 64));
+    }
+    /* First occupied slot of a level at or after slot s, or `slots`. */
+    uint32_t nextOccupied(uint32_t level, uint32_t s) const {
+        for (uint32_t w = s / 64; w < words; w++) {
+            uint64_t word = occupied_[level][w];
+            if (w == s / 64) word &= ~0ULL << (s % 64);
+            if (word) return w * 64 + __builtin_ctzll(word);
+        }
+        return slots;
+    }
+    void place(const QueueEntry& entry) {
+        uint64_t tick = ticks(entry.key);
+        uint64_t diff = tick ^ cursor_;
+        uint32_t level = diff == 0 ? 0 : (63 - __builtin_clzll(diff)) / bits;
+        if (level >= levels) {
+            overflow_.push_back(entry);
+            return;
+        }
+        uint32_t s = (tick >> (level * bits)) & (slots - 1);
+        vector<QueueEntry>& b = slot_[level][s];
+        b.push_back(entry);
+        if (level == 0) push_heap(b.begin(), b.end(), later);
+        occupiedIs(level, s, true);
+    }
+
+    /* Find the earliest activity: the front of the first occupied level-0
+     * slot, or else the smallest key in the first occupied slot above it.
+     */
+    void locate() {
+        if (found_) return;
+        foundLevel_ = levels;
+        foundSlot_ = 0;
+        for (uint32_t l = 0; l < levels; l++) {
+            uint32_t digit = (cursor_ >> (l * bits)) & (slots - 1);
+            uint32_t s = nextOccupied(l, l == 0 ? digit : digit + 1);
+            if (s == slots) continue;
+            foundLevel_ = l;
+            foundSlot_ = s;
+            break;
+        }
+        vector<QueueEntry>& b = slot(foundLevel_, foundSlot_);
+        foundIndex_ = 0;
+        if (foundLevel_ > 0) {
+            for (size_t i = 1; i < b.size(); i++) {
+                if (earlier(b[i], b[foundIndex_])) foundIndex_ = i;
+            }
+        }
+        foundKey_ = b[foundIndex_].key;
+        found_ = true;
+    }
+
+    /* Advance the cursor to the earliest activity and spread the slot that
+     * holds it over the lower levels; it ends up alone at the front of its
+     * level-0 slot. Slots of higher levels stay valid since the cursor has
+     * not left their ranges.
+     */
+    void cascade() {
+        vector<QueueEntry> entries;
+        entries.swap(slot(foundLevel_, foundSlot_));
+        if (foundLevel_ < levels) occupiedIs(foundLevel_, foundSlot_, false);
+        cursor_ = ticks(foundKey_);
+        for (size_t i = 0; i < entries.size(); i++) place(entries[i]);
+        foundLevel_ = 0;
+        foundSlot_ = cursor_ & (slots - 1);
+        foundIndex_ = 0;
+    }
+
+    vector<QueueEntry> slot_[levels][slots];
+    vector<QueueEntry> overflow_;
+    uint64_t occupied_[levels][words];
+    uint64_t cursor_;
+    size_t size_;
+    bool found_;
+    uint32_t foundLevel_;
+    uint32_t foundSlot_;
+    size_t foundIndex_;
+    uint64_t foundKey_;
+};
+
+/*
+ * Manager
+ *
+ */
+
+Manager::Manager(QueuePolicy policy) :
+    queuePolicy_(policy), now_(0), activityName_(0), sequence_(0), events_(0), tombstones_(0),
+    batchDispatch_(false), horizon_(maxTick), deferredHead_(0), inbox_(NULL) {
+    scheduledActivities_ = queueNew();
+    periodicActivities_ = new TimingWheel();
+}
+
+Manager::Queue* Manager::queueNew() const {
+    if (queuePolicy_ == radixHeap()) return new RadixHeapQueue();
+    if (queuePolicy_ == calendarQueue()) return new CalendarQueue();
+    return new HeapQueue();
+}
+
+Manager::~Manager() {
+    delete scheduledActivities_;
+    delete periodicActivities_;
+    while (inbox_ != NULL) {
+        Posted* posted = inbox_;
+        inbox_ = posted->next;
+        delete posted;
+    }
+}
+
 ActivityPtr Manager::activityNew() {
     std::stringstream s;
     s << "act-auto-name-"<< activityName_;
+    Journal::save(this, activityName_);
     activityName_++;
     return activityNew(s.str());
 }
 
 ActivityPtr Manager::activityNew(const string& name) {
+    Journal::saveKey(this, activities_, name);
     ActivityPtr activity = activities_[name];
     if (activity != NULL) {
         cerr << "Activity already exists!" << endl;
@@ -62,14 +852,339 @@ ActivityPtr Manager::activity(const string& name) const {
 }
 
 void Manager::activityDel(const string& name) {
+    Journal::saveKey(this, activities_, name);
     activities_.erase(name);
 }
 
+ActivityHandle Manager::anonymousActivityNew() {
+    uint32_t slot;
+    if (freeSlots_.empty()) {
+        slot = pool_.size();
+        Journal::savePushBack(this, pool_);
+        pool_.push_back(NULL);
+        Journal::savePushBack(this, generations_);
+        generations_.push_back(0);
+    } else {
+        slot = freeSlots_.back();
+        Journal::savePopBack(this, freeSlots_);
+        freeSlots_.pop_back();
+    }
+    ActivityHandle handle = (ActivityHandle)generations_[slot] << 32 | slot;
+    ActivityPtr& activity = pool_[slot];
+    // reuse the slot's activity only once the pool holds its last reference;
+    // a deleted activity may still be queued or running
+    if (activity != NULL && activity->references() == 1) {
+        activity->reset();
+    } else {
+        Journal::saveElement(this, pool_, slot);
+        activity = new Activity("", this);
+    }
+    activity->handle_ = handle;
+    return handle;
+}
+
+void Manager::activityDel(ActivityHandle handle) {
+    if (!live(handle)) return;
+    uint32_t slot = (uint32_t)handle;
+    Journal::saveElement(this, generations_, slot);
+    generations_[slot]++;
+    Journal::savePushBack(this, freeSlots_);
+    freeSlots_.push_back(slot);
+}
+
+void Manager::activityCancel(ActivityHandle handle) {
+    if (live(handle)) activityCancel(pool_[(uint32_t)handle].ptr());
+}
+
+void Manager::activityCancel(const string& name) {
+    map<string, ActivityPtr>::const_iterator it = activities_.find(name);
+    if (it != activities_.end()) activityCancel((*it).second.ptr());
+}
+
+void Manager::activityCancel(Activity* activity) {
+    if (activity->status() == Activity::cancelled()) return;
+    activity->statusIs(Activity::cancelled());
+    if (!activity->queued_) return;
+    tombstones_++;
+    size_t scheduled = scheduledActivities_->size() + periodicActivities_->size();
+    if (tombstones_ >= minTombstones && 2 * tombstones_ >= scheduled) {
+        DEBUG_LOG << "Compacting " << tombstones_ << " cancelled of " << scheduled << " scheduled activities" << std::endl;
+        scheduledActivities_->compact();
+        periodicActivities_->compact();
+        tombstones_ = 0;
+    }
+}
+
 void Manager::lastActivityIs(ActivityPtr activity) {
-    scheduledActivities_.push(activity);
+    activity->save();
+    Journal::save(this, sequence_);
+    activity->sequence_ = sequence_++;
+    activity->queued_ = true;
+    if (activity->period() > 0) {
+        periodicActivities_->push(activity);
+    } else {
+        scheduledActivities_->push(activity);
+    }
+}
+
+void Manager::coroutineNew(Coroutine* coroutine) {
+    ActivityPtr activity = this->activity(anonymousActivityNew());
+    activity->lastNotifieeIs(coroutine);
+    activity->coroutine_ = true;
+    activity->nextTime_ = now_;
+    activity->tick_ = now_.tick();
+    activity->coroutineRun();
+}
+
+void Manager::coroutineNew(Coroutine* coroutine, Time t, Priority priority) {
+    ActivityPtr activity = this->activity(anonymousActivityNew());
+    activity->lastNotifieeIs(coroutine);
+    activity->coroutine_ = true;
+    activity->nextTime_ = t;
+    activity->tick_ = t.tick();
+    activity->priority_ = priority;
+    activity->status_ = Activity::nextTimeScheduled();
+    lastActivityIs(activity);
+}
+
+void Manager::coroutineResume(Coroutine* coroutine) {
+    ActivityPtr activity = coroutine->notifier();
+    activity->save();
+    activity->nextTime_ = now_;
+    activity->tick_ = now_.tick();
+    activity->coroutineRun();
+}
+
+void Manager::coroutineDel(Coroutine* coroutine) {
+    activityDel(coroutine->notifier()->handle());
+}
+
+void Manager::deferredNew(Lane* lane) {
+    Journal::save(this, sequence_);
+    Journal::savePushBack(this, deferred_);
+    deferred_.push_back(Deferred(lane, now_, sequence_++));
+}
+
+/* True when the first deferred piece of work runs before next, or before
+ * the arrivals at the front when arriving */
+bool Manager::deferredFirst(const ActivityPtr& next, bool arriving) const {
+    Tick tick = now_.tick();
+    // arrivals of the current time join the queues first
+    if (arriving) return arrivals_.front().tick > tick;
+    if (next == NULL || next->tick() > tick) return true;
+    uint8_t priority = next->priority().value();
+    if (priority != deferredPriority) return priority > deferredPriority;
+    return next->sequence() > deferred_[deferredHead_].sequence;
+}
+
+void Manager::deferredRun() {
+    LanePtr lane = deferred_[deferredHead_].lane;
+    now_ = deferred_[deferredHead_].time;
+    Journal::save(this, deferredHead_);
+    deferredHead_++;
+    if (deferredHead_ == deferred_.size()) {
+        Journal::save(this, deferred_);
+        deferred_.clear();
+        deferredHead_ = 0;
+    }
+    events_++;
+    lane->deferredRun();
+}
+
+/* Every queued activity is either named or in the pool */
+vector<ActivityPtr> Manager::scheduledActivities() const {
+    vector<ActivityPtr> scheduled;
+    map<string, ActivityPtr>::const_iterator it;
+    for (it = activities_.begin(); it != activities_.end(); it++) {
+        if (it->second->queued_ && it->second->status() == Activity::nextTimeScheduled())
+            scheduled.push_back(it->second);
+    }
+    for (size_t i = 0; i < pool_.size(); i++) {
+        if (pool_[i] != NULL && pool_[i]->queued_ && pool_[i]->status() == Activity::nextTimeScheduled())
+            scheduled.push_back(pool_[i]);
+    }
+    // ActivityComp puts the last to run first
+    std::sort(scheduled.begin(), scheduled.end(), ActivityComp());
+    std::reverse(scheduled.begin(), scheduled.end());
+    return scheduled;
+}
+
+void Manager::batchDispatchIs(bool batchDispatch) {
+    batchDispatch_ = batchDispatch;
+}
+
+/* Earliest activity across the scheduling queue and the timing wheel, or
+ * NULL when nothing is scheduled.
+ */
+ActivityPtr Manager::scheduledTop(bool& periodic) {
+    periodic = scheduledActivities_->empty();
+    if (periodic) {
+        if (periodicActivities_->empty()) return NULL;
+        return periodicActivities_->top();
+    }
+    ActivityPtr top = scheduledActivities_->top();
+    if (!periodicActivities_->empty()) {
+        ActivityPtr nextPeriodic = periodicActivities_->top();
+        if (ActivityComp()(top, nextPeriodic)) {
+            periodic = true;
+            return nextPeriodic;
+        }
+    }
+    return top;
+}
+
+Tick Manager::nextTick() {
+    inboxMerge();
+    bool periodic;
+    ActivityPtr top = scheduledTop(periodic);
+    Tick tick = top == NULL ? maxTick : top->tick();
+    if (!arrivals_.empty() && arrivals_.front().tick < tick) tick = arrivals_.front().tick;
+    return tick;
+}
+
+Telemetry Manager::telemetry() const {
+    Telemetry telemetry = telemetry_;
+#ifdef ACTIVITY_TELEMETRY
+    for (size_t i = 0; i < reactorCounts_.size(); i++) {
+        Telemetry::Reactor& reactor = telemetry.reactors[reactorName(reactorCounts_[i].type)];
+        reactor.events += reactorCounts_[i].count.events;
+        reactor.nanoseconds += reactorCounts_[i].count.nanoseconds;
+    }
+#endif
+    return telemetry;
+}
+
+void Manager::depthCount(uint64_t events) {
+    uint64_t depth = scheduledActivities_->size() + periodicActivities_->size();
+    uint32_t bucket = depth == 0 ? 0 : 64 - __builtin_clzll(depth);
+    if (bucket >= Telemetry::depthBuckets) bucket = Telemetry::depthBuckets - 1;
+    telemetry_.depth[bucket] += events;
+    telemetry_.events += events;
+}
+
+void Manager::reactorCount(Activity::Notifiee* notifiee, uint64_t events, uint64_t nanoseconds) {
+    const std::type_info* type = notifiee == NULL ? NULL : &typeid(*notifiee);
+    for (size_t i = 0; i < reactorCounts_.size(); i++) {
+        if (reactorCounts_[i].type != type) continue;
+        reactorCounts_[i].count.events += events;
+        reactorCounts_[i].count.nanoseconds += nanoseconds;
+        return;
+    }
+    ReactorCount count;
+    count.type = type;
+    count.count.events = events;
+    count.count.nanoseconds = nanoseconds;
+    reactorCounts_.push_back(count);
+}
+
+void Manager::scheduledPop(ActivityPtr activity, bool periodic) {
+    if (periodic) periodicActivities_->pop();
+    else scheduledActivities_->pop();
+    activity->save();
+    activity->queued_ = false;
+    if (activity->status() == Activity::cancelled() && tombstones_ > 0) tombstones_--;
+}
+
+/* A periodic activity left free goes straight back on the wheel */
+void Manager::periodicReschedule(ActivityPtr activity) {
+    if (activity->period() > 0 && activity->status() == Activity::free()) {
+        activity->save();
+        Journal::save(this, sequence_);
+        activity->nextTime_ = activity->nextTime_.value() + activity->period().value();
+        activity->tick_ = activity->nextTime_.tick();
+        activity->sequence_ = sequence_++;
+        activity->status_ = Activity::nextTimeScheduled();
+        activity->queued_ = true;
+        periodicActivities_->push(activity);
+    }
+}
+
+static void runActivities(const vector<ActivityPtr>& batch) {
+    for (size_t i = 0; i < batch.size(); i++) {
+        ActivityPtr activity = batch[i];
+        // an earlier activity of the batch may have cancelled this one
+        if (activity->status() != Activity::nextTimeScheduled()) continue;
+        activity->statusIs(Activity::executing());
+        activity->statusIs(Activity::free());
+    }
+}
+
+void Activity::Notifiee::onStatusBatch(const vector<ActivityPtr>& batch) {
+    runActivities(batch);
+}
+
+static bool sameType(const Activity::NotifieePtr& a, const Activity::NotifieePtr& b) {
+    if (a == NULL || b == NULL) return a == b;
+    return typeid(*a.ptr()) == typeid(*b.ptr());
+}
+
+/* Take every other activity of first's (time, priority) class off the
+ * queues and dispatch the class one notifiee type at a time, in the order
+ * each type first appears.
+ */
+void Manager::batchRun(ActivityPtr first) {
+    batch_.clear();
+    batch_.push_back(first);
+    ActivityPtr next;
+    bool periodic;
+    while ((next = scheduledTop(periodic)) != NULL &&
+           next->tick() == first->tick() && next->priority() == first->priority()) {
+        scheduledPop(next, periodic);
+        if (next->status() == Activity::nextTimeScheduled()) batch_.push_back(next);
+    }
+    DEBUG_LOG << "Dispatching batch of " << batch_.size() << " activities" << std::endl;
+    events_ += batch_.size();
+    for (size_t i = 0; i < batch_.size(); i++) {
+        if (batch_[i] == NULL) continue;
+        Activity::NotifieePtr notifiee = batch_[i]->notifiee();
+        group_.clear();
+        for (size_t j = i; j < batch_.size(); j++) {
+            if (batch_[j] == NULL || !sameType(notifiee, batch_[j]->notifiee())) continue;
+            group_.push_back(batch_[j]);
+            batch_[j] = NULL;
+        }
+#ifdef ACTIVITY_TELEMETRY
+        depthCount(group_.size());
+        uint64_t start = WallTime::now().value();
+#endif
+        if (notifiee != NULL) notifiee->onStatusBatch(group_);
+        else runActivities(group_);
+#ifdef ACTIVITY_TELEMETRY
+        reactorCount(notifiee.ptr(), group_.size(), WallTime::now().value() - start);
+#endif
+        for (size_t j = 0; j < group_.size(); j++) periodicReschedule(group_[j]);
+    }
+}
+
+/* Run an activity just taken off the queues */
+void Manager::activityRun(ActivityPtr activity) {
+    events_++;
+#ifdef ACTIVITY_TELEMETRY
+    depthCount(1);
+    Activity::NotifieePtr notifiee = activity->notifiee_;
+    uint64_t start = WallTime::now().value();
+#endif
+    if (activity->coroutine_) {
+        activity->coroutineRun();
+    } else {
+        activity->statusIs(Activity::executing());
+        activity->statusIs(Activity::free());
+        periodicReschedule(activity);
+    }
+#ifdef ACTIVITY_TELEMETRY
+    reactorCount(notifiee.ptr(), 1, WallTime::now().value() - start);
+#endif
 }
 
 void Manager::nowIs(Time t) {
+    nowIs(t, unboundedEvents, WallTime::never());
+}
+
+Time Manager::nowIs(Time t, uint64_t maxEvents, WallTime deadline) {
+#ifdef ACTIVITY_TELEMETRY
+    uint64_t start = WallTime::now().value();
+    Time from = now_;
+#endif
 
     DEBUG_LOG << std::endl;
     DEBUG_LOG << "==================================" << std::endl;
@@ -78,23 +1193,467 @@ void Manager::nowIs(Time t) {
     DEBUG_LOG << std::endl;
 
     //find the most recent activites to run and run them in order
-    while (!scheduledActivities_.empty()) {
-        //figure out the next activity to run
-        ActivityPtr nextToRun = scheduledActivities_.top();
+    Tick limit = t.tick();
+    Journal* journal = Journal::current();
+    bool timed = deadline < WallTime::never();
+    uint64_t first = events_;
+    // tick of the time step under way
+    Tick step = -maxTick;
+    Time reached = t;
+    ActivityPtr nextToRun;
+    bool periodic;
+    while (true) {
+        inboxMerge();
+        nextToRun = scheduledTop(periodic);
+        // activities sent by other partitions join the queues once their
+        // time comes, ahead of what runs at that time
+        bool arriving = !arrivals_.empty() && (nextToRun == NULL || arrivals_.front().tick <= nextToRun->tick());
+        // deferred work belongs to the time step under way
+        if (deferredHead_ < deferred_.size() && deferredFirst(nextToRun, arriving)) {
+            deferredRun();
+            continue;
+        }
+        if (!arriving && nextToRun == NULL) break;
+        Tick tick = arriving ? arrivals_.front().tick : nextToRun->tick();
         //if the next time is greater than the specified time, break
         //the loop
-        if (nextToRun->nextTime() > t) {
-                break;
+        if (tick > limit || tick > horizon_) break;
+        // a bound only ends the run between time steps
+        if (tick > step && events_ > first &&
+            (events_ - first >= maxEvents || (timed && WallTime::now() >= deadline))) {
+            reached = now_;
+            break;
+        }
+        if (paceGate_ && tick > step)
+            paceGate_->timeIs(arriving ? arrivals_.front().time : nextToRun->nextTime());
+        step = tick;
+        if (journal) journal->markIs(tick);
+        if (arriving) {
+            arrivalsRun(tick);
+            continue;
         }
         now_ = nextToRun->nextTime();
         //run the minimum time activity and remove it from the queue
-        scheduledActivities_.pop();
-        if(nextToRun->status() == Activity::nextTimeScheduled()){
-            nextToRun->statusIs(Activity::executing());
-            nextToRun->statusIs(Activity::free());
+        scheduledPop(nextToRun, periodic);
+        if (nextToRun->status() != Activity::nextTimeScheduled()) continue;
+        if (batchDispatch_) {
+            batchRun(nextToRun);
+            continue;
+        }
+        activityRun(nextToRun);
+    }
+    //syncrhonize the time
+    if (paceGate_ && reached > now_) paceGate_->timeIs(reached);
+    now_ = reached;
+#ifdef ACTIVITY_TELEMETRY
+    if (reached > from) telemetry_.simulatedHours += reached.value() - from.value();
+    telemetry_.nanoseconds += WallTime::now().value() - start;
+#endif
+    return reached;
+}
+
+void Manager::activityIs(const Arrival& arrival) {
+    ActivityPtr activity = this->activity(anonymousActivityNew());
+    activity->lastNotifieeIs(arrival.notifiee.ptr());
+    activity->nextTimeIs(arrival.time);
+    activity->priorityIs(arrival.priority);
+    activity->statusIs(Activity::nextTimeScheduled());
+    lastActivityIs(activity);
+}
+
+void Manager::externalActivityNew(Time t, Priority priority, Activity::Notifiee* notifiee) {
+    Posted* posted = new Posted(t, priority, notifiee);
+#ifdef FWK_ATOMIC_REFS
+    Posted* head;
+    do {
+        head = __atomic_load_n(&inbox_, __ATOMIC_RELAXED);
+        posted->next = head;
+    } while (!__sync_bool_compare_and_swap(&inbox_, head, posted));
+#else
+    posted->next = inbox_;
+    inbox_ = posted;
+#endif
+}
+
+/* Schedule everything posted to the inbox so far, in posting order */
+void Manager::inboxMerge() {
+#ifdef FWK_ATOMIC_REFS
+    // a relaxed load keeps the common case, an empty inbox, cheap
+    if (__atomic_load_n(&inbox_, __ATOMIC_RELAXED) == NULL) return;
+#else
+    if (inbox_ == NULL) return;
+#endif
+    // rolling back would lose what was taken in
+    if (Journal::current() != NULL) return;
+#ifdef FWK_ATOMIC_REFS
+    Posted* posted = __sync_lock_test_and_set(&inbox_, (Posted*)NULL);
+#else
+    Posted* posted = inbox_;
+    inbox_ = NULL;
+#endif
+    Posted* ordered = NULL;
+    while (posted != NULL) {
+        Posted* next = posted->next;
+        posted->next = ordered;
+        ordered = posted;
+        posted = next;
+    }
+    while (ordered != NULL) {
+        Posted* next = ordered->next;
+        Time t = ordered->time < now_ ? now_ : ordered->time;
+        activityIs(Arrival(t, ordered->priority, ordered->notifiee.ptr(), 0, 0));
+        delete ordered;
+        ordered = next;
+    }
+}
+
+/* Restore the order of arrivals_ after arrivals were appended at from */
+void Manager::arrivalsMerge(size_t from) {
+    sort(arrivals_.begin() + from, arrivals_.end());
+    inplace_merge(arrivals_.begin(), arrivals_.begin() + from, arrivals_.end());
+}
+
+void Manager::arrivalsRun(Tick tick) {
+    while (!arrivals_.empty() && arrivals_.front().tick <= tick) {
+        Arrival arrival = arrivals_.front();
+        Journal::savePopFront(this, arrivals_);
+        arrivals_.pop_front();
+        activityIs(arrival);
+    }
+}
+
+/* Empty the queues into restored_ ahead of a rollback, which changes the
+ * fields they are ordered by */
+void Manager::queuesDrain() {
+    while (!scheduledActivities_->empty()) {
+        restored_.push_back(scheduledActivities_->top());
+        scheduledActivities_->pop();
+    }
+    while (!periodicActivities_->empty()) {
+        restored_.push_back(periodicActivities_->top());
+        periodicActivities_->pop();
+    }
+}
+
+static bool byAddress(const ActivityPtr& a, const ActivityPtr& b) {
+    return a.ptr() < b.ptr();
+}
+
+static bool sameAddress(const ActivityPtr& a, const ActivityPtr& b) {
+    return a.ptr() == b.ptr();
+}
+
+/* Queue the restored activities that are scheduled, on fresh queues since
+ * time has gone back */
+void Manager::queuesRebuild() {
+    delete scheduledActivities_;
+    delete periodicActivities_;
+    scheduledActivities_ = queueNew();
+    periodicActivities_ = new TimingWheel();
+    sort(restored_.begin(), restored_.end(), byAddress);
+    restored_.erase(unique(restored_.begin(), restored_.end(), sameAddress), restored_.end());
+    for (size_t i = 0; i < restored_.size(); i++) {
+        ActivityPtr activity = restored_[i];
+        if (!activity->queued_) continue;
+        // tombstones are left behind
+        if (activity->status() == Activity::cancelled()) {
+            activity->queued_ = false;
+            continue;
+        }
+        if (activity->period() > 0) periodicActivities_->push(activity);
+        else scheduledActivities_->push(activity);
+    }
+    restored_.clear();
+    tombstones_ = 0;
+}
+
+/*
+ * ParallelManager
+ *
+ */
+
+static Time tickTime(Tick tick) {
+    return Time((double)tick / ticksPerHour);
+}
+
+#ifdef FWK_ATOMIC_REFS
+/* One thread per partition. The coordinating thread starts a phase of a
+ * window at start_ and waits for every partition to finish it at done_.
+ */
+class ParallelManager::Workers {
+public:
+    Workers(ParallelManager* owner) : owner_(owner), stop_(false) {
+        uint32_t count = owner->partitions();
+        pthread_barrier_init(&start_, NULL, count + 1);
+        pthread_barrier_init(&done_, NULL, count + 1);
+        threads_.resize(count);
+        for (uint32_t i = 0; i < count; i++) {
+            threads_[i].workers = this;
+            threads_[i].index = i;
+            pthread_create(&threads_[i].thread, NULL, &Workers::run, &threads_[i]);
+        }
+    }
+    ~Workers() {
+        stop_ = true;
+        pthread_barrier_wait(&start_);
+        for (size_t i = 0; i < threads_.size(); i++) pthread_join(threads_[i].thread, NULL);
+        pthread_barrier_destroy(&start_);
+        pthread_barrier_destroy(&done_);
+    }
+    void phaseRun() {
+        pthread_barrier_wait(&start_);
+        pthread_barrier_wait(&done_);
+    }
+private:
+    struct Thread {
+        Workers* workers;
+        uint32_t index;
+        pthread_t thread;
+    };
+    static void* run(void* arg) {
+        Thread* self = (Thread*)arg;
+        Workers* workers = self->workers;
+        while (true) {
+            pthread_barrier_wait(&workers->start_);
+            if (workers->stop_) break;
+            if (workers->owner_->phase_ == rollback_) workers->owner_->partitionRollback(self->index);
+            else workers->owner_->partitionRun(self->index);
+            pthread_barrier_wait(&workers->done_);
+        }
+        return NULL;
+    }
+    ParallelManager* owner_;
+    bool stop_;
+    pthread_barrier_t start_;
+    pthread_barrier_t done_;
+    vector<Thread> threads_;
+};
+#endif
+
+ParallelManager::ParallelManager(ManagerPtr coordinator, uint32_t partitions) :
+    coordinator_(coordinator), lookahead_(1), optimisticWindow_(0), sending_(0), sent_(partitions, 0),
+    sentTicks_(partitions, maxTick), pendingTick_(maxTick), inWindow_(false), windowEnd_(0),
+    rollbackTick_(0), windows_(0), rollbacks_(0), failed_(partitions, 0), phase_(run_),
+    simulatedHours_(0), nanoseconds_(0), workers_(NULL) {
+    for (uint32_t i = 0; i < partitions; i++) {
+        ManagerPtr manager = Manager::ManagerIs(coordinator->queuePolicy());
+        manager->batchDispatchIs(coordinator->batchDispatch());
+        manager->nowIs(coordinator->now());
+        partitions_.push_back(manager);
+    }
+    outboxes_[0].resize(partitions * partitions);
+    outboxes_[1].resize(partitions * partitions);
+}
+
+ParallelManager::~ParallelManager() {
+#ifdef FWK_ATOMIC_REFS
+    delete workers_;
+#endif
+    for (size_t i = 0; i < journals_.size(); i++) delete journals_[i];
+}
+
+void ParallelManager::lookaheadIs(Time lookahead) {
+    Tick tick = lookahead.tick();
+    lookahead_ = tick < 1 ? 1 : tick;
+}
+
+void ParallelManager::optimisticWindowIs(Time window) {
+    Tick tick = window.tick();
+    optimisticWindow_ = tick < 0 ? 0 : tick;
+    if (optimisticWindow_ == 0 || !journals_.empty()) return;
+    for (size_t i = 0; i < partitions_.size(); i++) journals_.push_back(new Journal());
+}
+
+void ParallelManager::batchDispatchIs(bool batchDispatch) {
+    coordinator_->batchDispatchIs(batchDispatch);
+    for (size_t i = 0; i < partitions_.size(); i++) partitions_[i]->batchDispatchIs(batchDispatch);
+}
+
+void ParallelManager::activityNew(uint32_t from, uint32_t to, Time time, Priority priority,
+                                  Activity::Notifiee* notifiee) {
+    Manager* sender = partitions_[from].ptr();
+    Manager::Arrival arrival(time, priority, notifiee, from, sent_[from]);
+    // outside a window, or within one partition, nothing runs concurrently
+    if (!inWindow_ || from == to) {
+        partitions_[to]->activityIs(arrival);
+        return;
+    }
+    Journal::save(this, sent_[from]);
+    sent_[from]++;
+    Tick sendTick = sender->now().tick();
+    Tick earliest = optimisticWindow_ > 0 ? sendTick : windowEnd_;
+    if (arrival.tick <= earliest) {
+        cerr << "Activity sent from partition " << from << " to " << to
+             << " inside the lookahead; delayed to tick " << earliest + 1 << endl;
+        arrival.time = tickTime(earliest + 1);
+        arrival.tick = earliest + 1;
+    }
+    // the window will be rolled back to the arrival; the sender has no
+    // need to run past it
+    if (arrival.tick <= windowEnd_ && arrival.tick - 1 < sender->horizon_) {
+        sender->horizon_ = arrival.tick - 1;
+    }
+    outbox(sending_, from, to).push_back(Message(arrival, sendTick));
+    if (arrival.tick < sentTicks_[from]) sentTicks_[from] = arrival.tick;
+}
+
+/* Take in the messages sent to the partition during the previous window,
+ * then run it to the end of this one.
+ */
+void ParallelManager::partitionRun(uint32_t index) {
+    Manager* manager = partitions_[index].ptr();
+    try {
+        size_t queued = manager->arrivals_.size();
+        for (uint32_t from = 0; from < partitions_.size(); from++) {
+            vector<Message>& inbox = outbox(sending_ ^ 1, from, index);
+            for (size_t i = 0; i < inbox.size(); i++) manager->arrivals_.push_back(inbox[i].arrival);
+            inbox.clear();
+        }
+        manager->arrivalsMerge(queued);
+        manager->horizon_ = maxTick;
+        if (optimisticWindow_ > 0) Journal::currentIs(journals_[index]);
+        manager->nowIs(tickTime(windowEnd_));
+    }
+    catch(...){
+        failed_[index] = 1;
+    }
+    Journal::currentIs(NULL);
+}
+
+/* Undo the partition's activities from rollbackTick_ on */
+void ParallelManager::partitionRollback(uint32_t index) {
+    Manager* manager = partitions_[index].ptr();
+    Journal* journal = journals_[index];
+    if (journal->markTick() >= rollbackTick_) {
+        manager->queuesDrain();
+        journal->rollbackIs(rollbackTick_);
+        manager->queuesRebuild();
+    }
+    manager->now_ = tickTime(rollbackTick_ - 1);
+}
+
+void ParallelManager::phaseRun(Phase phase) {
+    phase_ = phase;
+#ifdef FWK_ATOMIC_REFS
+    if (workers_ == NULL) workers_ = new Workers(this);
+    workers_->phaseRun();
+#else
+    for (uint32_t i = 0; i < partitions_.size(); i++) {
+        if (phase == rollback_) partitionRollback(i);
+        else partitionRun(i);
+    }
+#endif
+}
+
+void ParallelManager::windowRun(Tick end) {
+    DEBUG_LOG << "Window to tick " << end << std::endl;
+    windowEnd_ = end;
+    inWindow_ = true;
+    phaseRun(run_);
+    inWindow_ = false;
+    windows_++;
+    pendingTick_ = maxTick;
+    for (uint32_t i = 0; i < partitions_.size(); i++) {
+        if (sentTicks_[i] < pendingTick_) pendingTick_ = sentTicks_[i];
+        sentTicks_[i] = maxTick;
+    }
+    if (optimisticWindow_ > 0) {
+        // everything before the earliest message is final
+        if (pendingTick_ <= end) {
+            DEBUG_LOG << "Rolling back to tick " << pendingTick_ << std::endl;
+            rollbackTick_ = pendingTick_;
+            phaseRun(rollback_);
+            rollbacks_++;
+            pendingTick_ = maxTick;
+            for (size_t i = 0; i < outboxes_[sending_].size(); i++) {
+                vector<Message>& box = outboxes_[sending_][i];
+                size_t kept = 0;
+                for (size_t j = 0; j < box.size(); j++) {
+                    if (box[j].sendTick >= rollbackTick_) continue;
+                    if (box[j].arrival.tick < pendingTick_) pendingTick_ = box[j].arrival.tick;
+                    box[kept++] = box[j];
+                }
+                box.erase(box.begin() + kept, box.end());
+            }
+        }
+        for (size_t i = 0; i < journals_.size(); i++) journals_[i]->entriesDel();
+    }
+    sending_ ^= 1;
+    for (uint32_t i = 0; i < partitions_.size(); i++) {
+        if (!failed_[i]) continue;
+        failed_[i] = 0;
+        stringstream s;
+        s << "Activity of partition " << i << " failed";
+        throw Fwk::InternalException(s.str());
+    }
+}
+
+Telemetry ParallelManager::telemetry() const {
+    Telemetry telemetry = coordinator_->telemetry();
+    for (size_t i = 0; i < partitions_.size(); i++) telemetry.countsInc(partitions_[i]->telemetry());
+    telemetry.simulatedHours = simulatedHours_;
+    telemetry.nanoseconds = nanoseconds_;
+    return telemetry;
+}
+
+uint64_t ParallelManager::events() const {
+    uint64_t events = coordinator_->events();
+    for (size_t i = 0; i < partitions_.size(); i++) events += partitions_[i]->events();
+    return events;
+}
+
+void ParallelManager::nowIs(Time t) {
+    nowIs(t, Manager::unboundedEvents, WallTime::never());
+}
+
+Time ParallelManager::nowIs(Time t, uint64_t maxEvents, WallTime deadline) {
+#ifdef ACTIVITY_TELEMETRY
+    uint64_t start = WallTime::now().value();
+    Time from = now();
+#endif
+    Tick limit = t.tick();
+    bool bounded = maxEvents != Manager::unboundedEvents || deadline < WallTime::never();
+    uint64_t first = bounded ? events() : 0;
+    Time reached = t;
+    while (true) {
+        Tick coordinatorNext = coordinator_->nextTick();
+        Tick next = coordinatorNext < pendingTick_ ? coordinatorNext : pendingTick_;
+        for (size_t i = 0; i < partitions_.size(); i++) {
+            Tick tick = partitions_[i]->nextTick();
+            if (tick < next) next = tick;
+        }
+        if (next > limit) break;
+        // a bound ends the run once everything before next has run, which
+        // is not the case while partitions still share the coordinator's
+        // last time
+        if (bounded && coordinator_->now().tick() < next) {
+            uint64_t run = events() - first;
+            if (run > 0 && (run >= maxEvents || WallTime::now() >= deadline)) {
+                reached = tickTime(next - 1);
+                break;
+            }
+        }
+        if (next == coordinatorNext) {
+            coordinator_->nowIs(tickTime(next));
+            continue;
         }
+        // the window closes before anything it sends can arrive, or
+        // spans the optimistic window, and before the coordinator's next
+        // activity
+        Tick width = optimisticWindow_ > 0 ? optimisticWindow_ : lookahead_;
+        Tick end = limit;
+        if (end - next > width - 1) end = next + width - 1;
+        if (end > coordinatorNext - 1) end = coordinatorNext - 1;
+        if (coordinator_->paceGate_) coordinator_->paceGate_->timeIs(tickTime(next));
+        windowRun(end);
     }
     //syncrhonize the time
-    now_ = t;
+    coordinator_->nowIs(reached);
+    for (size_t i = 0; i < partitions_.size(); i++) partitions_[i]->nowIs(reached);
+#ifdef ACTIVITY_TELEMETRY
+    if (reached > from) simulatedHours_ += reached.value() - from.value();
+    nanoseconds_ += WallTime::now().value() - start;
+#endif
+    return reached;
 }
 }
@@ -1,6 +1,9 @@
 #include <stdlib.h>
 #include <iostream>
 #include <stack>
+#include <algorithm>
+#include <limits>
+#include <new>
 #include "engine/Engine.h"
 #include "logging.h"
 
@@ -12,14 +15,79 @@ using namespace Shipping;
  */
 
 Location::Location(EntityID name, EntityType type): 
-    Fwk::NamedInterface(name), entityType_(type){}
+    Fwk::NamedInterface(name), entityType_(type), partition_(0){}
 
-int uniqueInt = 0;
+// id of the next shipment
+static uint64_t shipmentIdNext = 1;
 
-string uniqueName() {
+ShipmentPtr Shipment::ShipmentNew(ShipmentSlab* slab) {
+#ifdef FWK_ATOMIC_REFS
+    // partitions inject shipments concurrently
+    return ShipmentNew(__sync_fetch_and_add(&shipmentIdNext, 1), slab);
+#else
+    return ShipmentNew(shipmentIdNext++, slab);
+#endif
+}
+
+ShipmentPtr Shipment::ShipmentNew(uint64_t id, ShipmentSlab* slab) {
+    if (id >= shipmentIdNext) shipmentIdNext = id + 1;
+    if (!slab) return new Shipment(id, NULL);
+    return new (slab->slotNew()) Shipment(id, slab);
+}
+
+void Shipment::onZeroReferences() const {
+    if (!slab_) {
+        delete this;
+        return;
+    }
+    // the slab must outlive the slot handed back to it
+    ShipmentSlabPtr slab = slab_;
+    Shipment* slot = const_cast<Shipment*>(this);
+    slot->~Shipment();
+    slab->slotDel(slot);
+}
+
+ShipmentSlab::~ShipmentSlab() {
+    for (size_t i = 0; i < blocks_.size(); i++) ::operator delete(blocks_[i]);
+}
+
+void* ShipmentSlab::slotNew() {
+#ifdef FWK_ATOMIC_REFS
+    // take over the slots handed back since free_ last ran out
+    if (free_ == NULL) free_ = __sync_lock_test_and_set(&returned_, (void*)NULL);
+#endif
+    if (free_ == NULL) {
+        char* block = static_cast<char*>(::operator new(sizeof(Shipment) * blockSlots));
+        blocks_.push_back(block);
+        // the lowest slot comes off first
+        for (size_t i = blockSlots; i > 0; i--) {
+            void* slot = block + (i - 1) * sizeof(Shipment);
+            *(void**)slot = free_;
+            free_ = slot;
+        }
+    }
+    void* slot = free_;
+    free_ = *(void**)slot;
+    return slot;
+}
+
+void ShipmentSlab::slotDel(void* slot) {
+#ifdef FWK_ATOMIC_REFS
+    // the last reference may drop on another partition's thread
+    void* head;
+    do {
+        head = returned_;
+        *(void**)slot = head;
+    } while (!__sync_bool_compare_and_swap(&returned_, head, slot));
+#else
+    *(void**)slot = free_;
+    free_ = slot;
+#endif
+}
+
+string Shipment::name() const {
     stringstream s;
-    s << uniqueInt;
-    uniqueInt += 1;
+    s << id_;
     return s.str();
 }
 
@@ -121,10 +189,13 @@ void Customer::transferRateIs(ShipmentPerDay spd){
     }
 }
 
-Time Customer::nextShipmentTime() const {
+Time Customer::shipmentPeriod() const {
     // division by zero is defined and results in +inf, which is desired
-    Time shipmentFrequency = 24.0/(static_cast<double>(transferRate().value()));
-    return manager_->now().value()+shipmentFrequency.value();
+    return 24.0/(static_cast<double>(transferRate().value()));
+}
+
+Time Customer::nextShipmentTime() const {
+    return manager_->now().value()+shipmentPeriod().value();
 }
 
 void Customer::shipmentSizeIs(PackageNum pn) {
@@ -221,6 +292,9 @@ void CustomerReactor::onShipment(ShipmentPtr shipment) {
         CustomerPtr cust = dynamic_cast<Customer*> (shipment->destination().ptr());
         DEBUG_LOG << "  Customer is destination; updating stats: \n";
         DEBUG_LOG << "     latency: " << Hour(manager_->now().value() - shipment->startTime().value()).value() << std::endl;
+        Activity::Journal::save(cust.ptr(), cust->totalLatency_);
+        Activity::Journal::save(cust.ptr(), cust->totalCost_);
+        Activity::Journal::save(cust.ptr(), cust->shipmentsReceived_);
         cust->totalLatency_ = Hour(cust->totalLatency_.value() + manager_->now().value() - shipment->startTime().value());
         cust->totalCost_ = cust->totalCost_ + shipment->cost();
         cust->shipmentsReceived_ ++;
@@ -244,45 +318,75 @@ void CustomerReactor::onShipment(ShipmentPtr shipment) {
     throw Fwk::InternalException("Shipment ended up at wrong customer.");
 }
 
+/* Name of the injection activity shared by the customers that inject
+ * every period ticks, at ticks congruent to phase */
+static string injectGroupName(Activity::Tick period, Activity::Tick phase) {
+    stringstream s;
+    s << "inject every " << period << " at " << phase;
+    return s.str();
+}
+
+void CustomerReactor::injectGroupLeave() {
+    if (injectGroup_.empty()) return;
+    Activity::ActivityPtr activity = manager_->activity(injectGroup_);
+    injectGroup_ = "";
+    if (!activity) return;
+    InjectActivityReactor* iar = dynamic_cast<InjectActivityReactor*>(activity->notifiee().ptr());
+    iar->sourceDel(dynamic_cast<Customer*>(notifier().ptr()));
+    if (iar->sources() > 0) return;
+    manager_->activityCancel(activity->name());
+    manager_->activityDel(activity->name());
+}
+
 void CustomerReactor::checkAndCreateInjectActivity() {
     if (!(transferRateSet_ && shipmentSizeSet_ && destinationSet_)) return;
 
     DEBUG_LOG << "Criteria fully specified. Setting up shipment injection activity...\n";
     CustomerPtr cust = dynamic_cast<Customer*>(notifier().ptr());
   
-    // Clear the old activity
-    Activity::ActivityPtr activity = manager_->activity(notifier_->name());
-    if(activity){
-        activity->statusIs(Activity::Activity::cancelled());
-        manager_->activityDel(activity->name());
-    }
-
-    activity = manager_->activityNew(notifier_->name());
-    InjectActivityReactor* iar = new InjectActivityReactor();
-    iar->managerIs(manager_);
-    iar->sourceIs(cust);
-    activity->priorityIs(2);
-    activity->lastNotifieeIs(iar);
-    activity->nextTimeIs(cust->nextShipmentTime());
-    activity->statusIs(Activity::Activity::nextTimeScheduled());
-    manager_->lastActivityIs(activity);
+    // Leave the old group
+    injectGroupLeave();
+    if (cust->transferRate().value() == 0) return;
+
+    // Join the customers injecting at the same times
+    Activity::Time next = cust->nextShipmentTime();
+    Activity::Tick period = cust->shipmentPeriod().tick();
+    injectGroup_ = injectGroupName(period, period > 0 ? next.tick() % period : next.tick());
+    Activity::ActivityPtr activity = manager_->activity(injectGroup_);
+    if (!activity) {
+        activity = manager_->activityNew(injectGroup_);
+        InjectActivityReactor* iar = new InjectActivityReactor();
+        iar->managerIs(manager_);
+        iar->slabIs(network_->shipmentSlab(cust->partition()));
+        activity->priorityIs(2);
+        // the manager reschedules the injection every period
+        activity->periodIs(cust->shipmentPeriod());
+        activity->lastNotifieeIs(iar);
+        activity->nextTimeIs(next);
+        activity->statusIs(Activity::Activity::nextTimeScheduled());
+        manager_->lastActivityIs(activity);
+    }
+    dynamic_cast<InjectActivityReactor*>(activity->notifiee().ptr())->sourceIs(cust);
+}
+
+void InjectActivityReactor::sourceDel(CustomerPtr customer) {
+    std::vector<CustomerPtr>::iterator it = std::find(sources_.begin(), sources_.end(), customer);
+    if (it != sources_.end()) sources_.erase(it);
 }
 
 void InjectActivityReactor::onStatus() {
     if (notifier_->status() == Activity::Activity::executing()) {
-        ShipmentPtr shipment = new Shipment(uniqueName());
-        shipment->loadIs(source_->shipmentSize());
-        shipment->sourceIs(source_);
-        shipment->destinationIs(source_->destination());
-        shipment->startTimeIs(manager_->now());
-        // add shipment to location
-        source_->shipmentIs(shipment);
-    }
-    else if(notifier_->status() == Activity::Activity::free()){
-        DEBUG_LOG << source_->name() << " next shipment @ " << source_->nextShipmentTime().value() << ".\n";
-        notifier_->nextTimeIs(source_->nextShipmentTime());
-        notifier_->statusIs(Activity::Activity::nextTimeScheduled());
-        source_->manager()->lastActivityIs(notifier_);
+        for (size_t i = 0; i < sources_.size(); i++) {
+            CustomerPtr source = sources_[i];
+            ShipmentPtr shipment = Shipment::ShipmentNew(slab_.ptr());
+            shipment->loadIs(source->shipmentSize());
+            shipment->sourceIs(source);
+            shipment->destinationIs(source->destination());
+            shipment->startTimeIs(manager_->now());
+            // add shipment to location
+            source->shipmentIs(shipment);
+            DEBUG_LOG << source->name() << " next shipment @ " << source->nextShipmentTime().value() << ".\n";
+        }
     }
 }
 
@@ -437,11 +541,7 @@ void Segment::shipmentIs(ShipmentPtr shipment) {
     DEBUG_LOG << "Shipment " << shipment->name() << " arrived at segment " << this->name() << std::endl; 
 
     // add subshipments to queue
-    SubshipmentPtr s = new Subshipment("name");
-    s->shipmentIs(shipment);
-    s->shipmentOrderIs(Subshipment::other());
-    s->remainingLoadIs(shipment->load());
-    subshipmentEnqueue(s);
+    subshipmentEnqueue(Subshipment(shipment, shipment->load()));
 
     shipmentsRoutedInc();
 
@@ -455,25 +555,126 @@ void Segment::shipmentIs(ShipmentPtr shipment) {
     }
 }
 
-SubshipmentPtr Segment::subshipmentDequeue(PackageNum capacity) {
-    // return null if queue is empty
-    if (subshipmentQueue_.empty())
-        return NULL;
-    SubshipmentPtr lastSubshipment = subshipmentQueue_.front();
+void Segment::dequeueUpTo(PackageNum capacity, vector<Subshipment>& load) {
+    while (capacity > 0 && !subshipmentQueue_.empty()) {
+        Subshipment& next = subshipmentQueue_.front();
 
-    // remove subshipment if remaining packages can be delivered at once
-    if (capacity >= lastSubshipment->remainingLoad()) {
-        subshipmentQueue_.pop();
-        return lastSubshipment;
+        // remove subshipment if remaining packages can be delivered at once
+        if (capacity >= next.remainingLoad()) {
+            load.push_back(next);
+            capacity = capacity - next.remainingLoad();
+            Activity::Journal::savePopFront(this, subshipmentQueue_);
+            subshipmentQueue_.pop_front();
+            continue;
+        }
+
+        // otherwise take part of it; the journal restores the whole
+        // front, as if it had been replaced
+        load.push_back(Subshipment(next.shipment(), capacity));
+        Activity::Journal::savePopFront(this, subshipmentQueue_);
+        Activity::Journal::savePushFront(this, subshipmentQueue_);
+        next.remainingLoadIs(next.remainingLoad() - capacity);
+        break;
     }
+}
+
+void Segment::SubshipmentQueue::push_back(const Subshipment& s) {
+    if (size_ == slot_.size()) slotsIs(slot_.empty() ? 8 : 2 * slot_.size());
+    slot_[(head_ + size_) & (slot_.size() - 1)] = s;
+    size_++;
+}
 
-    // otherwise return partial shipment
-    SubshipmentPtr result = new Subshipment("name");
-    lastSubshipment->remainingLoadIs(lastSubshipment->remainingLoad() - capacity);
-    result->shipmentIs(lastSubshipment->shipment());
-    result->remainingLoadIs(capacity);
-    return result;
+void Segment::SubshipmentQueue::push_front(const Subshipment& s) {
+    if (size_ == slot_.size()) slotsIs(slot_.empty() ? 8 : 2 * slot_.size());
+    head_ = (head_ - 1) & (slot_.size() - 1);
+    slot_[head_] = s;
+    size_++;
+}
+
+/* Vacated slots drop their shipment */
+void Segment::SubshipmentQueue::pop_front() {
+    slot_[head_] = Subshipment();
+    head_ = (head_ + 1) & (slot_.size() - 1);
+    size_--;
+}
+
+void Segment::SubshipmentQueue::pop_back() {
+    back() = Subshipment();
+    size_--;
+}
 
+void Segment::SubshipmentQueue::clear() {
+    slot_.clear();
+    head_ = 0;
+    size_ = 0;
+}
+
+void Segment::SubshipmentQueue::slotsIs(size_t slots) {
+    vector<Subshipment> slot(slots);
+    for (size_t i = 0; i < size_; i++) slot[i] = (*this)[i];
+    slot_.swap(slot);
+    head_ = 0;
+}
+
+/* Fibonacci hashing: ids on one segment are often a stride apart, as
+ * customers inject in turn */
+size_t Segment::DeliveryMap::home(uint64_t id) const {
+    return (size_t)((id * 0x9E3779B97F4A7C15ULL) >> 32) & (slot_.size() - 1);
+}
+
+Segment::DeliveryMap::iterator Segment::DeliveryMap::find(uint64_t id) {
+    if (size_ == 0) return NULL;
+    for (size_t i = home(id); slot_[i].first != 0; i = (i + 1) & (slot_.size() - 1))
+        if (slot_[i].first == id) return &slot_[i];
+    return NULL;
+}
+
+uint32_t& Segment::DeliveryMap::operator[](uint64_t id) {
+    // at most half full
+    if (2 * (size_ + 1) > slot_.size()) slotsIs(slot_.empty() ? 8 : 2 * slot_.size());
+    size_t i = home(id);
+    for (; slot_[i].first != 0; i = (i + 1) & (slot_.size() - 1))
+        if (slot_[i].first == id) return slot_[i].second;
+    slot_[i] = value_type(id, 0);
+    size_++;
+    return slot_[i].second;
+}
+
+/* Shift later entries of the run back into the freed slot, so that
+ * lookups need no tombstones */
+void Segment::DeliveryMap::erase(uint64_t id) {
+    iterator it = find(id);
+    if (!it) return;
+    size_t mask = slot_.size() - 1;
+    size_t hole = it - &slot_[0];
+    for (size_t i = (hole + 1) & mask; slot_[i].first != 0; i = (i + 1) & mask) {
+        // an entry may fill the hole if the hole lies between its home
+        // slot and where it is
+        size_t h = home(slot_[i].first);
+        if (((i - h) & mask) >= ((i - hole) & mask)) {
+            slot_[hole] = slot_[i];
+            hole = i;
+        }
+    }
+    slot_[hole] = value_type(0, 0);
+    size_--;
+}
+
+void Segment::DeliveryMap::clear() {
+    slot_.clear();
+    size_ = 0;
+}
+
+void Segment::DeliveryMap::slotsIs(size_t slots) {
+    vector<value_type> old(slots, value_type(0, 0));
+    old.swap(slot_);
+    size_ = 0;
+    for (size_t i = 0; i < old.size(); i++)
+        if (old[i].first != 0) (*this)[old[i].first] = old[i].second;
+}
+bool Segment::crossesPartitions() const {
+    if (!source_ || !returnSegment_ || !returnSegment_->source()) return false;
+    return source_->partition() != returnSegment_->source()->partition();
 }
 
 Hour Segment::carrierLatency() const {
@@ -660,6 +861,96 @@ void ShippingNetwork::activeFleetIs(FleetPtr fleet) {
     fleetPtr_ = fleet;
 }
 
+ManagerPtr ShippingNetwork::manager(uint32_t partition) const {
+    if (!parallelManager_) return manager_;
+    return parallelManager_->partition(partition);
+}
+
+Hour ShippingNetwork::lookahead() const {
+    double lookahead = std::numeric_limits<double>::infinity();
+    for (SegmentMap::const_iterator it = segmentMap_.begin(); it != segmentMap_.end(); it++) {
+        SegmentPtr segment = it->second;
+        if (!segment->crossesPartitions()) continue;
+        for (FleetMap::const_iterator f = fleet_.begin(); f != fleet_.end(); f++) {
+            double latency = segment->length().value() / f->second->speed(segment->transportMode()).value();
+            if (latency < lookahead) lookahead = latency;
+        }
+        double latency = segment->length().value() / fleetPtr_->speed(segment->transportMode()).value();
+        if (latency < lookahead) lookahead = latency;
+    }
+    return Hour(lookahead);
+}
+
+/* Hand a location and its outgoing segments to its partition's manager */
+void ShippingNetwork::locationManagerIs(LocationPtr location) {
+    ManagerPtr partitionManager = manager(location->partition());
+    for (Location::SegmentList::iterator it = location->segments_.begin(); it != location->segments_.end(); it++) {
+        Segment::NotifieeList::iterator n;
+        for (n = (*it)->notifieeList_.begin(); n != (*it)->notifieeList_.end(); n++) {
+            SegmentReactor* sr = dynamic_cast<SegmentReactor*>((*n).ptr());
+            if (sr) sr->managerIs(partitionManager);
+        }
+    }
+
+    Customer* cust = dynamic_cast<Customer*>(location.ptr());
+    if (!cust || cust->manager_ == partitionManager) return;
+    // the customer's injections move to a group of the partition
+    cust->manager_ = partitionManager;
+    Customer::NotifieeList::iterator n;
+    for (n = cust->notifieeList_.begin(); n != cust->notifieeList_.end(); n++) {
+        CustomerReactor* cr = dynamic_cast<CustomerReactor*>((*n).ptr());
+        if (!cr) continue;
+        cr->injectGroupLeave();
+        cr->manager_ = partitionManager;
+        cr->checkAndCreateInjectActivity();
+    }
+}
+
+void ShippingNetwork::partitionsIs(uint32_t partitions) {
+    Activity::Time now = parallelManager_ ? parallelManager_->now() : manager_->now();
+    if (now.value() > 0) {
+        throw Fwk::InternalException("Network can only be partitioned before the simulation starts.");
+    }
+
+    // order the locations breadth first, so that consecutive runs of
+    // the order form connected regions
+    std::vector<LocationPtr> order;
+    std::set<EntityID> seen;
+    for (LocationMap::iterator it = locationMap_.begin(); it != locationMap_.end(); it++) {
+        if (!seen.insert(it->first).second) continue;
+        size_t head = order.size();
+        order.push_back(it->second);
+        for (; head < order.size(); head++) {
+            LocationPtr location = order[head];
+            for (Location::SegmentList::iterator s = location->segments_.begin(); s != location->segments_.end(); s++) {
+                SegmentPtr returnSegment = (*s)->returnSegment();
+                if (!returnSegment || !returnSegment->source()) continue;
+                if (seen.insert(returnSegment->source()->name()).second) order.push_back(returnSegment->source());
+            }
+        }
+    }
+
+    if (partitions <= 1) {
+        parallelManager_ = NULL;
+        partitions = 1;
+    } else {
+        parallelManager_ = ParallelManager::ParallelManagerIs(manager_, partitions);
+    }
+    deliveryLanes_.clear();
+    for (uint32_t i = 0; i < partitions; i++)
+        deliveryLanes_.push_back(new DeliveryLane(manager(i)));
+    // shipments under way keep the slab they came from
+    while (shipmentSlabs_.size() < partitions)
+        shipmentSlabs_.push_back(ShipmentSlab::ShipmentSlabNew());
+    size_t regionSize = (order.size() + partitions - 1) / partitions;
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i]->partition_ = i / regionSize;
+        locationManagerIs(order[i]);
+    }
+    if (parallelManager_) parallelManager_->lookaheadIs(lookahead().value());
+    DEBUG_LOG << "Network split into " << partitions << " partitions\n";
+}
+
 void ShippingNetwork::notifieeIs(ShippingNetwork::NotifieePtr notifiee){
     // Ensure idempotency
     ShippingNetwork::NotifieeList::iterator it;
@@ -686,7 +977,7 @@ SegmentPtr ShippingNetwork::SegmentNew(EntityID name, TransportMode entityType,
 
     // Setup Reactor
     SegmentReactor* sr = new SegmentReactor(this,statPtr_);
-    sr->manager_ = manager_;
+    sr->manager_ = manager(0);
     retval->notifieeIs(sr);
 
     // Issue Notifications
@@ -743,11 +1034,11 @@ LocationPtr ShippingNetwork::LocationNew(EntityID name, Location::EntityType ent
     if (entityType == Location::customer()) {
         retval = new Customer(name, entityType);
         CustomerPtr cust = (dynamic_cast<Customer*> (retval.ptr()));
-        cust->manager_ = manager_;
+        cust->manager_ = manager(0);
 
         // create CustomerReactor
         CustomerReactor* notifiee = new CustomerReactor();
-        notifiee->manager_ = manager_;
+        notifiee->manager_ = manager(0);
         notifiee->network_ = this;
         cust->notifieeIs(notifiee);
     } else {
@@ -887,6 +1178,8 @@ void SegmentReactor::onSource(){
     // Add the notifier to the new source
     if(currentSource_){
         currentSource_->segmentIs(notifier());
+        // carriers run in the source's partition
+        managerIs(network_->manager(currentSource_->partition()));
     }
 }
 
@@ -919,10 +1212,42 @@ void SegmentReactor::onModeDel(PathMode mode){
 }
 
 void SegmentReactor::onCapacity() {
-    // start up activities as needed
+    SegmentPtr segment = notifier();
+    // busy carriers beyond the capacity retire once they run out of load
+    while (segment->idleCarriers() > 0 && segment->carriers() > segment->capacity().value())
+        idleCarrierDel();
+    if (!manager_) return;
+    while (segment->carriers() < segment->capacity().value())
+        carrierNew();
     startupFAR();
 }
 
+void SegmentReactor::managerIs(ManagerPtr manager) {
+    if (manager == manager_) return;
+    // idle carriers keep activities of the old manager
+    while (notifier()->idleCarriers() > 0)
+        idleCarrierDel();
+    manager_ = manager;
+    onCapacity();
+}
+
+/* Start a carrier; it takes any queued load right away, and otherwise
+ * parks */
+void SegmentReactor::carrierNew() {
+    SegmentPtr segment = notifier();
+    DEBUG_LOG << "Creating new ForwardActivityReactor...\n";
+    ForwardActivityReactor* far = new ForwardActivityReactor();
+    far->managerIs(manager_);
+    far->segmentIs(segment);
+    segment->carriersUsedInc();
+    manager_->coroutineNew(far);
+}
+
+void SegmentReactor::idleCarrierDel() {
+    ForwardActivityReactorPtr far = notifier()->idleCarrierDel();
+    far->manager()->coroutineDel(far.ptr());
+}
+
 void SegmentReactor::onShipment(ShipmentPtr shipment) {
 
     DEBUG_LOG << "Segment reactor notified of new shipment.\n";
@@ -945,19 +1270,15 @@ void SegmentReactor::onShipment(ShipmentPtr shipment) {
 void SegmentReactor::startupFAR() {
     SegmentPtr segment = notifier();
     while (segment->carriersUsed() < segment->capacity().value() && !segment->subshipmentQueue_.empty()) {
-        DEBUG_LOG << "Creating new ForwardActivityReactor...\n";
-        // create new activity and activity reactor
-        Activity::ActivityPtr fa = manager_->activityNew();
-        ForwardActivityReactor* far = new ForwardActivityReactor();
-        far->managerIs(manager_);
-        far->segmentIs(segment);
-        fa->lastNotifieeIs(far);
-
-        // increment the number of carriers used
+        // a restored segment starts with no idle carriers
+        if (segment->idleCarriers() == 0) {
+            carrierNew();
+            continue;
+        }
+        // the carrier picks up its first load right away
+        ForwardActivityReactorPtr far = segment->idleCarrierDel();
         segment->carriersUsedInc();
-
-        // schedule activity to pick up new subshipment
-        fa->statusIs(Activity::Activity::free());
+        manager_->coroutineResume(far.ptr());
     }
 
     if (segment->carriersUsed() >= segment->capacity().value())
@@ -966,59 +1287,144 @@ void SegmentReactor::startupFAR() {
         DEBUG_LOG << "No more subshipments.\n";
 }
 
-void ForwardActivityReactor::onStatus() {
-
-    if (notifier_->status() == Activity::Activity::executing()) {
-        DEBUG_LOG << "Delivering subshipments at time " << manager_->now().value() << "\n";
-        for(uint32_t i = 0; i < subshipments_.size(); i++){
-            SubshipmentPtr subshipment = subshipments_[i];
-            subshipment->shipment()->costInc(segment_->carrierCost());
-            segment_->deliveryMap_[subshipment->shipment()->name()] += subshipment->remainingLoad().value();
-            if (segment_->deliveryMap_[subshipment->shipment()->name()] == subshipment->shipment()->load().value()) {
-                DEBUG_LOG << "  Shipment " << subshipment->shipment()->name() << " is complete.\n";
-                segment_->deliveryMap_.erase(segment_->deliveryMap_.find(subshipment->shipment()->name()));
-                // Deliver package
-                Activity::ActivityPtr da = manager_->activityNew();
-                DeliveryActivityReactor* dar = new DeliveryActivityReactor(subshipment->shipment(), segment_->returnSegment()->source());
-                da->lastNotifieeIs(dar);
-                da->nextTimeIs(manager_->now());
-                da->priorityIs(2);
-                da->statusIs(Activity::Activity::nextTimeScheduled());
-                manager_->lastActivityIs(da);
+void ForwardActivityReactor::resume() {
+    COROUTINE_BEGIN;
+    for (;;) {
+        // pick up another load while there is one and carriers are not exceeded
+        while (segment_->carriersUsed() <= segment_->capacity().value() && segment_->subshipmentQueueSize() > 0) {
+            subshipmentsLoad();
+            DEBUG_LOG << "  Shipment to be delivered at time " << manager_->now().value() + segment_->carrierLatency().value() << ".\n";
+            // the far partition learns of the load now, a full trip ahead
+            // of its arrival
+            if (segment_->crossesPartitions()) {
+                subshipmentsArrivalIs(Time(manager_->now().value() + segment_->carrierLatency().value()));
             }
+            COROUTINE_SLEEP(segment_->carrierLatency().value());
+            DEBUG_LOG << "Delivering subshipments at time " << manager_->now().value() << "\n";
+            subshipmentsArrivalIs(manager_->now());
         }
-        subshipments_.clear();
-    }
-
-    else if (notifier_->status() == Activity::Activity::free()) {
-        // reschedule activity if there is another subshipment left and not exceeding carriers
-        if (segment_->carriersUsed() <= segment_->capacity().value() && segment_->subshipmentQueueSize() > 0) {
-            PackageNum capacity = segment_->carrierCapacity();
-            while(capacity > 0){
-                SubshipmentPtr subshipment;
-                subshipment = segment_->subshipmentDequeue(capacity);
-                if(!subshipment) break; // Exit loop if all shipments dequeued
-                subshipments_.push_back(subshipment);
-                capacity = capacity.value() - subshipment->remainingLoad().value();
-                DEBUG_LOG << "  Picking up new subshipment for shipment "<< subshipment->shipment()->name()<<"\n";
-                if (segment_->deliveryMap_.find(subshipment->shipment()->name()) == segment_->deliveryMap_.end()) {
-                    DEBUG_LOG << "  Shipment is starting.\n";
-                    segment_->shipmentsReceivedInc();
-                    segment_->deliveryMap_[subshipment->shipment()->name()] = 0;
-                    DEBUG_LOG << "  Segment " << segment_->name() << " shipment queue time is " << manager_->now().value()-subshipment->shipment()->queueTime().value() << std::endl;
-                    segment_->queueTimeIs(manager_->now().value()-subshipment->shipment()->queueTime().value());
-                }
-            }
-            notifier_->statusIs(Activity::Activity::nextTimeScheduled());
-            notifier_->nextTimeIs(Time(manager_->now().value() + segment_->carrierLatency().value()));
-            DEBUG_LOG << "  Shipment to be delivered at time " << (double)notifier_->nextTime().value() << ".\n";
-            manager_->lastActivityIs(notifier_);
-            return;
-        }
-        // otherwise, delete activity
-        manager_->activityDel(notifier_->name());
         segment_->carriersUsedDec();
+        if (segment_->carriers() >= segment_->capacity().value()) break;
+        // SegmentReactor::startupFAR() wakes the carrier for the next load
+        segment_->idleCarrierIs(this);
+        COROUTINE_PARK;
+    }
+    COROUTINE_END;
+}
+
+void ForwardActivityReactor::subshipmentsLoad() {
+    Activity::Journal::save(this, loaded_);
+    loaded_ = manager_->now().tick();
+    size_t loaded = subshipments_.size();
+    segment_->dequeueUpTo(segment_->carrierCapacity(), subshipments_);
+    for (size_t i = loaded; i < subshipments_.size(); i++) {
+        Activity::Journal::savePushBack(this, subshipments_);
+        const Subshipment& subshipment = subshipments_[i];
+        DEBUG_LOG << "  Picking up new subshipment for shipment "<< subshipment.shipment()->name()<<"\n";
+        uint64_t id = subshipment.shipment()->id();
+        if (segment_->deliveryMap_.find(id) == segment_->deliveryMap_.end()) {
+            DEBUG_LOG << "  Shipment is starting.\n";
+            segment_->shipmentsReceivedInc();
+            Activity::Journal::saveKey(segment_.ptr(), segment_->deliveryMap_, id);
+            segment_->deliveryMap_[id] = 0;
+            DEBUG_LOG << "  Segment " << segment_->name() << " shipment queue time is " << manager_->now().value()-subshipment.shipment()->queueTime().value() << std::endl;
+            segment_->queueTimeIs(manager_->now().value()-subshipment.shipment()->queueTime().value());
+        }
+    }
+}
+
+void ForwardActivityReactor::subshipmentsArrivalIs(Activity::Time arrival) {
+    for(uint32_t i = 0; i < subshipments_.size(); i++){
+        subshipmentArrivalIs(subshipments_[i], arrival);
     }
+    Activity::Journal::save(this, subshipments_);
+    subshipments_.clear();
+}
+
+/* Charge the trip to the subshipment's shipment, and deliver the shipment
+ * to the far end once all of it has arrived */
+void ForwardActivityReactor::subshipmentArrivalIs(const Subshipment& subshipment, Activity::Time arrival) {
+    subshipment.shipment()->costInc(segment_->carrierCost());
+    uint64_t id = subshipment.shipment()->id();
+    Activity::Journal::saveKey(segment_.ptr(), segment_->deliveryMap_, id);
+    uint32_t& delivered = segment_->deliveryMap_[id];
+    delivered += subshipment.remainingLoad().value();
+    if (delivered != subshipment.shipment()->load().value()) return;
+
+    DEBUG_LOG << "  Shipment " << subshipment.shipment()->name() << " is complete.\n";
+    segment_->deliveryMap_.erase(id);
+    // Deliver package
+    LocationPtr destination = segment_->returnSegment()->source();
+    if (segment_->crossesPartitions()) {
+        DeliveryActivityReactor* dar = new DeliveryActivityReactor(subshipment.shipment(), destination, segment_, loaded_,
+            segment_->network_->deliveryLane(destination->partition()));
+        ParallelManagerPtr parallel = segment_->network_->parallelManager();
+        dar->managerIs(parallel->partition(destination->partition()));
+        parallel->activityNew(segment_->source()->partition(), destination->partition(), arrival, 2, dar);
+        return;
+    }
+    segment_->network_->deliveryLane(segment_->source()->partition())->deliveryNew(destination, subshipment.shipment(), segment_, loaded_);
+}
+
+/*
+ * DeliveryActivityReactor
+ *
+ */
+
+void DeliveryActivityReactor::onStatus() {
+    if (notifier()->status() == Activity::Activity::executing()) {
+        // the shipment takes its place among the deliveries of this time
+        // step, and the lane holds it now
+        lane_->deliveryNew(location_, shipment_, segment_, loaded_);
+        Activity::Journal::save(this, shipment_);
+        shipment_ = NULL;
+    }
+    else if (notifier()->status() == Activity::Activity::free()) {
+        manager_->activityDel(notifier_->handle());
+    }
+}
+
+/*
+ * DeliveryLane
+ *
+ */
+
+bool DeliveryLane::loadedEarlier(const Delivery& a, const Delivery& b) {
+    if (a.loaded != b.loaded) return a.loaded < b.loaded;
+    return a.segment != b.segment && a.segment->name() < b.segment->name();
+}
+
+void DeliveryLane::deliveryNew(LocationPtr location, ShipmentPtr shipment, SegmentPtr segment, Activity::Tick loaded) {
+    Activity::Journal::savePushBack(this, deliveries_);
+    deliveries_.push_back(Delivery(location, shipment, segment, loaded));
+    if (sorted_) {
+        Activity::Journal::save(this, sorted_);
+        sorted_ = false;
+    }
+    manager_->deferredNew(this);
+}
+
+void DeliveryLane::deferredRun() {
+    // the deliveries of a carrier keep their order, as do those of
+    // carriers of one segment
+    if (!sorted_) {
+        Activity::Journal::save(this, deliveries_);
+        Activity::Journal::save(this, sorted_);
+        stable_sort(deliveries_.begin() + head_, deliveries_.end(), loadedEarlier);
+        sorted_ = true;
+    }
+    LocationPtr location = deliveries_[head_].location;
+    ShipmentPtr shipment = deliveries_[head_].shipment;
+    Activity::Journal::save(this, head_);
+    head_++;
+    if (head_ == deliveries_.size()) {
+        Activity::Journal::save(this, deliveries_);
+        deliveries_.clear();
+        head_ = 0;
+    }
+    // a shipment at its destination goes back to the slab once the
+    // location is done with it
+    location->shipmentIs(shipment);
 }
 
 /*
@@ -1029,6 +1435,11 @@ void ForwardActivityReactor::onStatus() {
 ShippingNetworkReactor::ShippingNetworkReactor(){}
 
 void ShippingNetworkReactor::onSegmentDel(SegmentPtr segment){
+    // Retire the idle carriers
+    while (segment->idleCarriers() > 0) {
+        ForwardActivityReactorPtr far = segment->idleCarrierDel();
+        far->manager()->coroutineDel(far.ptr());
+    }
     // Clean up this Segment's source
     segment->sourceIs((LocationPtr)NULL);
     // Clean up this Segment's return segment
@@ -1466,7 +1877,7 @@ void FleetReactor::onStartTime() {
     // if activity exists already, clear the old activity
     Activity::ActivityPtr activity = manager_->activity(notifier_->name());
     if (activity) {
-        activity->statusIs(Activity::Activity::cancelled());
+        manager_->activityCancel(activity->name());
         manager_->activityDel(activity->name());
     }
 
@@ -1477,6 +1888,8 @@ void FleetReactor::onStartTime() {
     fcar->networkIs(network_);
     fcar->fleetIs(notifier());
     activity->lastNotifieeIs(fcar);
+    // the schedule changes again every day
+    activity->periodIs(24);
 
     // find the next time the schedule would change
     float currTime = manager_->now().value();
@@ -1496,13 +1909,41 @@ void FleetChangeActivityReactor::onStatus() {
         DEBUG_LOG << "Changing fleet to " << fleet_->name() << "\n";
         network_->activeFleetIs(fleet_);
     }
+}
 
-    else if(notifier_->status() == Activity::Activity::free()){
-        // schedule the activity one day later
-        notifier_->nextTimeIs(Time(manager_->now().value() + 24));
-        notifier_->statusIs(Activity::Activity::nextTimeScheduled());
-        manager_->lastActivityIs(notifier_);
-    }
+/*
+ * Random
+ *
+ */
+
+void Random::seedIs(uint32_t seed) {
+    seed_ = seed;
+    // rand() treats 0 as 1
+    int32_t word = seed == 0 ? 1 : seed;
+    state_[0] = word;
+    for (uint32_t i = 1; i < 31; i++) {
+        // 16807 * word % (2^31 - 1), without overflowing 31 bits
+        int32_t hi = word / 127773;
+        int32_t lo = word % 127773;
+        word = 16807 * lo - 2836 * hi;
+        if (word < 0) word += 2147483647;
+        state_[i] = word;
+    }
+    for (uint32_t i = 31; i < degree; i++)
+        state_[i] = state_[i - 31];
+    next_ = 0;
+    // rand() discards the first 310 values
+    for (uint32_t i = 0; i < 310; i++)
+        value();
+}
+
+int32_t Random::value() {
+    // r[i] = r[i-31] + r[i-3]; the oldest of the last degree values is
+    // r[i-34], so r[i-31] and r[i-3] follow it by 3 and 31
+    uint32_t r = state_[(next_ + 3) % degree] + state_[(next_ + 31) % degree];
+    state_[next_] = r;
+    next_ = (next_ + 1) % degree;
+    return r >> 1;
 }
 
 /*
@@ -1565,7 +2006,7 @@ void RoutingReactor::onRouting(){
         initRoutingTable(&traversal);
     }
     else if(algo == Conn::minTime()){
-        Conn::MinTimeTraversal traversal(network_->activeFleet());
+        Conn::MinTimeTraversal traversal(network_->activeFleet(), &network_->random());
         initRoutingTable(&traversal);
     }
 }
@@ -1610,3 +2051,601 @@ void RoutingReactor::initRoutingTable(Conn::TraversalOrder* traversal){
     }
 }
 
+
+/*
+ * Checkpoint
+ *
+ */
+
+static const char checkpointMagic[8] = {'S','H','I','P','C','K','P','T'};
+static const uint32_t checkpointVersion = 5;
+
+/* Kinds of activities a checkpoint can hold, by reactor */
+enum CheckpointActivity {
+    injectActivity_ = 0,
+    fleetChangeActivity_ = 1,
+    forwardActivity_ = 2,
+    deliveryActivity_ = 3
+};
+
+/* Writes values in host byte order. Names are numbered as they appear:
+ * the first use of a name carries its text, later ones only its number. */
+class CheckpointWriter {
+public:
+    CheckpointWriter(std::ostream& out) : out_(out) {}
+    template <class T> void valueIs(T value) {
+        out_.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+    void nameIs(const string& name) {
+        map<string,uint32_t>::const_iterator it = names_.find(name);
+        if (it != names_.end()) {
+            valueIs(it->second);
+            return;
+        }
+        uint32_t index = names_.size();
+        names_[name] = index;
+        valueIs(index);
+        valueIs<uint32_t>(name.size());
+        out_.write(name.data(), name.size());
+    }
+    void subshipmentIs(const Subshipment& subshipment, const map<Shipment*,uint32_t>& shipments) {
+        valueIs(shipments.find(subshipment.shipment().ptr())->second);
+        valueIs(subshipment.remainingLoad().value());
+    }
+private:
+    std::ostream& out_;
+    map<string,uint32_t> names_;
+};
+
+class CheckpointReader {
+public:
+    CheckpointReader(std::istream& in) : in_(in) {}
+    template <class T> T value() {
+        T value;
+        in_.read(reinterpret_cast<char*>(&value), sizeof(value));
+        if (!in_) throw Fwk::InternalException("Checkpoint is truncated.");
+        return value;
+    }
+    string name() {
+        uint32_t index = value<uint32_t>();
+        if (index < names_.size()) return names_[index];
+        if (index > names_.size()) throw Fwk::InternalException("Checkpoint is corrupt.");
+        string name(value<uint32_t>(), '\0');
+        if (!name.empty()) in_.read(&name[0], name.size());
+        if (!in_) throw Fwk::InternalException("Checkpoint is truncated.");
+        names_.push_back(name);
+        return name;
+    }
+    Subshipment subshipment(const vector<ShipmentPtr>& shipments) {
+        uint32_t index = value<uint32_t>();
+        if (index >= shipments.size()) throw Fwk::InternalException("Checkpoint is corrupt.");
+        PackageNum load = value<int64_t>();
+        return Subshipment(shipments[index], load);
+    }
+private:
+    std::istream& in_;
+    vector<string> names_;
+};
+
+static uint32_t checkpointShipmentIndex(ShipmentPtr shipment, map<Shipment*,uint32_t>& index, vector<ShipmentPtr>& shipments) {
+    map<Shipment*,uint32_t>::const_iterator it = index.find(shipment.ptr());
+    if (it != index.end()) return it->second;
+    index[shipment.ptr()] = shipments.size();
+    shipments.push_back(shipment);
+    return shipments.size() - 1;
+}
+
+void ShippingNetwork::checkpointIs(std::ostream& out) {
+    if (parallelManager_) {
+        throw Fwk::InternalException("Partitioned networks cannot be checkpointed.");
+    }
+    CheckpointWriter w(out);
+
+    // every shipment under way is queued on a segment, loaded on a carrier
+    // or waiting for delivery; number them before anything refers to them
+    map<Shipment*,uint32_t> shipmentIndex;
+    vector<ShipmentPtr> shipments;
+    for (SegmentMap::const_iterator it = segmentMap_.begin(); it != segmentMap_.end(); it++) {
+        const Segment::SubshipmentQueue& queue = it->second->subshipmentQueue_;
+        for (size_t i = 0; i < queue.size(); i++)
+            checkpointShipmentIndex(queue[i].shipment(), shipmentIndex, shipments);
+    }
+    vector<Activity::ActivityPtr> activities = manager_->scheduledActivities();
+    for (size_t i = 0; i < activities.size(); i++) {
+        Activity::Activity::Notifiee* notifiee = activities[i]->notifiee().ptr();
+        if (ForwardActivityReactor* far = dynamic_cast<ForwardActivityReactor*>(notifiee)) {
+            for (size_t j = 0; j < far->subshipments_.size(); j++)
+                checkpointShipmentIndex(far->subshipments_[j].shipment(), shipmentIndex, shipments);
+        } else if (DeliveryActivityReactor* dar = dynamic_cast<DeliveryActivityReactor*>(notifiee)) {
+            checkpointShipmentIndex(dar->shipment(), shipmentIndex, shipments);
+        }
+    }
+
+    out.write(checkpointMagic, sizeof(checkpointMagic));
+    w.valueIs(checkpointVersion);
+    w.valueIs(shipmentIdNext);
+    w.valueIs(manager_->now().value());
+    w.valueIs(random_.seed_);
+    for (uint32_t i = 0; i < Random::degree; i++)
+        w.valueIs(random_.state_[i]);
+    w.valueIs(random_.next_);
+
+    // locations, with the counters and injection state of customers
+    w.valueIs<uint32_t>(locationMap_.size());
+    for (LocationMap::const_iterator it = locationMap_.begin(); it != locationMap_.end(); it++) {
+        w.nameIs(it->first);
+        w.valueIs<uint8_t>(it->second->entityType());
+        Customer* cust = dynamic_cast<Customer*>(it->second.ptr());
+        if (!cust) continue;
+        w.valueIs(cust->transferRate_.value());
+        w.valueIs(cust->shipmentSize_.value());
+        w.nameIs(cust->destination_ ? cust->destination_->name() : "");
+        w.valueIs(cust->shipmentsSentToday_.value());
+        w.valueIs(cust->shipmentsReceived_.value());
+        w.valueIs(cust->totalLatency_.value());
+        w.valueIs(cust->totalCost_.value());
+        CustomerReactor* cr = NULL;
+        for (size_t i = 0; !cr && i < cust->notifieeList_.size(); i++)
+            cr = dynamic_cast<CustomerReactor*>(cust->notifieeList_[i].ptr());
+        w.valueIs<uint8_t>(cr && cr->transferRateSet_);
+        w.valueIs<uint8_t>(cr && cr->shipmentSizeSet_);
+        w.valueIs<uint8_t>(cr && cr->destinationSet_);
+        w.nameIs(cr ? cr->injectGroup_ : "");
+    }
+
+    w.valueIs<uint32_t>(segmentMap_.size());
+    for (SegmentMap::const_iterator it = segmentMap_.begin(); it != segmentMap_.end(); it++) {
+        SegmentPtr segment = it->second;
+        w.nameIs(it->first);
+        w.valueIs(segment->transportMode_.value());
+        w.valueIs<uint8_t>(segment->mode_.size());
+        for (std::set<PathMode>::const_iterator m = segment->mode_.begin(); m != segment->mode_.end(); m++)
+            w.valueIs(m->value());
+        w.nameIs(segment->source_ ? segment->source_->name() : "");
+        w.nameIs(segment->returnSegment_ ? segment->returnSegment_->name() : "");
+        w.valueIs(segment->length_.value());
+        w.valueIs(segment->difficulty_.value());
+        w.valueIs(segment->capacity_.value());
+        w.valueIs(segment->totalQueueTime_.value());
+        w.valueIs(segment->queueTime_.value());
+        w.valueIs(segment->shipmentsRouted_.value());
+        w.valueIs(segment->shipmentsReceived_.value());
+        w.valueIs(segment->shipmentsRefused_.value());
+        w.valueIs(segment->carriersUsed_.value());
+    }
+
+    // segmentN numbering of each location
+    for (LocationMap::const_iterator it = locationMap_.begin(); it != locationMap_.end(); it++) {
+        w.valueIs<uint32_t>(it->second->segments_.size());
+        for (size_t i = 0; i < it->second->segments_.size(); i++)
+            w.nameIs(it->second->segments_[i]->name());
+    }
+
+    w.valueIs<uint32_t>(fleet_.size());
+    EntityID activeFleet;
+    for (FleetMap::const_iterator it = fleet_.begin(); it != fleet_.end(); it++) {
+        FleetPtr fleet = it->second;
+        w.nameIs(it->first);
+        if (fleet == fleetPtr_) activeFleet = it->first;
+        w.valueIs<uint8_t>(fleet->speed_.size());
+        for (Fleet::SpeedMap::const_iterator m = fleet->speed_.begin(); m != fleet->speed_.end(); m++) {
+            w.valueIs(m->first.value());
+            w.valueIs(m->second.value());
+        }
+        w.valueIs<uint8_t>(fleet->capacity_.size());
+        for (Fleet::CapacityMap::const_iterator m = fleet->capacity_.begin(); m != fleet->capacity_.end(); m++) {
+            w.valueIs(m->first.value());
+            w.valueIs(m->second.value());
+        }
+        w.valueIs<uint8_t>(fleet->cost_.size());
+        for (Fleet::CostMap::const_iterator m = fleet->cost_.begin(); m != fleet->cost_.end(); m++) {
+            w.valueIs(m->first.value());
+            w.valueIs(m->second.value());
+        }
+        w.valueIs<uint8_t>(fleet->speedMultiplier_.size());
+        for (Fleet::SpeedMultiplierMap::const_iterator m = fleet->speedMultiplier_.begin(); m != fleet->speedMultiplier_.end(); m++) {
+            w.valueIs(m->first.value());
+            w.valueIs(m->second.value());
+        }
+        w.valueIs<uint8_t>(fleet->costMultiplier_.size());
+        for (Fleet::CostMultiplierMap::const_iterator m = fleet->costMultiplier_.begin(); m != fleet->costMultiplier_.end(); m++) {
+            w.valueIs(m->first.value());
+            w.valueIs(m->second.value());
+        }
+        w.valueIs(fleet->startTime_.value());
+        w.valueIs<uint8_t>(fleet->startTimeSet_);
+    }
+    w.nameIs(activeFleet);
+
+    // the conn and its routing table, which is only rebuilt when the
+    // routing algorithm changes
+    w.valueIs<uint32_t>(conn_.size());
+    for (ConnMap::const_iterator it = conn_.begin(); it != conn_.end(); it++)
+        w.nameIs(it->first);
+    w.valueIs<uint8_t>(connPtr_->routingAlgorithm_);
+    w.valueIs<uint8_t>(connPtr_->endLocationType_.size());
+    for (std::set<Location::EntityType>::const_iterator t = connPtr_->endLocationType_.begin(); t != connPtr_->endLocationType_.end(); t++)
+        w.valueIs<uint8_t>(*t);
+    w.valueIs<uint32_t>(connPtr_->supportedRouteModes_.size());
+    for (Conn::ModeCollection::const_iterator m = connPtr_->supportedRouteModes_.begin(); m != connPtr_->supportedRouteModes_.end(); m++) {
+        w.valueIs(m->first);
+        w.valueIs<uint8_t>(m->second.size());
+        for (Conn::ModeSet::const_iterator p = m->second.begin(); p != m->second.end(); p++)
+            w.valueIs(p->value());
+    }
+    w.valueIs<uint32_t>(connPtr_->nextHop_.size());
+    for (Conn::RoutingTable::const_iterator h = connPtr_->nextHop_.begin(); h != connPtr_->nextHop_.end(); h++) {
+        w.nameIs(h->first.first);
+        w.nameIs(h->first.second);
+        w.nameIs(h->second);
+    }
+
+    w.valueIs<uint32_t>(stat_.size());
+    for (StatMap::const_iterator it = stat_.begin(); it != stat_.end(); it++)
+        w.nameIs(it->first);
+    w.valueIs<uint8_t>(statPtr_->locationCount_.size());
+    for (Stats::LocationCountMap::const_iterator c = statPtr_->locationCount_.begin(); c != statPtr_->locationCount_.end(); c++) {
+        w.valueIs<uint8_t>(c->first);
+        w.valueIs(c->second);
+    }
+    w.valueIs<uint8_t>(statPtr_->segmentCount_.size());
+    for (Stats::SegmentCountMap::const_iterator c = statPtr_->segmentCount_.begin(); c != statPtr_->segmentCount_.end(); c++) {
+        w.valueIs(c->first.value());
+        w.valueIs(c->second);
+    }
+    w.valueIs<uint8_t>(statPtr_->modeCount_.size());
+    for (Stats::PathModeCountMap::const_iterator c = statPtr_->modeCount_.begin(); c != statPtr_->modeCount_.end(); c++) {
+        w.valueIs(c->first.value());
+        w.valueIs(c->second);
+    }
+    w.valueIs(statPtr_->totalSegmentCount_);
+
+    w.valueIs<uint32_t>(shipments.size());
+    for (size_t i = 0; i < shipments.size(); i++) {
+        ShipmentPtr shipment = shipments[i];
+        w.valueIs(shipment->id());
+        w.valueIs(shipment->load().value());
+        w.nameIs(shipment->source()->name());
+        w.nameIs(shipment->destination()->name());
+        w.valueIs(shipment->cost().value());
+        w.valueIs(shipment->startTime().value());
+        w.valueIs(shipment->queueTime().value());
+    }
+
+    // loads waiting for a carrier, and loads delivered so far by shipment
+    for (SegmentMap::const_iterator it = segmentMap_.begin(); it != segmentMap_.end(); it++) {
+        const Segment::SubshipmentQueue& queue = it->second->subshipmentQueue_;
+        w.valueIs<uint32_t>(queue.size());
+        for (size_t i = 0; i < queue.size(); i++)
+            w.subshipmentIs(queue[i], shipmentIndex);
+        const Segment::DeliveryMap& delivered = it->second->deliveryMap_;
+        w.valueIs<uint32_t>(delivered.size());
+        for (size_t d = 0; d < delivered.slots(); d++) {
+            if (delivered.slot(d).first == 0) continue;
+            w.valueIs(delivered.slot(d).first);
+            w.valueIs(delivered.slot(d).second);
+        }
+    }
+
+    // activities in the order they will run, so that restoring them in
+    // that order keeps the order of those due at the same time
+    w.valueIs<uint32_t>(activities.size());
+    for (size_t i = 0; i < activities.size(); i++) {
+        Activity::ActivityPtr activity = activities[i];
+        Activity::Activity::Notifiee* notifiee = activity->notifiee().ptr();
+        InjectActivityReactor* iar = dynamic_cast<InjectActivityReactor*>(notifiee);
+        FleetChangeActivityReactor* fcar = dynamic_cast<FleetChangeActivityReactor*>(notifiee);
+        ForwardActivityReactor* far = dynamic_cast<ForwardActivityReactor*>(notifiee);
+        DeliveryActivityReactor* dar = dynamic_cast<DeliveryActivityReactor*>(notifiee);
+        if (iar) w.valueIs<uint8_t>(injectActivity_);
+        else if (fcar) w.valueIs<uint8_t>(fleetChangeActivity_);
+        else if (far) w.valueIs<uint8_t>(forwardActivity_);
+        else if (dar) w.valueIs<uint8_t>(deliveryActivity_);
+        else throw Fwk::InternalException("Activity " + activity->name() + " cannot be checkpointed.");
+        w.valueIs(activity->nextTime().value());
+        w.valueIs(activity->priority().value());
+        w.valueIs(activity->period().value());
+        if (iar) {
+            w.nameIs(activity->name());
+            w.valueIs<uint32_t>(iar->sources());
+            for (uint32_t j = 0; j < iar->sources(); j++)
+                w.nameIs(iar->source(j)->name());
+        } else if (fcar) {
+            EntityID key;
+            for (FleetMap::const_iterator f = fleet_.begin(); f != fleet_.end(); f++) {
+                if (f->second == fcar->fleet()) key = f->first;
+            }
+            if (key.empty()) throw Fwk::InternalException("Fleet of " + activity->name() + " is not in the network.");
+            w.nameIs(key);
+        } else if (far) {
+            w.nameIs(far->segment()->name());
+            w.valueIs<int32_t>(far->line());
+            w.valueIs<int64_t>(far->loaded_);
+            w.valueIs<uint32_t>(far->subshipments_.size());
+            for (size_t j = 0; j < far->subshipments_.size(); j++)
+                w.subshipmentIs(far->subshipments_[j], shipmentIndex);
+        } else {
+            w.valueIs(shipmentIndex[dar->shipment().ptr()]);
+            w.nameIs(dar->location()->name());
+            w.nameIs(dar->segment()->name());
+            w.valueIs<int64_t>(dar->loaded());
+        }
+    }
+    if (!out) throw Fwk::InternalException("Checkpoint could not be written.");
+}
+
+/* Location named in a checkpoint, which must exist by then */
+static LocationPtr checkpointLocation(ShippingNetwork* network, const EntityID& name) {
+    LocationPtr location = network->location(name);
+    if (!location) throw Fwk::InternalException("Checkpoint names unknown location " + name + ".");
+    return location;
+}
+
+static SegmentPtr checkpointSegment(ShippingNetwork* network, const EntityID& name) {
+    SegmentPtr segment = network->segment(name);
+    if (!segment) throw Fwk::InternalException("Checkpoint names unknown segment " + name + ".");
+    return segment;
+}
+
+void ShippingNetwork::restoreIs(std::istream& in) {
+    if (parallelManager_) {
+        throw Fwk::InternalException("Partitioned networks cannot be restored.");
+    }
+    if (manager_->now().value() > 0 || !manager_->scheduledActivities().empty()) {
+        throw Fwk::InternalException("Checkpoints can only be restored before the simulation starts.");
+    }
+    CheckpointReader r(in);
+    char magic[sizeof(checkpointMagic)];
+    in.read(magic, sizeof(magic));
+    if (!in || !std::equal(magic, magic + sizeof(magic), checkpointMagic) ||
+        r.value<uint32_t>() != checkpointVersion) {
+        throw Fwk::InternalException("Not a checkpoint of this version.");
+    }
+    // ids of new shipments must not repeat restored ones
+    uint64_t idNext = r.value<uint64_t>();
+    if (idNext > shipmentIdNext) shipmentIdNext = idNext;
+    Activity::Time now = r.value<double>();
+    random_.seed_ = r.value<uint32_t>();
+    for (uint32_t i = 0; i < Random::degree; i++)
+        random_.state_[i] = r.value<uint32_t>();
+    random_.next_ = r.value<uint32_t>() % Random::degree;
+
+    // customer fields are set directly: the mutators would schedule
+    // injections, which are restored with the other activities
+    uint32_t count = r.value<uint32_t>();
+    vector<LocationPtr> locations;
+    map<Customer*,EntityID> destinations;
+    for (uint32_t i = 0; i < count; i++) {
+        EntityID name = r.name();
+        Location::EntityType type = static_cast<Location::EntityType>(r.value<uint8_t>());
+        LocationPtr location = this->location(name);
+        if (!location) location = LocationNew(name, type);
+        if (location->entityType() != type) throw Fwk::InternalException("Location " + name + " changed type.");
+        locations.push_back(location);
+        Customer* cust = dynamic_cast<Customer*>(location.ptr());
+        if (!cust) continue;
+        cust->transferRate_ = r.value<int64_t>();
+        cust->shipmentSize_ = r.value<int64_t>();
+        destinations[cust] = r.name();
+        cust->shipmentsSentToday_ = r.value<int64_t>();
+        cust->shipmentsReceived_ = r.value<int64_t>();
+        cust->totalLatency_ = r.value<double>();
+        cust->totalCost_ = r.value<double>();
+        CustomerReactor* cr = NULL;
+        for (size_t j = 0; !cr && j < cust->notifieeList_.size(); j++)
+            cr = dynamic_cast<CustomerReactor*>(cust->notifieeList_[j].ptr());
+        cr->transferRateSet_ = r.value<uint8_t>();
+        cr->shipmentSizeSet_ = r.value<uint8_t>();
+        cr->destinationSet_ = r.value<uint8_t>();
+        cr->injectGroup_ = r.name();
+    }
+    for (map<Customer*,EntityID>::const_iterator it = destinations.begin(); it != destinations.end(); it++)
+        it->first->destination_ = it->second.empty() ? NULL : checkpointLocation(this, it->second);
+
+    // the segment reactors link sources and return segments
+    count = r.value<uint32_t>();
+    vector<SegmentPtr> segments;
+    vector<pair<EntityID,EntityID> > links;
+    for (uint32_t i = 0; i < count; i++) {
+        EntityID name = r.name();
+        TransportMode transportMode = r.value<uint8_t>();
+        std::set<PathMode> modes;
+        for (uint8_t m = r.value<uint8_t>(); m > 0; m--)
+            modes.insert(r.value<uint8_t>());
+        SegmentPtr segment = this->segment(name);
+        if (!segment) segment = SegmentNew(name, transportMode, *modes.begin());
+        if (segment->transportMode() != transportMode) throw Fwk::InternalException("Segment " + name + " changed type.");
+        segments.push_back(segment);
+        std::set<PathMode> previous = segment->mode_;
+        for (std::set<PathMode>::const_iterator m = previous.begin(); m != previous.end(); m++) {
+            if (!modes.count(*m)) segment->modeDel(*m);
+        }
+        for (std::set<PathMode>::const_iterator m = modes.begin(); m != modes.end(); m++)
+            segment->modeIs(*m);
+        EntityID source = r.name();
+        EntityID returnSegment = r.name();
+        links.push_back(make_pair(source, returnSegment));
+        segment->length_ = r.value<double>();
+        segment->difficulty_ = r.value<double>();
+        segment->capacity_ = r.value<int64_t>();
+        segment->totalQueueTime_ = r.value<double>();
+        segment->queueTime_ = r.value<double>();
+        segment->shipmentsRouted_ = r.value<int64_t>();
+        segment->shipmentsReceived_ = r.value<int64_t>();
+        segment->shipmentsRefused_ = r.value<int64_t>();
+        segment->carriersUsed_ = r.value<int64_t>();
+    }
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (!links[i].first.empty()) segments[i]->sourceIs(checkpointLocation(this, links[i].first));
+        if (!links[i].second.empty()) segments[i]->returnSegmentIs(checkpointSegment(this, links[i].second));
+    }
+    for (size_t i = 0; i < locations.size(); i++) {
+        Location::SegmentList order;
+        for (uint32_t n = r.value<uint32_t>(); n > 0; n--)
+            order.push_back(checkpointSegment(this, r.name()));
+        locations[i]->segments_ = order;
+    }
+
+    // fleet fields are set directly too, as a start time would schedule
+    // a fleet change
+    for (count = r.value<uint32_t>(); count > 0; count--) {
+        EntityID name = r.name();
+        FleetPtr fleet = this->fleet(name);
+        if (!fleet) fleet = FleetNew(name);
+        fleet->speed_.clear();
+        for (uint8_t m = r.value<uint8_t>(); m > 0; m--) {
+            TransportMode mode = r.value<uint8_t>();
+            fleet->speed_[mode] = r.value<double>();
+        }
+        fleet->capacity_.clear();
+        for (uint8_t m = r.value<uint8_t>(); m > 0; m--) {
+            TransportMode mode = r.value<uint8_t>();
+            fleet->capacity_[mode] = r.value<int64_t>();
+        }
+        fleet->cost_.clear();
+        for (uint8_t m = r.value<uint8_t>(); m > 0; m--) {
+            TransportMode mode = r.value<uint8_t>();
+            fleet->cost_[mode] = r.value<double>();
+        }
+        fleet->speedMultiplier_.clear();
+        for (uint8_t m = r.value<uint8_t>(); m > 0; m--) {
+            PathMode mode = r.value<uint8_t>();
+            fleet->speedMultiplier_[mode] = r.value<double>();
+        }
+        fleet->costMultiplier_.clear();
+        for (uint8_t m = r.value<uint8_t>(); m > 0; m--) {
+            PathMode mode = r.value<uint8_t>();
+            fleet->costMultiplier_[mode] = r.value<double>();
+        }
+        fleet->startTime_ = r.value<double>();
+        fleet->startTimeSet_ = r.value<uint8_t>();
+    }
+    EntityID activeFleet = r.name();
+    if (!activeFleet.empty()) {
+        if (!fleet(activeFleet)) throw Fwk::InternalException("Checkpoint names unknown fleet " + activeFleet + ".");
+        activeFleetIs(fleet(activeFleet));
+    }
+
+    for (count = r.value<uint32_t>(); count > 0; count--) {
+        EntityID name = r.name();
+        if (!conn_.count(name)) ConnNew(name);
+    }
+    connPtr_->routingAlgorithm_ = static_cast<Conn::RoutingAlgorithm>(r.value<uint8_t>());
+    connPtr_->endLocationType_.clear();
+    for (uint8_t n = r.value<uint8_t>(); n > 0; n--)
+        connPtr_->endLocationType_.insert(static_cast<Location::EntityType>(r.value<uint8_t>()));
+    connPtr_->supportedRouteModes_.clear();
+    for (count = r.value<uint32_t>(); count > 0; count--) {
+        Conn::ModeSet& modes = connPtr_->supportedRouteModes_[r.value<uint32_t>()];
+        for (uint8_t n = r.value<uint8_t>(); n > 0; n--)
+            modes.insert(r.value<uint8_t>());
+    }
+    connPtr_->nextHopClear();
+    for (count = r.value<uint32_t>(); count > 0; count--) {
+        EntityID source = r.name();
+        EntityID sink = r.name();
+        connPtr_->nextHopIs(source, sink, r.name());
+    }
+
+    for (count = r.value<uint32_t>(); count > 0; count--) {
+        EntityID name = r.name();
+        if (!stat_.count(name)) StatsNew(name);
+    }
+    statPtr_->locationCount_.clear();
+    for (uint8_t n = r.value<uint8_t>(); n > 0; n--) {
+        Location::EntityType type = static_cast<Location::EntityType>(r.value<uint8_t>());
+        statPtr_->locationCount_[type] = r.value<uint32_t>();
+    }
+    statPtr_->segmentCount_.clear();
+    for (uint8_t n = r.value<uint8_t>(); n > 0; n--) {
+        TransportMode mode = r.value<uint8_t>();
+        statPtr_->segmentCount_[mode] = r.value<uint32_t>();
+    }
+    statPtr_->modeCount_.clear();
+    for (uint8_t n = r.value<uint8_t>(); n > 0; n--) {
+        PathMode mode = r.value<uint8_t>();
+        statPtr_->modeCount_[mode] = r.value<uint32_t>();
+    }
+    statPtr_->totalSegmentCount_ = r.value<uint32_t>();
+
+    vector<ShipmentPtr> shipments;
+    for (count = r.value<uint32_t>(); count > 0; count--) {
+        ShipmentPtr shipment = Shipment::ShipmentNew(r.value<uint64_t>(), shipmentSlab(0));
+        shipment->loadIs(r.value<int64_t>());
+        shipment->sourceIs(checkpointLocation(this, r.name()));
+        shipment->destinationIs(checkpointLocation(this, r.name()));
+        shipment->costInc(r.value<double>());
+        shipment->startTimeIs(r.value<double>());
+        shipment->queueTimeIs(r.value<double>());
+        shipments.push_back(shipment);
+    }
+
+    for (size_t i = 0; i < segments.size(); i++) {
+        segments[i]->subshipmentQueue_.clear();
+        for (count = r.value<uint32_t>(); count > 0; count--)
+            segments[i]->subshipmentQueue_.push_back(r.subshipment(shipments));
+        segments[i]->deliveryMap_.clear();
+        for (count = r.value<uint32_t>(); count > 0; count--) {
+            uint64_t shipment = r.value<uint64_t>();
+            segments[i]->deliveryMap_[shipment] = r.value<uint32_t>();
+        }
+    }
+
+    // nothing is scheduled yet, so this only moves the clock
+    manager_->nowIs(now);
+
+    for (count = r.value<uint32_t>(); count > 0; count--) {
+        uint8_t kind = r.value<uint8_t>();
+        Activity::Time nextTime = r.value<double>();
+        Activity::Priority priority = r.value<uint8_t>();
+        Activity::Time period = r.value<double>();
+        Activity::ActivityPtr activity;
+        if (kind == injectActivity_) {
+            activity = manager_->activityNew(r.name());
+            InjectActivityReactor* iar = new InjectActivityReactor();
+            iar->managerIs(manager_);
+            iar->slabIs(shipmentSlab(0));
+            for (uint32_t n = r.value<uint32_t>(); n > 0; n--)
+                iar->sourceIs(dynamic_cast<Customer*>(checkpointLocation(this, r.name()).ptr()));
+            activity->lastNotifieeIs(iar);
+        } else if (kind == fleetChangeActivity_) {
+            EntityID name = r.name();
+            FleetPtr fleet = this->fleet(name);
+            if (!fleet) throw Fwk::InternalException("Checkpoint names unknown fleet " + name + ".");
+            activity = manager_->activityNew(fleet->name());
+            FleetChangeActivityReactor* fcar = new FleetChangeActivityReactor();
+            fcar->managerIs(manager_);
+            fcar->networkIs(this);
+            fcar->fleetIs(fleet);
+            activity->lastNotifieeIs(fcar);
+        } else if (kind == forwardActivity_) {
+            ForwardActivityReactor* far = new ForwardActivityReactor();
+            far->managerIs(manager_);
+            far->segmentIs(checkpointSegment(this, r.name()));
+            far->lineIs(r.value<int32_t>());
+            far->loaded_ = r.value<int64_t>();
+            for (uint32_t n = r.value<uint32_t>(); n > 0; n--)
+                far->subshipmentIs(r.subshipment(shipments));
+            // the carrier resumes where it went to sleep
+            manager_->coroutineNew(far, nextTime, priority);
+            continue;
+        } else if (kind == deliveryActivity_) {
+            uint32_t index = r.value<uint32_t>();
+            if (index >= shipments.size()) throw Fwk::InternalException("Checkpoint is corrupt.");
+            LocationPtr location = checkpointLocation(this, r.name());
+            SegmentPtr segment = checkpointSegment(this, r.name());
+            DeliveryActivityReactor* dar = new DeliveryActivityReactor(shipments[index], location, segment,
+                r.value<int64_t>(), deliveryLane(0));
+            dar->managerIs(manager_);
+            activity = manager_->activity(manager_->anonymousActivityNew());
+            activity->lastNotifieeIs(dar);
+        } else {
+            throw Fwk::InternalException("Checkpoint is corrupt.");
+        }
+        activity->priorityIs(priority);
+        activity->periodIs(period);
+        activity->nextTimeIs(nextTime);
+        activity->statusIs(Activity::Activity::nextTimeScheduled());
+        manager_->lastActivityIs(activity);
+    }
+}
@@ -1,5 +1,8 @@
 #include "gtest/gtest.h"
 #include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
 #include "engine/Engine.h"
 
 using namespace Shipping;
@@ -1138,6 +1141,67 @@ TEST(Engine, Segment_mode){
     ASSERT_TRUE(stats->segmentCount(PathMode::expedited()) == 0);
 }
 
+TEST(Engine, Segment_dequeueUpTo){
+    ShippingNetworkPtr nwk = ShippingNetwork::ShippingNetworkIs("network",NULL);
+    SegmentPtr segment = nwk->SegmentNew("segment",TransportMode::truck(),PathMode::unexpedited());
+    std::vector<ShipmentPtr> shipments;
+    for(uint32_t i = 0; i < 20; i++){
+        shipments.push_back(Shipment::ShipmentNew());
+        shipments[i]->loadIs(i % 2 ? 7 : 5);
+        segment->subshipmentEnqueue(Subshipment(shipments[i], shipments[i]->load()));
+    }
+    ASSERT_TRUE(segment->subshipmentQueueSize() == 20);
+
+    // the last load that does not fit is split
+    std::vector<Subshipment> load;
+    segment->dequeueUpTo(10, load);
+    ASSERT_TRUE(load.size() == 2);
+    ASSERT_TRUE(load[0].shipment() == shipments[0] && load[0].remainingLoad() == 5);
+    ASSERT_TRUE(load[1].shipment() == shipments[1] && load[1].remainingLoad() == 5);
+    ASSERT_TRUE(segment->subshipmentQueueSize() == 19);
+    load.clear();
+    segment->dequeueUpTo(4, load);
+    ASSERT_TRUE(load.size() == 2);
+    ASSERT_TRUE(load[0].shipment() == shipments[1] && load[0].remainingLoad() == 2);
+    ASSERT_TRUE(load[1].shipment() == shipments[2] && load[1].remainingLoad() == 2);
+
+    // the rest comes off in order
+    load.clear();
+    segment->dequeueUpTo(1000, load);
+    ASSERT_TRUE(load.size() == 18);
+    ASSERT_TRUE(load[0].shipment() == shipments[2] && load[0].remainingLoad() == 3);
+    ASSERT_TRUE(load[17].shipment() == shipments[19]);
+    ASSERT_TRUE(segment->subshipmentQueueSize() == 0);
+}
+
+TEST(Engine, SegmentCarrierPool){
+    ManagerPtr manager = Activity::Manager::ManagerIs();
+    ShippingNetworkPtr nwk = ShippingNetwork::ShippingNetworkIs("network",manager);
+    nwk->FleetNew("fleet");
+    LocationPtr t1 = nwk->LocationNew("t1",Location::truckTerminal());
+    LocationPtr t2 = nwk->LocationNew("t2",Location::truckTerminal());
+    connectLocations(t1,t2,nwk);
+    SegmentPtr segment = nwk->segment("t1-t2");
+
+    // the pool follows the capacity, parked until there is load
+    segment->capacityIs(3);
+    ASSERT_TRUE(segment->idleCarriers() == 3);
+    ASSERT_TRUE(segment->carriersUsed() == 0);
+    segment->capacityIs(1);
+    ASSERT_TRUE(segment->idleCarriers() == 1);
+    segment->capacityIs(2);
+    ASSERT_TRUE(segment->idleCarriers() == 2);
+
+    // a shipment wakes one of them
+    ShipmentPtr shipment = Shipment::ShipmentNew();
+    shipment->loadIs(1);
+    segment->shipmentIs(shipment);
+    ASSERT_TRUE(segment->carriersUsed() == 1);
+    ASSERT_TRUE(segment->idleCarriers() == 1);
+    ASSERT_TRUE(segment->subshipmentQueueSize() == 0);
+    ASSERT_TRUE(manager->scheduledActivities().size() == 1);
+}
+
 TEST(Engine, Fleet){
     ShippingNetworkPtr nwk = ShippingNetwork::ShippingNetworkIs("network",NULL);
     FleetPtr fleet = nwk->FleetNew("fleet");
@@ -1282,3 +1346,713 @@ TEST(Engine, Stats){
     ASSERT_TRUE(stat->segmentCount(PathMode::expedited()) == 0);
 }
 
+
+class Workload;
+
+/* Reports to its workload each time its activity runs; a periodic one
+ * stops after the given number of runs */
+class WorkloadReactor : public Activity::Activity::Notifiee {
+public:
+    WorkloadReactor(Workload* workload, uint32_t runs) : workload_(workload), runs_(runs) {}
+    void onStatus();
+private:
+    Workload* workload_;
+    uint32_t runs_;
+};
+
+/* Pseudo-random mix of activities on a manager with a given queue policy.
+ * The activities log "name@time" as they run, and the workload may
+ * schedule or cancel others from ran(); since the random numbers are
+ * drawn in dispatch order, two policies only agree on the log if they
+ * dispatched the same way all along. */
+class Workload {
+public:
+    Workload(Activity::Manager::QueuePolicy policy) :
+        manager_(Activity::Manager::ManagerIs(policy)), seed_(1), activities_(0) {}
+    virtual ~Workload(){}
+    /* Run up to each of the given times in turn */
+    const std::vector<std::string>& order(const std::vector<double>& times){
+        for(size_t i = 0; i < times.size(); i++){
+            manager_->nowIs(times[i]);
+            stopped();
+        }
+        return order_;
+    }
+    /* Called each time the manager stops short of what it has queued */
+    virtual void stopped(){}
+    virtual void ran(Activity::Activity* activity){
+        EXPECT_TRUE(cancelled_.find(activity->name()) == cancelled_.end());
+        EXPECT_TRUE(ticks_.empty() || ticks_.back() <= manager_->now().tick());
+        ticks_.push_back(manager_->now().tick());
+        std::stringstream entry;
+        entry.precision(12);
+        entry << activity->name() << "@" << manager_->now().value();
+        order_.push_back(entry.str());
+    }
+protected:
+    uint32_t random(uint32_t n){
+        seed_ = seed_ * 1103515245 + 12345;
+        return (seed_ >> 16) % n;
+    }
+    std::string activityNew(double t, uint8_t priority, double period, uint32_t runs){
+        std::stringstream name;
+        name << "a" << activities_++;
+        Activity::ActivityPtr activity = manager_->activityNew(name.str());
+        activity->lastNotifieeIs(new WorkloadReactor(this, runs));
+        activity->nextTimeIs(t);
+        activity->priorityIs(priority);
+        activity->periodIs(period);
+        activity->statusIs(Activity::Activity::nextTimeScheduled());
+        manager_->lastActivityIs(activity);
+        names_.push_back(name.str());
+        return name.str();
+    }
+    /* Cancel one of the activities still waiting to run, if the draw
+     * finds one */
+    void cancel(){
+        if(names_.empty()) return;
+        std::string name = names_[random(names_.size())];
+        if(manager_->activity(name)->status() != Activity::Activity::nextTimeScheduled()) return;
+        manager_->activityCancel(name);
+        cancelled_.insert(name);
+    }
+    ManagerPtr manager_;
+private:
+    uint32_t seed_;
+    uint32_t activities_;
+    std::vector<std::string> names_;
+    std::set<std::string> cancelled_;
+    std::vector<std::string> order_;
+    std::vector<Activity::Tick> ticks_;
+};
+
+void WorkloadReactor::onStatus(){
+    if (notifier_->status() != Activity::Activity::executing()) return;
+    workload_->ran(notifier_);
+    if (runs_ > 0 && --runs_ == 0) notifier_->periodIs(0);
+}
+
+/* Runs workload W under every queue policy, expecting the order heap()
+ * gives; returns the number of activities that ran */
+template <class W>
+static size_t expectSameOrder(const std::vector<double>& times){
+    W heap(Activity::Manager::heap());
+    std::vector<std::string> expected = heap.order(times);
+    Activity::Manager::QueuePolicy policies[] = {
+        Activity::Manager::radixHeap(), Activity::Manager::calendarQueue()
+    };
+    for(uint32_t i = 0; i < 2; i++){
+        W workload(policies[i]);
+        EXPECT_TRUE(expected == workload.order(times)) << "queue policy " << policies[i];
+    }
+    return expected.size();
+}
+
+/* Activities at crowded times and priorities which schedule more as they
+ * run, some within the tick under way at any priority, and cancel
+ * others. */
+class CrowdedWorkload : public Workload {
+public:
+    CrowdedWorkload(Activity::Manager::QueuePolicy policy) : Workload(policy), budget_(2000) {
+        for(uint32_t i = 0; i < 200; i++) activityNew(random(1000) / 10.0, random(4), 0, 0);
+    }
+    void ran(Activity::Activity* activity){
+        Workload::ran(activity);
+        if(budget_ == 0) return;
+        budget_--;
+        for(uint32_t children = random(3); children > 0; children--){
+            if(random(4) == 0){
+                activityNew(manager_->now().value(), random(4), 0, 0);
+            } else {
+                activityNew(manager_->now().value() + (1 + random(100)) / 10.0, random(4), 0, 0);
+            }
+        }
+        if(random(5) == 0) cancel();
+    }
+    /* The queue has looked at what runs next; schedule ahead of it */
+    void stopped(){
+        for(uint32_t i = 0; i < 5; i++)
+            activityNew(manager_->now().value() + (1 + random(10)) / 100.0, random(4), 0, 0);
+    }
+private:
+    uint32_t budget_;
+};
+
+TEST(Activity, QueuePoliciesCrowded){
+    std::vector<double> times;
+    times.push_back(25.0);
+    times.push_back(25.05);
+    times.push_back(1000.0);
+    ASSERT_LT(2000u, expectSameOrder<CrowdedWorkload>(times));
+}
+
+/* Waves of activities that grow the calendar well past its sixteen days,
+ * sparse tails that shrink it again, and activities so far ahead that no
+ * day of the ring reaches them */
+class WavesWorkload : public Workload {
+public:
+    WavesWorkload(Activity::Manager::QueuePolicy policy) : Workload(policy) {
+        waves_.insert(activityNew(0.0, 0, 0, 0));
+        waves_.insert(activityNew(50.0, 0, 0, 0));
+        waves_.insert(activityNew(100050.0, 0, 0, 0));
+        for(uint32_t i = 0; i < 30; i++) activityNew(100000.0 + random(10000) / 10.0, random(4), 0, 0);
+        for(uint32_t i = 0; i < 5; i++) activityNew(500000.0 + random(10) * 1000.0, random(4), 0, 0);
+    }
+    void ran(Activity::Activity* activity){
+        Workload::ran(activity);
+        if(waves_.find(activity->name()) != waves_.end()){
+            for(uint32_t i = 0; i < 300; i++)
+                activityNew(manager_->now().value() + (1 + random(1000)) / 100.0, random(4), 0, 0);
+            return;
+        }
+        if(random(3) == 0) activityNew(manager_->now().value() + (1 + random(2000)) / 10.0, random(4), 0, 0);
+        if(random(4) == 0) cancel();
+    }
+    /* The calendar has moved its day on to what runs next, possibly a
+     * long way ahead; schedule before it */
+    void stopped(){
+        for(uint32_t i = 0; i < 5; i++)
+            activityNew(manager_->now().value() + (1 + random(100)) / 10.0, random(4), 0, 0);
+    }
+private:
+    std::set<std::string> waves_;
+};
+
+TEST(Activity, QueuePoliciesWaves){
+    std::vector<double> times;
+    times.push_back(40.0);
+    times.push_back(60000.0);
+    times.push_back(100000.0);
+    times.push_back(1000000.0);
+    ASSERT_LT(900u, expectSameOrder<WavesWorkload>(times));
+}
+
+/* Periodic activities on a quarter-hour grid, tied with each other and
+ * with one-off activities, and a few periods long enough to start on the
+ * upper levels of the timing wheel or in its overflow list */
+class PeriodicWorkload : public Workload {
+public:
+    PeriodicWorkload(Activity::Manager::QueuePolicy policy) : Workload(policy) {
+        for(uint32_t i = 0; i < 60; i++)
+            activityNew(random(20) / 4.0, random(3), (1 + random(20)) / 4.0, 1 + random(20));
+        for(uint32_t i = 0; i < 40; i++) activityNew(random(40) / 4.0, random(3), 0, 0);
+        double periods[] = { 300.0, 50000.0, 2000000.0 };
+        for(uint32_t i = 0; i < 3; i++) activityNew(1.0, random(3), periods[i], 4);
+        activityNew(3000000.0, 0, 0.5, 3);
+    }
+    void ran(Activity::Activity* activity){
+        Workload::ran(activity);
+        if(random(3) == 0) activityNew(manager_->now().value() + (1 + random(20)) / 4.0, random(3), 0, 0);
+        if(random(8) == 0) cancel();
+    }
+};
+
+TEST(Activity, QueuePoliciesPeriodic){
+    std::vector<double> times;
+    times.push_back(10.0);
+    times.push_back(10000.0);
+    times.push_back(10000000.0);
+    ASSERT_LT(500u, expectSameOrder<PeriodicWorkload>(times));
+}
+
+
+/* Logs its name when it runs */
+class NameRecorder : public Activity::Activity::Notifiee {
+public:
+    NameRecorder(std::string name, std::vector<std::string>* order) : name_(name), order_(order) {}
+    void onStatus(){
+        if (notifier_->status() == Activity::Activity::executing()) order_->push_back(name_);
+    }
+private:
+    std::string name_;
+    std::vector<std::string>* order_;
+};
+
+static void anonymousSchedule(ManagerPtr manager, Activity::ActivityHandle handle, Activity::Activity::Notifiee* notifiee, double t){
+    Activity::ActivityPtr activity = manager->activity(handle);
+    activity->lastNotifieeIs(notifiee);
+    activity->nextTimeIs(t);
+    activity->statusIs(Activity::Activity::nextTimeScheduled());
+    manager->lastActivityIs(activity);
+}
+
+TEST(Activity, AnonymousHandles){
+    ManagerPtr manager = Activity::Manager::ManagerIs();
+    std::vector<std::string> order;
+
+    // a slot and its activity are reused once the pool holds the last
+    // reference, under a handle of the next generation
+    Activity::ActivityHandle first = manager->anonymousActivityNew();
+    Activity::Activity* activity = manager->activity(first).ptr();
+    manager->activityDel(first);
+    ASSERT_TRUE(manager->activity(first) == NULL);
+    Activity::ActivityHandle reused = manager->anonymousActivityNew();
+    ASSERT_EQ((uint32_t)first, (uint32_t)reused);
+    ASSERT_TRUE(first != reused);
+    ASSERT_TRUE(manager->activity(reused).ptr() == activity);
+    ASSERT_EQ(reused, activity->handle());
+
+    // an activity deleted while still queued keeps its slot's next
+    // activity from reusing it, and still runs
+    anonymousSchedule(manager, reused, new NameRecorder("deleted", &order), 1.0);
+    manager->activityDel(reused);
+    Activity::ActivityHandle fresh = manager->anonymousActivityNew();
+    ASSERT_EQ((uint32_t)reused, (uint32_t)fresh);
+    ASSERT_TRUE(manager->activity(fresh).ptr() != activity);
+    anonymousSchedule(manager, fresh, new NameRecorder("fresh", &order), 2.0);
+
+    // stale handles are ignored, rather than reaching the slot's new
+    // activity or handing the slot out twice
+    manager->activityCancel(reused);
+    manager->activityCancel(first);
+    manager->activityDel(reused);
+    ASSERT_EQ(Activity::Activity::nextTimeScheduled(), activity->status());
+    ASSERT_EQ(Activity::Activity::nextTimeScheduled(), manager->activity(fresh)->status());
+    ASSERT_TRUE((uint32_t)manager->anonymousActivityNew() != (uint32_t)fresh);
+    ASSERT_TRUE(manager->activity(Activity::noHandle) == NULL);
+    manager->nowIs(3.0);
+    ASSERT_EQ(2u, order.size());
+    ASSERT_EQ("deleted", order[0]);
+    ASSERT_EQ("fresh", order[1]);
+
+    // a live handle still cancels
+    Activity::ActivityHandle cancelled = manager->anonymousActivityNew();
+    anonymousSchedule(manager, cancelled, new NameRecorder("cancelled", &order), 4.0);
+    manager->activityCancel(cancelled);
+    manager->nowIs(5.0);
+    ASSERT_EQ(2u, order.size());
+}
+
+TEST(Engine, InjectGroups){
+    ManagerPtr manager = Activity::Manager::ManagerIs();
+    ShippingNetworkPtr nwk = ShippingNetwork::ShippingNetworkIs("network",manager);
+    std::vector<CustomerPtr> customers;
+    for(uint32_t i = 0; i < 3; i++){
+        std::stringstream name; name << "c" << i;
+        customers.push_back(dynamic_cast<Customer*>(nwk->LocationNew(name.str(),Location::customer()).ptr()));
+    }
+    LocationPtr dest = nwk->LocationNew("dest",Location::customer());
+    for(uint32_t i = 0; i < customers.size(); i++){
+        customers[i]->destinationIs(dest);
+        customers[i]->shipmentSizeIs(1);
+        customers[i]->transferRateIs(8);
+    }
+
+    // customers on the same schedule share one activity
+    Activity::ActivityPtr every3 = manager->activity("inject every 3000000 at 0");
+    ASSERT_TRUE(every3);
+    InjectActivityReactor* group = dynamic_cast<InjectActivityReactor*>(every3->notifiee().ptr());
+    ASSERT_TRUE(group->sources() == 3);
+    ASSERT_TRUE(group->source(0) == customers[0]);
+
+    // changing the rate moves a customer to another group
+    customers[1]->transferRateIs(4);
+    ASSERT_TRUE(group->sources() == 2);
+    ASSERT_TRUE(group->source(1) == customers[2]);
+    Activity::ActivityPtr every6 = manager->activity("inject every 6000000 at 0");
+    ASSERT_TRUE(every6);
+
+    // and an empty group goes away
+    customers[1]->transferRateIs(0);
+    ASSERT_TRUE(!manager->activity("inject every 6000000 at 0"));
+}
+
+TEST(Engine, ShipmentIds){
+    ShipmentPtr a = Shipment::ShipmentNew();
+    ShipmentPtr b = Shipment::ShipmentNew();
+    ASSERT_TRUE(a->id() > 0);
+    ASSERT_TRUE(b->id() == a->id() + 1);
+    ASSERT_TRUE(b->name() != a->name());
+
+    // a restored shipment keeps its id, and new ones come after it
+    ShipmentPtr restored = Shipment::ShipmentNew(b->id() + 100);
+    ASSERT_TRUE(restored->id() == b->id() + 100);
+    ASSERT_TRUE(Shipment::ShipmentNew()->id() == b->id() + 101);
+}
+
+static void* releaseShipments(void* arg){
+    static_cast<std::vector<ShipmentPtr>*>(arg)->clear();
+    return NULL;
+}
+
+TEST(Engine, ShipmentSlab){
+    // a shipment's slot is reused once its last reference drops, before
+    // the slab grows
+    ShipmentSlabPtr slab = ShipmentSlab::ShipmentSlabNew();
+    ShipmentPtr a = Shipment::ShipmentNew(slab.ptr());
+    Shipment* slot = a.ptr();
+    ShipmentPtr b = Shipment::ShipmentNew(slab.ptr());
+    ASSERT_TRUE(b.ptr() != slot);
+    ASSERT_TRUE(a->slab() == slab && slab->slots() == 256);
+    a = NULL;
+    std::vector<ShipmentPtr> shipments;
+    while(shipments.size() < 255 && (shipments.empty() || shipments.back().ptr() != slot))
+        shipments.push_back(Shipment::ShipmentNew(slab.ptr()));
+    ASSERT_TRUE(shipments.back().ptr() == slot);
+    ASSERT_TRUE(shipments.back()->cost() == 0);
+    ASSERT_TRUE(shipments[0]->id() == b->id() + 1);
+    ASSERT_TRUE(slab->slots() == 256);
+    ASSERT_TRUE(!Shipment::ShipmentNew()->slab());
+
+    // slots freed on another thread go back to the slab they came from
+    size_t count = shipments.size();
+    pthread_t thread;
+    ASSERT_EQ(0, pthread_create(&thread, NULL, releaseShipments, &shipments));
+    pthread_join(thread, NULL);
+    for(size_t i = 0; i < count; i++) shipments.push_back(Shipment::ShipmentNew(slab.ptr()));
+    ASSERT_TRUE(slab->slots() == 256);
+
+    // and the slab lives as long as its shipments
+    slab = NULL;
+    shipments.clear();
+    ASSERT_TRUE(b->slab()->slots() == 256);
+}
+
+/* Records the times it runs at */
+class RunRecorder : public Activity::Activity::Notifiee {
+public:
+    RunRecorder(ManagerPtr manager, std::vector<double>* runs) : manager_(manager), runs_(runs) {}
+    void onStatus(){
+        if (notifier_->status() == Activity::Activity::executing()) runs_->push_back(manager_->now().value());
+    }
+private:
+    ManagerPtr manager_;
+    std::vector<double>* runs_;
+};
+
+struct Producer {
+    ManagerPtr manager;
+    std::vector<double>* runs;
+};
+
+static void* produce(void* arg){
+    Producer* producer = static_cast<Producer*>(arg);
+    for(uint32_t i = 0; i < 100; i++)
+        producer->manager->externalActivityNew(1.0 + i % 10, 0, new RunRecorder(producer->manager, producer->runs));
+    return NULL;
+}
+
+TEST(Activity, ExternalActivities){
+    ManagerPtr manager = Activity::Manager::ManagerIs();
+    std::vector<double> runs;
+    Producer producer;
+    producer.manager = manager;
+    producer.runs = &runs;
+    pthread_t thread;
+    ASSERT_EQ(0, pthread_create(&thread, NULL, produce, &producer));
+    pthread_join(thread, NULL);
+
+    // taken in and run in time order by the simulation thread
+    manager->nowIs(5.0);
+    ASSERT_EQ(50u, runs.size());
+    for(uint32_t i = 1; i < runs.size(); i++) ASSERT_TRUE(runs[i-1] <= runs[i]);
+    manager->nowIs(20.0);
+    ASSERT_EQ(100u, runs.size());
+
+    // an activity posted for a past time runs at the current time
+    manager->externalActivityNew(3.0, 0, new RunRecorder(manager, &runs));
+    manager->nowIs(21.0);
+    ASSERT_EQ(101u, runs.size());
+    ASSERT_EQ(20.0, runs.back());
+}
+
+#ifdef FWK_ATOMIC_REFS
+/* Counts its runs, and logs the time it was posted for and the time it
+ * ran at */
+class PostedRecorder : public Activity::Activity::Notifiee {
+public:
+    PostedRecorder(ManagerPtr manager, double posted, std::vector<uint32_t>* runs, uint32_t id,
+                   std::vector< std::pair<double, double> >* times) :
+        manager_(manager), posted_(posted), runs_(runs), id_(id), times_(times) {}
+    void onStatus(){
+        if (notifier_->status() != Activity::Activity::executing()) return;
+        (*runs_)[id_]++;
+        times_->push_back(std::make_pair(posted_, manager_->now().value()));
+    }
+private:
+    ManagerPtr manager_;
+    double posted_;
+    std::vector<uint32_t>* runs_;
+    uint32_t id_;
+    std::vector< std::pair<double, double> >* times_;
+};
+
+struct ConcurrentProducer {
+    ManagerPtr manager;
+    uint32_t first;
+    // posts made by every producer so far
+    uint32_t* posted;
+    std::vector<uint32_t>* runs;
+    std::vector< std::pair<double, double> >* times;
+};
+
+static const uint32_t concurrentPosts = 2000;
+
+static void* produceConcurrently(void* arg){
+    ConcurrentProducer* producer = static_cast<ConcurrentProducer*>(arg);
+    for(uint32_t i = 0; i < concurrentPosts; i++){
+        uint32_t id = producer->first + i;
+        double t = 1.0 + (id * 7 % 400) / 4.0;
+        producer->manager->externalActivityNew(t, id % 3, new PostedRecorder(producer->manager, t, producer->runs, id, producer->times));
+        __sync_fetch_and_add(producer->posted, 1);
+        if(i % 64 == 0) sched_yield();
+    }
+    return NULL;
+}
+
+TEST(Activity, ConcurrentProducers){
+    ManagerPtr manager = Activity::Manager::ManagerIs();
+    const uint32_t producers = 4;
+    std::vector<uint32_t> runs(producers * concurrentPosts, 0);
+    std::vector< std::pair<double, double> > times;
+    uint32_t posted = 0;
+    ConcurrentProducer producer[producers];
+    pthread_t threads[producers];
+    for(uint32_t i = 0; i < producers; i++){
+        producer[i].manager = manager;
+        producer[i].first = i * concurrentPosts;
+        producer[i].posted = &posted;
+        producer[i].runs = &runs;
+        producer[i].times = &times;
+        ASSERT_EQ(0, pthread_create(&threads[i], NULL, produceConcurrently, &producer[i]));
+    }
+
+    // the simulation thread takes posts in while they are still coming,
+    // keeping its time in step with how many have been made
+    while(times.size() < runs.size()){
+        uint32_t made = __atomic_load_n(&posted, __ATOMIC_RELAXED);
+        manager->nowIs(1.0 + made * 101.0 / runs.size());
+    }
+    for(uint32_t i = 0; i < producers; i++) pthread_join(threads[i], NULL);
+
+    // each ran once, never before its time, and in time order; one posted
+    // for a time already passed ran at the time it was taken in
+    for(uint32_t i = 0; i < runs.size(); i++) ASSERT_EQ(1u, runs[i]) << i;
+    ASSERT_EQ(runs.size(), times.size());
+    for(uint32_t i = 0; i < times.size(); i++){
+        ASSERT_LE(times[i].first, times[i].second);
+        if(i > 0) ASSERT_LE(times[i-1].second, times[i].second);
+    }
+}
+#endif
+
+/* Logs the pieces of work it runs */
+class LaneRecorder : public Activity::Manager::Lane {
+public:
+    LaneRecorder(ManagerPtr manager, std::vector<std::string>* order) : manager_(manager), order_(order) {}
+    void pieceNew(const std::string& name){
+        pieces_.push_back(name);
+        manager_->deferredNew(this);
+    }
+    void deferredRun(){
+        std::stringstream piece; piece << pieces_.front() << "@" << manager_->now().value();
+        order_->push_back(piece.str());
+        pieces_.pop_front();
+    }
+private:
+    ManagerPtr manager_;
+    std::vector<std::string>* order_;
+    std::deque<std::string> pieces_;
+};
+
+/* Logs its name when it runs, and queues deferred work if given a lane */
+class OrderRecorder : public Activity::Activity::Notifiee {
+public:
+    OrderRecorder(std::string name, std::vector<std::string>* order, LaneRecorder* lane) : name_(name), order_(order), lane_(lane) {}
+    void onStatus(){
+        if (notifier_->status() != Activity::Activity::executing()) return;
+        order_->push_back(name_);
+        if (lane_) lane_->pieceNew(name_ + " deferred");
+    }
+private:
+    std::string name_;
+    std::vector<std::string>* order_;
+    LaneRecorder* lane_;
+};
+
+static void orderedActivityNew(ManagerPtr manager, OrderRecorder* recorder, const std::string& name, double t, uint8_t priority){
+    Activity::ActivityPtr activity = manager->activityNew(name);
+    activity->lastNotifieeIs(recorder);
+    activity->nextTimeIs(t);
+    activity->priorityIs(priority);
+    activity->statusIs(Activity::Activity::nextTimeScheduled());
+    manager->lastActivityIs(activity);
+}
+
+TEST(Activity, DeferredLane){
+    ManagerPtr manager = Activity::Manager::ManagerIs();
+    std::vector<std::string> order;
+    Fwk::Ptr<LaneRecorder> lane = new LaneRecorder(manager, &order);
+    orderedActivityNew(manager, new OrderRecorder("inject", &order, NULL), "inject", 1.0, 2);
+    orderedActivityNew(manager, new OrderRecorder("carrier", &order, lane.ptr()), "carrier", 1.0, 1);
+    orderedActivityNew(manager, new OrderRecorder("late", &order, NULL), "late", 1.0, 2);
+    orderedActivityNew(manager, new OrderRecorder("next", &order, NULL), "next", 2.0, 1);
+
+    // deferred work runs where a priority 2 activity scheduled with it
+    // would, and within the time step it was queued in
+    manager->nowIs(1.0);
+    ASSERT_EQ(4u, order.size());
+    ASSERT_EQ("carrier", order[0]);
+    ASSERT_EQ("inject", order[1]);
+    ASSERT_EQ("late", order[2]);
+    ASSERT_EQ("carrier deferred@1", order[3]);
+    manager->nowIs(2.0);
+    ASSERT_EQ(5u, order.size());
+    ASSERT_EQ("next", order[4]);
+}
+
+TEST(Activity, CancelCompaction){
+    Activity::Manager::QueuePolicy policies[] = {
+        Activity::Manager::heap(), Activity::Manager::radixHeap(), Activity::Manager::calendarQueue()
+    };
+    for(uint32_t p = 0; p < 3; p++){
+        ManagerPtr manager = Activity::Manager::ManagerIs(policies[p]);
+        std::vector<std::string> order;
+        // one-off activities on the hour and periodic ones in between, so
+        // each queue holds 100 and no two run at once
+        std::vector<Activity::ActivityPtr> activities;
+        for(uint32_t i = 0; i < 200; i++){
+            std::stringstream name;
+            name << (i < 100 ? "once" : "periodic") << i % 100;
+            Activity::ActivityHandle handle = manager->anonymousActivityNew();
+            if(i >= 100) manager->activity(handle)->periodIs(10.0);
+            anonymousSchedule(manager, handle, new OrderRecorder(name.str(), &order, NULL),
+                              i < 100 ? i + 1.0 : i % 100 / 10.0 + 0.25);
+            activities.push_back(manager->activity(handle));
+        }
+        // a queued activity is referenced by the pool, the queue and here
+        std::vector<uint32_t> cancelled;
+        for(uint32_t i = 0; i < 200; i++){
+            if(i % 100 % 3 == 0) continue;
+            manager->activityCancel(activities[i]->handle());
+            cancelled.push_back(i);
+            // the 100th tombstone is half of the scheduled entries
+            if(cancelled.size() == 99){
+                ASSERT_EQ(3u, activities[i]->references());
+            }
+        }
+        // compacting dropped the first 100, one-off and periodic alike;
+        // the rest are tombstones again
+        for(uint32_t c = 0; c < cancelled.size(); c++)
+            ASSERT_EQ(c < 100 ? 2u : 3u, activities[cancelled[c]]->references()) << c;
+
+        // what is left runs in order, the periodic activities every ten
+        // hours; nothing cancelled runs
+        std::vector< std::pair<double, std::string> > expected;
+        for(uint32_t i = 0; i < 100; i += 3){
+            std::stringstream once, periodic;
+            once << "once" << i;
+            periodic << "periodic" << i;
+            if(i + 1.0 <= 30.0) expected.push_back(std::make_pair(i + 1.0, once.str()));
+            for(double t = i / 10.0 + 0.25; t <= 30.0; t += 10.0) expected.push_back(std::make_pair(t, periodic.str()));
+        }
+        std::sort(expected.begin(), expected.end());
+        manager->nowIs(30.0);
+        ASSERT_EQ(expected.size(), order.size());
+        for(size_t i = 0; i < order.size(); i++) ASSERT_EQ(expected[i].second, order[i]) << "policy " << p << " at " << i;
+    }
+}
+
+/* Logs each batch it is handed before running it */
+class BatchRecorder : public OrderRecorder {
+public:
+    BatchRecorder(std::string name, std::vector<std::string>* order) : OrderRecorder(name, order, NULL), order_(order) {}
+    void onStatusBatch(const std::vector<Activity::ActivityPtr>& batch){
+        std::stringstream entry;
+        entry << "batch of " << batch.size();
+        order_->push_back(entry.str());
+        Activity::Activity::Notifiee::onStatusBatch(batch);
+    }
+private:
+    std::vector<std::string>* order_;
+};
+
+TEST(Activity, BatchDispatch){
+    ManagerPtr manager = Activity::Manager::ManagerIs();
+    manager->batchDispatchIs(true);
+    std::vector<std::string> order;
+    orderedActivityNew(manager, new OrderRecorder("a1", &order, NULL), "a1", 1.0, 1);
+    orderedActivityNew(manager, new BatchRecorder("b1", &order), "b1", 1.0, 1);
+    orderedActivityNew(manager, new OrderRecorder("a2", &order, NULL), "a2", 1.0, 1);
+    orderedActivityNew(manager, new BatchRecorder("b2", &order), "b2", 1.0, 1);
+    orderedActivityNew(manager, new OrderRecorder("a3", &order, NULL), "a3", 1.0, 1);
+    orderedActivityNew(manager, new BatchRecorder("b3", &order), "b3", 1.0, 2);
+    orderedActivityNew(manager, new BatchRecorder("b4", &order), "b4", 2.0, 1);
+
+    // a (time, priority) class is taken off the queues as one batch and
+    // run one notifiee type at a time, in the order the types first
+    // appear; every activity counts as an event
+    manager->nowIs(1.0);
+    const char* expected[] = { "a1", "a2", "a3", "batch of 2", "b1", "b2", "batch of 1", "b3" };
+    ASSERT_EQ(8u, order.size());
+    for(uint32_t i = 0; i < 8; i++) ASSERT_EQ(expected[i], order[i]);
+    ASSERT_EQ(6u, manager->events());
+    manager->nowIs(2.0);
+    ASSERT_EQ(10u, order.size());
+    ASSERT_EQ("b4", order[9]);
+}
+
+/* Logs each step of its body with the time it ran at */
+class StepCoroutine : public Activity::Coroutine {
+public:
+    StepCoroutine(ManagerPtr manager, std::vector<std::string>* order) : manager_(manager), order_(order) {}
+    void resume(){
+        COROUTINE_BEGIN;
+        step("start");
+        COROUTINE_SLEEP(1.0);
+        step("woke");
+        COROUTINE_SLEEP(2.5);
+        step("parked");
+        COROUTINE_PARK;
+        step("resumed");
+        COROUTINE_END;
+    }
+private:
+    void step(const std::string& name){
+        std::stringstream entry;
+        entry << name << "@" << manager_->now().value();
+        order_->push_back(entry.str());
+    }
+    ManagerPtr manager_;
+    std::vector<std::string>* order_;
+};
+
+TEST(Activity, CoroutineSteps){
+    ManagerPtr manager = Activity::Manager::ManagerIs();
+    std::vector<std::string> order;
+    Fwk::Ptr<StepCoroutine> coroutine = new StepCoroutine(manager, &order);
+    StepCoroutine* frame = coroutine.ptr();
+
+    // the body runs up to its first sleep at once, then a step per wake
+    manager->coroutineNew(coroutine.ptr());
+    Activity::ActivityHandle handle = coroutine->notifier()->handle();
+    ASSERT_EQ(1u, order.size());
+    ASSERT_EQ("start@0", order[0]);
+    manager->nowIs(1.0);
+    ASSERT_EQ(2u, order.size());
+    ASSERT_EQ("woke@1", order[1]);
+    manager->nowIs(3.5);
+    ASSERT_EQ(3u, order.size());
+    ASSERT_EQ("parked@3.5", order[2]);
+
+    // a parked coroutine keeps its activity off the queues until resumed
+    ASSERT_TRUE(manager->scheduledActivities().empty());
+    manager->nowIs(10.0);
+    ASSERT_EQ(3u, order.size());
+    ASSERT_FALSE(coroutine->done());
+    manager->coroutineResume(coroutine.ptr());
+    ASSERT_EQ(4u, order.size());
+    ASSERT_EQ("resumed@10", order[3]);
+    ASSERT_TRUE(coroutine->done());
+    ASSERT_TRUE(manager->activity(handle) == NULL);
+
+    // reusing the slot drops the activity's hold on the coroutine; its
+    // frame goes back on the free list for the next coroutine of its size,
+    // not to the heap
+    coroutine = NULL;
+    manager->anonymousActivityNew();
+    void* other = ::operator new(sizeof(StepCoroutine));
+    Fwk::Ptr<StepCoroutine> next = new StepCoroutine(manager, &order);
+    ::operator delete(other);
+    ASSERT_TRUE(next.ptr() == frame);
+}
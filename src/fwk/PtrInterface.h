@@ -12,8 +12,14 @@ public:
     PtrInterface() : ref_(0) {}
     unsigned long references() const { return ref_; }
     // DRC - support for templates
+#ifdef FWK_ATOMIC_REFS
+    // objects shared between simulation threads need atomic counts
+    inline const PtrInterface * newRef() const { __sync_add_and_fetch(&ref_, 1); return this; }
+    inline void deleteRef() const { if( __sync_sub_and_fetch(&ref_, 1) == 0 ) onZeroReferences(); }
+#else
     inline const PtrInterface * newRef() const { ++ref_; return this; }
     inline void deleteRef() const { if( --ref_ == 0 ) onZeroReferences(); }
+#endif
 protected:
     virtual ~PtrInterface() {}
     virtual void onZeroReferences() const { delete this; }
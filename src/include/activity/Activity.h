@@ -4,8 +4,12 @@
 #include <string>
 #include <functional>
 #include <map>
+#include <vector>
 #include <queue>
+#include <deque>
 #include <cmath>
+#include <typeinfo>
+#include <stdint.h>
 
 #include "fwk/Ptr.h"
 #include "fwk/NamedInterface.h"
@@ -24,16 +28,42 @@ class Manager;
 typedef Fwk::Ptr<Manager> ManagerPtr;
 typedef Fwk::Ptr<Manager const> ManagerPtrConst;
 
+class ParallelManager;
+typedef Fwk::Ptr<ParallelManager> ParallelManagerPtr;
+
+class Coroutine;
+typedef Fwk::Ptr<Coroutine> CoroutinePtr;
+
+class PaceGate;
+typedef Fwk::Ptr<PaceGate> PaceGatePtr;
+
+/* Anonymous activity of a manager's pool: the slot in the low 32 bits, and
+ * in the high ones the generation of the slot it was handed out in */
+typedef uint64_t ActivityHandle;
+static const ActivityHandle noHandle = ~(ActivityHandle)0;
+
 class Priority : public Ordinal<Priority,uint8_t>{
 public:
     Priority(uint8_t priority) : Ordinal<Priority,uint8_t>(priority){}
 };
 
+/* Fixed-point time in microhours, used to order activities exactly */
+typedef int64_t Tick;
+static const Tick ticksPerHour = 1000000;
+static const Tick maxTick = 0x7fffffffffffffffLL;
+
 /* Define the type 'Time' */
 class Time : public Ordinal<Time,double> {
 public:
     Time(double time) : Ordinal<Time,double>(time)
     {}
+    /* Nearest tick; saturates for infinite and out of range times */
+    Tick tick() const {
+        double t = value_ * ticksPerHour;
+        if (!(t < (double)maxTick)) return maxTick;
+        if (!(t > -(double)maxTick)) return -maxTick;
+        return (Tick)floor(t + 0.5);
+    }
     std::string str() {
         std::stringstream s;
         s.precision(2);
@@ -42,6 +72,184 @@ public:
     }
 };
 
+/* Point on the monotonic wall clock, in nanoseconds */
+class WallTime : public Ordinal<WallTime,uint64_t> {
+public:
+    explicit WallTime(uint64_t nanoseconds) : Ordinal<WallTime,uint64_t>(nanoseconds)
+    {}
+    static WallTime now();
+    /* now() plus the given number of seconds */
+    static WallTime nowPlus(double seconds);
+    /* Later than any other wall time */
+    static WallTime never(){ return WallTime(~(uint64_t)0); }
+};
+
+/* Holds a manager's time to another clock. nowIs() passes the gate with
+ * the time of each new time step before running it, and with the time it
+ * stops at; timeIs() returns once the clock has caught up. */
+class PaceGate : public Fwk::PtrInterface<PaceGate> {
+public:
+    virtual ~PaceGate(){}
+    virtual void timeIs(Time t) = 0;
+};
+
+/* Undo log of a partition running ahead of what is known to be safe.
+ * Code about to change simulation state records it through the static
+ * save functions, which do nothing unless the running thread has a
+ * current journal. Each record keeps its owner alive until the journal
+ * forgets it.
+ */
+class Journal {
+public:
+    class Entry {
+    public:
+        virtual ~Entry(){}
+        virtual void undo() = 0;
+    };
+
+    /* Journal of the partition running on this thread, NULL when state
+     * changes need no recording */
+    static inline Journal* current() { return current_; }
+    static void currentIs(Journal* journal) { current_ = journal; }
+
+    /* Record the value of field, a member of owner */
+    template<class O, class T> static void save(O* owner, T& field){
+        Journal* journal = current();
+        if (journal) journal->entryIs(new Field<O,T>(owner, field));
+    }
+    /* Record element i of vector v, a member of owner */
+    template<class O, class T> static void saveElement(O* owner, vector<T>& v, size_t i){
+        Journal* journal = current();
+        if (journal) journal->entryIs(new Element<O,T>(owner, v, i));
+    }
+    /* Record that an element is about to be appended to sequence s */
+    template<class O, class S> static void savePushBack(O* owner, S& s){
+        Journal* journal = current();
+        if (journal) journal->entryIs(new PushBack<O,S>(owner, s));
+    }
+    /* Record the last element of sequence s, about to be removed */
+    template<class O, class S> static void savePopBack(O* owner, S& s){
+        Journal* journal = current();
+        if (journal) journal->entryIs(new PopBack<O,S>(owner, s));
+    }
+    /* Record the first element of sequence s, about to be removed */
+    template<class O, class S> static void savePopFront(O* owner, S& s){
+        Journal* journal = current();
+        if (journal) journal->entryIs(new PopFront<O,S>(owner, s));
+    }
+    /* Record that an element is about to be prepended to sequence s */
+    template<class O, class S> static void savePushFront(O* owner, S& s){
+        Journal* journal = current();
+        if (journal) journal->entryIs(new PushFront<O,S>(owner, s));
+    }
+    /* Record the value m holds under key, or its absence */
+    template<class O, class M> static void saveKey(O* owner, M& m, const typename M::key_type& key){
+        Journal* journal = current();
+        if (journal) journal->entryIs(new Key<O,M>(owner, m, key));
+    }
+
+    /* Number of the current mark; unique across journals */
+    inline uint64_t epoch() const { return epoch_; }
+    /* Tick of the latest mark, 0 when there is none */
+    inline Tick markTick() const { return marks_.empty() ? 0 : marks_.back().first; }
+    void entryIs(Entry* entry){ entries_.push_back(entry); }
+    /* Start the records of the activities run at tick */
+    void markIs(Tick tick);
+    /* Undo, newest first, everything recorded since the first mark at or
+     * after tick */
+    void rollbackIs(Tick tick);
+    /* Forget every record; none of it can be rolled back any more */
+    void entriesDel();
+    Journal();
+    ~Journal();
+private:
+    template<class O, class T> class Field : public Entry {
+    public:
+        Field(O* owner, T& field) : owner_(owner), field_(field), value_(field) {}
+        void undo(){ field_ = value_; }
+    private:
+        Fwk::Ptr<O> owner_;
+        T& field_;
+        T value_;
+    };
+    template<class O, class T> class Element : public Entry {
+    public:
+        Element(O* owner, vector<T>& v, size_t i) : owner_(owner), v_(v), i_(i), value_(v[i]) {}
+        void undo(){ v_[i_] = value_; }
+    private:
+        Fwk::Ptr<O> owner_;
+        vector<T>& v_;
+        size_t i_;
+        T value_;
+    };
+    template<class O, class S> class PushBack : public Entry {
+    public:
+        PushBack(O* owner, S& s) : owner_(owner), s_(s) {}
+        void undo(){ s_.pop_back(); }
+    private:
+        Fwk::Ptr<O> owner_;
+        S& s_;
+    };
+    template<class O, class S> class PopBack : public Entry {
+    public:
+        PopBack(O* owner, S& s) : owner_(owner), s_(s), value_(s.back()) {}
+        void undo(){ s_.push_back(value_); }
+    private:
+        Fwk::Ptr<O> owner_;
+        S& s_;
+        typename S::value_type value_;
+    };
+    template<class O, class S> class PopFront : public Entry {
+    public:
+        PopFront(O* owner, S& s) : owner_(owner), s_(s), value_(s.front()) {}
+        void undo(){ s_.push_front(value_); }
+    private:
+        Fwk::Ptr<O> owner_;
+        S& s_;
+        typename S::value_type value_;
+    };
+    template<class O, class S> class PushFront : public Entry {
+    public:
+        PushFront(O* owner, S& s) : owner_(owner), s_(s) {}
+        void undo(){ s_.pop_front(); }
+    private:
+        Fwk::Ptr<O> owner_;
+        S& s_;
+    };
+    template<class O, class M> class Key : public Entry {
+    public:
+        Key(O* owner, M& m, const typename M::key_type& key) :
+            owner_(owner), m_(m), key_(key), present_(false), value_() {
+            typename M::iterator it = m.find(key);
+            if (it != m.end()) {
+                present_ = true;
+                value_ = it->second;
+            }
+        }
+        void undo(){
+            if (present_) m_[key_] = value_;
+            else m_.erase(key_);
+        }
+    private:
+        Fwk::Ptr<O> owner_;
+        M& m_;
+        typename M::key_type key_;
+        bool present_;
+        typename M::mapped_type value_;
+    };
+
+#ifdef FWK_ATOMIC_REFS
+    static __thread Journal* current_;
+#else
+    static Journal* current_;
+#endif
+    Journal(const Journal&);
+    vector<Entry*> entries_;
+    // (tick, first entry) of each mark
+    vector< pair<Tick, size_t> > marks_;
+    uint64_t epoch_;
+};
+
 class Activity : public Fwk::NamedInterface {
 
 public:
@@ -51,6 +259,10 @@ public:
     public:
         virtual void onNextTime() {}
         virtual void onStatus() {}
+        /* Called in batch dispatch mode with activities of one (time,
+         * priority) class whose notifiees share this one's type. The
+         * default runs each of them through executing and free in turn. */
+        virtual void onStatusBatch(const vector<ActivityPtr>& batch);
         inline ActivityPtr notifier(){ return notifier_; }
         void notifierIs(Activity* notifier){ notifier_=notifier; }
     protected:
@@ -75,53 +287,451 @@ public:
     inline Status status() const { return status_; }
     inline Time nextTime() const { return nextTime_; }
     inline NotifieePtr notifiee() { return notifiee_; }
-    inline Priority priority() { return priority_; }
+    inline Priority priority() const { return priority_; }
+    inline Time period() const { return period_; }
+    inline Tick tick() const { return tick_; }
+    /* Order in which the manager was asked to schedule the activity */
+    inline uint64_t sequence() const { return sequence_; }
+    /* Pool handle of an anonymous activity, noHandle for named ones */
+    inline ActivityHandle handle() const { return handle_; }
 
     /* Mutators */
     void statusIs(Status s);    
     void nextTimeIs(Time t);
     void lastNotifieeIs(Notifiee* n);
     void priorityIs(Priority priority);
+    /* A positive period makes the activity periodic: each time it runs and
+     * is left free, the manager schedules it again one period later. */
+    void periodIs(Time period);
 
 private:
+    class State;
     Activity(string name, ManagerPtr manager); 
+    void reset();
+    // record the fields in the current journal, once per mark
+    void save();
+    void coroutineRun();
     string name_;
     friend class Manager;
+    friend class Coroutine;
     Status status_;
     Time nextTime_;
+    Tick tick_;
+    uint64_t sequence_;
     NotifieePtr notifiee_;
     ManagerPtr manager_;
     Priority priority_;    
+    Time period_;
+    ActivityHandle handle_;
+    // set while the manager holds a queue entry for the activity
+    bool queued_;
+    // the notifiee is a Coroutine, resumed instead of notified
+    bool coroutine_;
+    uint64_t savedEpoch_;
 };
 
-//Comparison class for activities   
+/* Activity behaviour written as a stackless coroutine. The body goes in
+ * resume(), between COROUTINE_BEGIN and COROUTINE_END, and waits with
+ * COROUTINE_SLEEP(delay). State that lives across a sleep must be kept in
+ * members; locals do not survive it. COROUTINE_PARK waits with no time
+ * set: the activity stays with the coroutine, off the queues, until
+ * Manager::coroutineResume(). The manager resumes the coroutine directly
+ * rather than through statusIs(), and hands its activity back to the pool
+ * once the body ends. Coroutines are allocated from per-size
+ * free lists, so starting one costs no trip to the heap once the lists
+ * are warm.
+ */
+class Coroutine : public Activity::Notifiee {
+public:
+    /* Run the body until it sleeps or ends */
+    virtual void resume() = 0;
+    /* Resumes every activity of a batch in turn */
+    void onStatusBatch(const vector<ActivityPtr>& batch);
+    inline bool done() const { return line_ < 0; }
+    /* Resume point, for checkpoints */
+    inline int line() const { return line_; }
+
+    static void* operator new(size_t size);
+    static void operator delete(void* frame, size_t size);
+protected:
+    Coroutine() : line_(0) {}
+    /* Resume point; journaled like the rest of the simulation state */
+    void lineIs(int line);
+    /* Schedule the next resume delay after the current time */
+    void sleepIs(Time delay);
+    int line_;
+};
+
+#define COROUTINE_BEGIN switch (line_) { case 0:
+#define COROUTINE_SLEEP(delay) \
+    do { lineIs(__LINE__); sleepIs(delay); return; case __LINE__:; } while (0)
+#define COROUTINE_PARK \
+    do { lineIs(__LINE__); return; case __LINE__:; } while (0)
+#define COROUTINE_END } lineIs(-1)
+
+//Comparison class for activities: by tick, then priority, then the order
+//in which they were scheduled
 class ActivityComp : public binary_function<ActivityPtr, ActivityPtr, bool> {
 public:
     ActivityComp() {}
-    bool operator()(ActivityPtr a, ActivityPtr b) const {
-        if(abs(a->nextTime().value() - b->nextTime().value()) > 0.0005) return (a->nextTime() > b->nextTime());
-        return a->priority() > b->priority();
+    bool operator()(const ActivityPtr& a, const ActivityPtr& b) const {
+        if (a->tick() != b->tick()) return a->tick() > b->tick();
+        if (a->priority() != b->priority()) return a->priority() > b->priority();
+        return a->sequence() > b->sequence();
     }
 };
 
+/* Scheduler counters of a manager. They are only kept when the activity
+ * library is built with ACTIVITY_TELEMETRY; otherwise they stay zero and
+ * cost nothing.
+ */
+struct Telemetry {
+    struct Reactor {
+        Reactor() : events(0), nanoseconds(0) {}
+        uint64_t events;
+        // wall-clock time spent notifying reactors of this type
+        uint64_t nanoseconds;
+    };
+    static const uint32_t depthBuckets = 32;
+
+    Telemetry();
+    /* Simulated hours per wall-clock second spent in nowIs() */
+    double hoursPerSecond() const;
+    /* Add the event counts of other, leaving the times alone */
+    void countsInc(const Telemetry& other);
+
+    uint64_t events;
+    // by notifiee class name, "none" for activities without one
+    map<string, Reactor> reactors;
+    // activities run while 2^(i-1) to 2^i - 1 others were queued, or none
+    // for i = 0; the last bucket takes everything deeper
+    uint64_t depth[depthBuckets];
+    double simulatedHours;
+    uint64_t nanoseconds;
+};
+
 class Manager : public Fwk::PtrInterface<Manager> {
 public:
+    /* Data structure holding the scheduled activities */
+    enum QueuePolicy {
+        heap_, radixHeap_, calendarQueue_
+    };
+    static QueuePolicy heap(){ return heap_; }
+    static QueuePolicy radixHeap(){ return radixHeap_; }
+    static QueuePolicy calendarQueue(){ return calendarQueue_; }
+
     /* Accessors */
     ActivityPtr activity(const string &name) const;
+    /* NULL once handle has been deleted */
+    inline ActivityPtr activity(ActivityHandle handle) const {
+        if (!live(handle)) return NULL;
+        return pool_[(uint32_t)handle];
+    }
     inline Time now() const { return now_; }
+    inline QueuePolicy queuePolicy() const { return queuePolicy_; }
+    inline bool batchDispatch() const { return batchDispatch_; }
+    inline PaceGatePtr paceGate() const { return paceGate_; }
+    /* Activities run so far, including any undone by a rollback */
+    inline uint64_t events() const { return events_; }
+    /* Tick of the earliest scheduled or arriving activity, maxTick when
+     * there is none */
+    Tick nextTick();
+    Telemetry telemetry() const;
     /* Mutators */
     ActivityPtr activityNew();
     ActivityPtr activityNew(const string &name);
     void activityDel(const string &name);
+    /* Anonymous activities are recycled through a pool and addressed by
+     * handle; they never enter the name map. A deleted handle is stale:
+     * activityDel() and activityCancel() ignore it, even once its slot has
+     * gone to a later anonymousActivityNew(). */
+    ActivityHandle anonymousActivityNew();
+    void activityDel(ActivityHandle handle);
+    /* Cancel a scheduled activity. Its queue entry stays behind as a
+     * tombstone until it surfaces; the queues are compacted once tombstones
+     * make up half of the scheduled entries. */
+    void activityCancel(ActivityHandle handle);
+    void activityCancel(const string &name);
     void lastActivityIs(ActivityPtr);
+    /* Start coroutine on a pooled activity at the current time: its body
+     * runs now, up to its first sleep */
+    void coroutineNew(Coroutine* coroutine);
+    /* Schedule coroutine to resume at t from its current resume point, as
+     * if it had gone to sleep; restores a checkpointed coroutine */
+    void coroutineNew(Coroutine* coroutine, Time t, Priority priority);
+    /* Resume a parked coroutine now, on the activity it kept */
+    void coroutineResume(Coroutine* coroutine);
+    /* End a parked coroutine and hand its activity back to the pool */
+    void coroutineDel(Coroutine* coroutine);
+    /* Work a client queues for the current time without an activity of
+     * its own. The client keeps its pieces of work in order;
+     * deferredRun() runs the first one and drops it. */
+    class Lane : public Fwk::PtrInterface<Lane> {
+    public:
+        virtual ~Lane(){}
+        virtual void deferredRun() = 0;
+    };
+    typedef Fwk::Ptr<Lane> LanePtr;
+    /* lane has queued a piece of work. It runs in the current time step,
+     * where an activity of priority deferredPriority scheduled now would
+     * run, and counts as an event. */
+    void deferredNew(Lane* lane);
+    static const uint8_t deferredPriority = 2;
+    /* Activities waiting to run, in the order they will run; cancelled
+     * ones and the inbox are left out */
+    vector<ActivityPtr> scheduledActivities() const;
+    /* Schedule notifiee at time t from any thread, without taking a lock.
+     * The activity waits in a lock-free inbox until the thread running the
+     * manager takes it in, at the top of each step of nowIs(); a time that
+     * has passed by then becomes the current time. Posting from another
+     * thread needs FWK_ATOMIC_REFS. A partition running an optimistic
+     * window leaves its inbox alone until the window is over. */
+    void externalActivityNew(Time t, Priority priority, Activity::Notifiee* notifiee);
     void nowIs(Time);
-    static ManagerPtr ManagerIs(){ return new Manager(); }
+    /* Bounded nowIs(): stop short of t once maxEvents activities have run,
+     * or once the wall clock has passed deadline. Time steps are run whole,
+     * and at least one is run, so a crowded step may overshoot the bound.
+     * Returns the time reached; everything scheduled up to it has run. */
+    Time nowIs(Time t, uint64_t maxEvents, WallTime deadline);
+    Time nowIs(Time t, uint64_t maxEvents){ return nowIs(t, maxEvents, WallTime::never()); }
+    Time nowIs(Time t, WallTime deadline){ return nowIs(t, unboundedEvents, deadline); }
+    /* In batch dispatch mode nowIs() takes all activities of a (time,
+     * priority) class off the queues at once and hands them to
+     * Notifiee::onStatusBatch() grouped by notifiee type. Off by default. */
+    void batchDispatchIs(bool batchDispatch);
+    /* Pace nowIs() with gate; NULL, the default, runs unpaced. A parallel
+     * manager passes its coordinator's gate before each window. */
+    void paceGateIs(PaceGate* gate){ paceGate_ = gate; }
+    static ManagerPtr ManagerIs(){ return new Manager(heap()); }
+    static ManagerPtr ManagerIs(QueuePolicy policy){ return new Manager(policy); }
 private:
-    Manager() : now_(0), activityName_(0){}
-    priority_queue<ActivityPtr, vector<ActivityPtr>, ActivityComp> scheduledActivities_;
+    /* Interface implemented by each queue policy */
+    class Queue {
+    public:
+        virtual ~Queue(){}
+        virtual bool empty() const = 0;
+        virtual size_t size() const = 0;
+        virtual ActivityPtr top() = 0;
+        virtual void pop() = 0;
+        virtual void push(ActivityPtr activity) = 0;
+        /* Drop the entries of cancelled activities, returning their number */
+        virtual size_t compact() = 0;
+    };
+    class HeapQueue;
+    class RadixHeapQueue;
+    class CalendarQueue;
+    class TimingWheel;
+
+    /* Activity sent by another partition, scheduled once time reaches it.
+     * Arrivals of one tick are scheduled in (sender, send order) order,
+     * however they were batched on the way. */
+    struct Arrival {
+        Arrival(Time t, Priority p, Activity::Notifiee* n, uint32_t f, uint64_t s) :
+            tick(t.tick()), from(f), sequence(s), time(t), priority(p), notifiee(n) {}
+        bool operator<(const Arrival& other) const {
+            if (tick != other.tick) return tick < other.tick;
+            if (from != other.from) return from < other.from;
+            return sequence < other.sequence;
+        }
+        Tick tick;
+        uint32_t from;
+        uint64_t sequence;
+        Time time;
+        Priority priority;
+        Activity::NotifieePtr notifiee;
+    };
+
+    /* Activity posted to the inbox */
+    struct Posted {
+        Posted(Time t, Priority p, Activity::Notifiee* n) :
+            time(t), priority(p), notifiee(n), next(NULL) {}
+        Time time;
+        Priority priority;
+        Activity::NotifieePtr notifiee;
+        Posted* next;
+    };
+
+    struct ReactorCount {
+        const std::type_info* type;
+        Telemetry::Reactor count;
+    };
+
+    /* Piece of work queued by deferredNew(); it runs at time, which
+     * may differ from the current time within the tick */
+    struct Deferred {
+        Deferred(Lane* l, Time t, uint64_t s) : lane(l), time(t), sequence(s) {}
+        LanePtr lane;
+        Time time;
+        uint64_t sequence;
+    };
+
+    static const size_t minTombstones = 64;
+    static const uint64_t unboundedEvents = ~(uint64_t)0;
+
+    friend class ParallelManager;
+    friend class Activity::State;
+    Manager(QueuePolicy policy);
+    ~Manager();
+    Queue* queueNew() const;
+    inline bool live(ActivityHandle handle) const {
+        uint32_t slot = (uint32_t)handle;
+        return slot < pool_.size() && generations_[slot] == (uint32_t)(handle >> 32);
+    }
+    void activityIs(const Arrival& arrival);
+    void inboxMerge();
+    void arrivalsMerge(size_t from);
+    void arrivalsRun(Tick tick);
+    void queuesDrain();
+    void queuesRebuild();
+    void activityCancel(Activity* activity);
+    void activityRun(ActivityPtr activity);
+    void depthCount(uint64_t events);
+    void reactorCount(Activity::Notifiee* notifiee, uint64_t events, uint64_t nanoseconds);
+    ActivityPtr scheduledTop(bool& periodic);
+    void scheduledPop(ActivityPtr activity, bool periodic);
+    void periodicReschedule(ActivityPtr activity);
+    void batchRun(ActivityPtr first);
+    bool deferredFirst(const ActivityPtr& next, bool arriving) const;
+    void deferredRun();
+    QueuePolicy queuePolicy_;
+    Queue* scheduledActivities_;
+    // periodic activities are kept apart from the scheduling queue
+    TimingWheel* periodicActivities_;
     map<string, ActivityPtr> activities_; 
+    vector<ActivityPtr> pool_;
+    // current generation of each slot, moved on when its handle is deleted
+    vector<uint32_t> generations_;
+    vector<uint32_t> freeSlots_;
     Time now_;
     uint32_t activityName_;
+    uint64_t sequence_;
+    uint64_t events_;
+    size_t tombstones_;
+    bool batchDispatch_;
+    // scratch space of batchRun()
+    vector<ActivityPtr> batch_;
+    vector<ActivityPtr> group_;
+    // sorted; see Arrival
+    deque<Arrival> arrivals_;
+    // nowIs() runs nothing later than this
+    Tick horizon_;
+    // activities to put back in the queues after a rollback
+    vector<ActivityPtr> restored_;
+    // queued by deferredNew(), from deferredHead_ on; empty between
+    // time steps
+    vector<Deferred> deferred_;
+    size_t deferredHead_;
+    // posted by externalActivityNew(), newest first
+    Posted* volatile inbox_;
+    PaceGatePtr paceGate_;
+    Telemetry telemetry_;
+    vector<ReactorCount> reactorCounts_;
+};
+
+/* Conservative parallel simulation over a set of partition managers.
+ * Activities of different partitions only interact through activityNew(),
+ * whose time must lie at least lookahead() past the sender's current time.
+ * nowIs() advances in windows one lookahead wide: within a window every
+ * partition runs on its own, and activities sent across partitions are
+ * handed over at the barrier that closes it. The coordinator keeps the
+ * activities that touch every partition; they run alone between windows,
+ * ahead of partition activities of the same time.
+ *
+ * With an optimistic window the partitions instead run that far ahead
+ * regardless of the lookahead, recording their changes in a Journal. At
+ * the barrier the earliest activity sent during the window bounds what is
+ * safe: when it falls inside the window every partition is rolled back to
+ * just before it, messages sent from the undone part are dropped, and the
+ * next window starts there. The journals are emptied after each window.
+ * Either way an activity sent across partitions is scheduled when its
+ * receiver reaches its time, so the results do not depend on the mode.
+ *
+ * Built with FWK_ATOMIC_REFS each partition runs on its own thread;
+ * otherwise the partitions of a window run in turn on the calling thread.
+ * Both give the same results.
+ */
+class ParallelManager : public Fwk::PtrInterface<ParallelManager> {
+public:
+    /* Accessors */
+    inline ManagerPtr coordinator() const { return coordinator_; }
+    inline ManagerPtr partition(uint32_t index) const { return partitions_[index]; }
+    inline uint32_t partitions() const { return partitions_.size(); }
+    inline Time lookahead() const { return Time((double)lookahead_ / ticksPerHour); }
+    inline Time now() const { return coordinator_->now(); }
+    inline Time optimisticWindow() const { return Time((double)optimisticWindow_ / ticksPerHour); }
+    /* Number of windows run so far, and of those partly rolled back */
+    inline uint64_t windows() const { return windows_; }
+    inline uint64_t rollbacks() const { return rollbacks_; }
+    /* Activities run by the coordinator and every partition */
+    uint64_t events() const;
+    /* Counts of the coordinator and every partition; the times are those
+     * of nowIs() */
+    Telemetry telemetry() const;
+    /* Mutators */
+    /* Rounded up to one tick */
+    void lookaheadIs(Time lookahead);
+    /* A positive window switches to optimistic execution: see below.
+     * Zero, the default, keeps windows one lookahead wide. */
+    void optimisticWindowIs(Time window);
+    /* Schedule notifiee on partition to at the given time. Called by an
+     * activity of partition from; a time closer than the lookahead (one
+     * tick when optimistic) is reported and pushed back. */
+    void activityNew(uint32_t from, uint32_t to, Time time, Priority priority,
+                     Activity::Notifiee* notifiee);
+    void batchDispatchIs(bool batchDispatch);
+    void nowIs(Time t);
+    /* As Manager::nowIs(t, maxEvents, deadline), stopping between windows */
+    Time nowIs(Time t, uint64_t maxEvents, WallTime deadline);
+    Time nowIs(Time t, uint64_t maxEvents){ return nowIs(t, maxEvents, WallTime::never()); }
+    Time nowIs(Time t, WallTime deadline){ return nowIs(t, Manager::unboundedEvents, deadline); }
+    static ParallelManagerPtr ParallelManagerIs(ManagerPtr coordinator, uint32_t partitions){
+        return new ParallelManager(coordinator, partitions);
+    }
+private:
+    struct Message {
+        Message(const Manager::Arrival& a, Tick s) : arrival(a), sendTick(s) {}
+        Manager::Arrival arrival;
+        Tick sendTick;
+    };
+    class Workers;
+    enum Phase { run_, rollback_ };
+
+    ParallelManager(ManagerPtr coordinator, uint32_t partitions);
+    ~ParallelManager();
+    vector<Message>& outbox(uint32_t buffer, uint32_t from, uint32_t to){
+        return outboxes_[buffer][from * partitions_.size() + to];
+    }
+    void windowRun(Tick end);
+    void phaseRun(Phase phase);
+    void partitionRun(uint32_t index);
+    void partitionRollback(uint32_t index);
+    ManagerPtr coordinator_;
+    vector<ManagerPtr> partitions_;
+    Tick lookahead_;
+    Tick optimisticWindow_;
+    // messages sent during a window go to outboxes_[sending_] and are
+    // taken in by their partitions at the start of the next one
+    vector< vector<Message> > outboxes_[2];
+    uint32_t sending_;
+    // messages sent by each partition so far
+    vector<uint64_t> sent_;
+    // earliest message time per sending partition, and over all of them
+    vector<Tick> sentTicks_;
+    Tick pendingTick_;
+    bool inWindow_;
+    Tick windowEnd_;
+    // optimistic windows undo everything from this tick on
+    Tick rollbackTick_;
+    uint64_t windows_;
+    uint64_t rollbacks_;
+    // per partition undo logs of optimistic windows
+    vector<Journal*> journals_;
+    vector<char> failed_;
+    Phase phase_;
+    double simulatedHours_;
+    uint64_t nanoseconds_;
+    Workers* workers_;
+    friend class Workers;
 };
 
 }
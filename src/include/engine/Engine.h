@@ -11,6 +11,7 @@
 #include <exception>
 #include <iostream>
 #include <queue>
+#include <deque>
 #include <utility>
 
 #include "fwk/Ptr.h"
@@ -349,6 +350,25 @@ public:
 };
 
 // Client Types
+/* Pseudo-random numbers owned by a network, so that a run can be repeated
+ * from its seed and checkpointed. The generator is the additive feedback
+ * one of the C library's rand(): a seed gives the same sequence there. */
+class Random {
+public:
+    static const uint32_t degree = 34;
+    Random(uint32_t seed = 1) { seedIs(seed); }
+    inline uint32_t seed() const { return seed_; }
+    void seedIs(uint32_t seed);
+    /* Next number, from 0 to RAND_MAX */
+    int32_t value();
+private:
+    friend class ShippingNetwork;
+    uint32_t seed_;
+    // the last degree values, the oldest at next_
+    uint32_t state_[degree];
+    uint32_t next_;
+};
+
 class Shipment;
 class Subshipment;
 class Segment;
@@ -365,13 +385,14 @@ class LocationReactor;
 class CustomerReactor;
 class InjectActivityReactor;
 class ForwardActivityReactor;
+class DeliveryLane;
+class ShipmentSlab;
 class SegmentReactor;
 class ShippingNetworkReactor;
 class StatsReactor;
 
 // Pointers
 typedef Fwk::Ptr<Shipment> ShipmentPtr;
-typedef Fwk::Ptr<Subshipment> SubshipmentPtr;
 typedef Fwk::Ptr<Segment> SegmentPtr;
 typedef Fwk::Ptr<Location> LocationPtr;
 typedef Fwk::Ptr<Customer> CustomerPtr;
@@ -380,6 +401,9 @@ typedef Fwk::Ptr<Path> PathPtr;
 typedef Fwk::Ptr<Conn> ConnPtr;
 typedef Fwk::Ptr<Fleet> FleetPtr;
 typedef Fwk::Ptr<Stats> StatsPtr;
+typedef Fwk::Ptr<ForwardActivityReactor> ForwardActivityReactorPtr;
+typedef Fwk::Ptr<DeliveryLane> DeliveryLanePtr;
+typedef Fwk::Ptr<ShipmentSlab> ShipmentSlabPtr;
 typedef Fwk::Ptr<SegmentReactor> SegmentReactorPtr;
 typedef Fwk::Ptr<ShippingNetworkReactor> ShippingNetworkReactorPtr;
 typedef Fwk::Ptr<StatsReactor> StatsReactorPtr;
@@ -415,6 +439,8 @@ public:
     SegmentNum segmentCount() const; 
     SegmentPtr segment(uint32_t index) const; 
     inline EntityType entityType() const { return entityType_; }
+    /* Partition whose manager runs the location and its outgoing segments */
+    inline uint32_t partition() const { return partition_; }
 
     class NotifieeConst : public virtual Fwk::NamedInterface::NotifieeConst {
     public:
@@ -445,6 +471,7 @@ private:
     void segmentIs(SegmentPtr segment);
     void segmentDel(SegmentPtr segment);
     EntityType entityType_;
+    uint32_t partition_;
     typedef std::vector<SegmentPtr> SegmentList;
     SegmentList segments_;
 
@@ -472,6 +499,7 @@ public:
 
     // accessors
     ShipmentPerDay transferRate() const { return transferRate_; }
+    Time shipmentPeriod() const;
     Time nextShipmentTime() const;
     PackageNum shipmentSize() const { return shipmentSize_; }
     LocationPtr destination() const { return destination_; }
@@ -541,15 +569,50 @@ private:
     ShippingNetworkPtrConst network_;
     ManagerPtr manager_;
     void checkAndCreateInjectActivity();
+    void injectGroupLeave();
 
+    // injection activity of manager_ this customer belongs to, if any
+    string injectGroup_;
     bool transferRateSet_;
     bool shipmentSizeSet_;
     bool destinationSet_;
 };
 
-class Shipment: public Fwk::NamedInterface {
+/* Slots for the shipments one partition injects, carved out of blocks
+ * and kept on a free list. Only the partition's own thread takes slots.
+ * A shipment whose last reference drops, on whatever thread, hands its
+ * slot back to the slab it came from, so the slots a partition frees for
+ * another are reused by the one that allocated them. The slab lives as
+ * long as any of its shipments. */
+class ShipmentSlab : public Fwk::PtrInterface<ShipmentSlab> {
+public:
+    /* Slots carved out so far, taken or free */
+    inline size_t slots() const { return blocks_.size() * blockSlots; }
+
+    static ShipmentSlabPtr ShipmentSlabNew() { return new ShipmentSlab(); }
+private:
+    friend class Shipment;
+    ShipmentSlab() : free_(NULL), returned_(NULL) {}
+    ~ShipmentSlab();
+    void* slotNew();
+    void slotDel(void* slot);
+    static const size_t blockSlots = 256;
+    std::vector<void*> blocks_;
+    // taken by slotNew() only
+    void* free_;
+    // slots handed back, moved over to free_ when it runs out
+    void* returned_;
+};
+
+/* A shipment is known by a dense id, handed out in injection order from
+ * 1; its name is only made up for debugging. Shipments of the simulation
+ * are allocated from the slab of the partition injecting them, and their
+ * slot goes back to it once the last reference drops. */
+class Shipment: public Fwk::PtrInterface<Shipment> {
 public:
     // accessors
+    inline uint64_t id() const { return id_; }
+    std::string name() const;
     inline PackageNum load() const { return load_; }
     inline LocationPtr destination() const { return destination_; }
     inline LocationPtr source() const { return source_; }
@@ -562,91 +625,154 @@ public:
     void destinationIs(LocationPtr loc) { destination_ = loc; }
     void sourceIs(LocationPtr src) { source_ = src;}
     void startTimeIs(Activity::Time t) { startTime_ = t; }
-    void costInc(Dollar cost) {cost_ = cost_ + cost;}
-    void queueTimeIs(Activity::Time t) { queueTime_ = t; }
+    void costInc(Dollar cost) {
+        Activity::Journal::save(this, cost_);
+        cost_ = cost_ + cost;
+    }
+    void queueTimeIs(Activity::Time t) {
+        Activity::Journal::save(this, queueTime_);
+        queueTime_ = t;
+    }
 
-    // constructor
-    Shipment(std::string name) : NamedInterface(name), cost_(0), startTime_(0), queueTime_(0) {}
+    /* A new shipment, with the next id, from slab or from the heap */
+    static ShipmentPtr ShipmentNew(ShipmentSlab* slab = NULL);
+    /* A restored shipment; later new ones get larger ids */
+    static ShipmentPtr ShipmentNew(uint64_t id, ShipmentSlab* slab = NULL);
+    inline ShipmentSlabPtr slab() const { return slab_; }
+protected:
+    void onZeroReferences() const;
 private:
+    Shipment(uint64_t id, ShipmentSlab* slab) : id_(id), cost_(0), startTime_(0), queueTime_(0), slab_(slab) {}
+    uint64_t id_;
     PackageNum load_;
-    LocationPtr destination_;
-    LocationPtr source_;
     Dollar cost_;
     Activity::Time startTime_;
     Activity::Time queueTime_;
+    LocationPtr source_;
+    LocationPtr destination_;
+    ShipmentSlabPtr slab_;
 };
 
+/* Part of a shipment's load, queued at a segment or on a carrier. A
+ * plain value: queues and carriers hold these inline. */
+class Subshipment {
+public:
+    Subshipment() : remainingLoad_(0) {}
+    Subshipment(ShipmentPtr shipment, PackageNum load) : shipment_(shipment), remainingLoad_(load) {}
+
+    inline ShipmentPtr shipment() const { return shipment_; }
+    inline PackageNum remainingLoad() const { return remainingLoad_; }
+
+    void remainingLoadIs(PackageNum pn) { remainingLoad_ = pn; }
+private:
+    ShipmentPtr shipment_;
+    PackageNum remainingLoad_;
+};
+
+/* Injects a shipment from each of its customers. Customers injecting at
+ * the same times, with equal periods and phases, share one such periodic
+ * activity; each customer joins it in turn and is served in that order. */
 class InjectActivityReactor : public Activity::Activity::Notifiee {
 public:
     void onStatus();
     void onNextTime(){};
 
-    void sourceIs(CustomerPtr customer) { source_ = customer; } 
+    void sourceIs(CustomerPtr customer) { sources_.push_back(customer); }
+    void sourceDel(CustomerPtr customer);
     void managerIs(ManagerPtr m) { manager_ = m; }
+    void slabIs(ShipmentSlabPtr slab) { slab_ = slab; }
 
-    inline CustomerPtr source() const { return source_; }
+    inline uint32_t sources() const { return sources_.size(); }
+    inline CustomerPtr source(uint32_t i) const { return sources_[i]; }
 private:
     ManagerPtr manager_;
-    CustomerPtr source_;
+    // the partition's, which the shipments are allocated from
+    ShipmentSlabPtr slab_;
+    std::vector<CustomerPtr> sources_;
 };
 
-class ForwardActivityReactor : public Activity::Activity::Notifiee {
+/* A carrier of a segment: picks up as much queued load as it holds,
+ * travels, delivers, and repeats until the queue is empty. It then parks
+ * with the segment's idle carriers until there is load again, or retires
+ * if the segment has more carriers than its capacity. */
+class ForwardActivityReactor : public Activity::Coroutine {
 public:
-    void onStatus();
-    void onNextTime(){};
+    void resume();
 
     inline ManagerPtr manager() { return manager_; }
     inline SegmentPtr segment() { return segment_; }
-    inline SubshipmentPtr subshipment(uint32_t i) { return subshipments_[i]; }
+    inline const Subshipment& subshipment(uint32_t i) const { return subshipments_[i]; }
 
     void managerIs(ManagerPtr m) { manager_ = m; }
     void segmentIs(SegmentPtr s) { segment_ = s; }
-    void subshipmentIs(SubshipmentPtr s) { subshipments_.push_back(s); }
-    ForwardActivityReactor(){};
+    void subshipmentIs(const Subshipment& s) {
+        Activity::Journal::savePushBack(this, subshipments_);
+        subshipments_.push_back(s);
+    }
+    ForwardActivityReactor() : loaded_(0) {};
 private:
+    friend class ShippingNetwork;
+    void subshipmentsLoad();
+    void subshipmentsArrivalIs(Activity::Time arrival);
+    void subshipmentArrivalIs(const Subshipment& subshipment, Activity::Time arrival);
     SegmentPtr segment_;
-    vector<SubshipmentPtr> subshipments_;
+    vector<Subshipment> subshipments_;
+    // when the load in subshipments_ was picked up
+    Activity::Tick loaded_;
     ManagerPtr manager_;
 };
 
+/* Hands a shipment sent from another partition to the delivery lane of
+ * the partition it arrives in, once it arrives there */
 class DeliveryActivityReactor : public Activity::Activity::Notifiee {
 public:
-    void onStatus(){
-        if(notifier()->status() == Activity::Activity::executing()){
-            location_->shipmentIs(shipment_);
-        }
-    }
-    DeliveryActivityReactor(ShipmentPtr shipment, LocationPtr location): location_(location), shipment_(shipment){};
+    void onStatus();
+    void managerIs(ManagerPtr m) { manager_ = m; }
+    inline ShipmentPtr shipment() const { return shipment_; }
+    inline LocationPtr location() const { return location_; }
+    inline SegmentPtr segment() const { return segment_; }
+    inline Activity::Tick loaded() const { return loaded_; }
+    DeliveryActivityReactor(ShipmentPtr shipment, LocationPtr location, SegmentPtr segment, Activity::Tick loaded, DeliveryLane* lane):
+        location_(location), shipment_(shipment), segment_(segment), loaded_(loaded), lane_(lane){};
 private:
     LocationPtr location_; 
     ShipmentPtr shipment_;
+    SegmentPtr segment_;
+    Activity::Tick loaded_;
+    DeliveryLanePtr lane_;
+    ManagerPtr manager_;
 };
 
-class Subshipment : public Fwk::NamedInterface {
+/* Shipments that have just come off a segment, handed to their locations
+ * in the current time step after the carriers arriving then, without an
+ * activity per delivery. Runs on one manager's deferred lane. The
+ * deliveries of a time step go out in the order their loads were picked
+ * up, and those picked up at the same time by segment name, none of
+ * which depends on the partition that ran the carrier: a shipment from
+ * another partition is handed over in the same place among them as in an
+ * unpartitioned run. */
+class DeliveryLane : public Activity::Manager::Lane {
 public:
-    enum ShipmentOrder {
-        last_ = 0,
-        first_ = 1,
-        other_
-    };
-
-    Subshipment(string name) : Fwk::NamedInterface(name) {};
-
-    static inline ShipmentOrder last() { return last_; }
-    static inline ShipmentOrder other() { return other_; }
-    static inline ShipmentOrder first() { return first_; }
-
-    inline ShipmentPtr shipment() const { return shipment_; }
-    inline ShipmentOrder shipmentOrder() const { return shipmentOrder_; }
-    inline PackageNum remainingLoad() const { return remainingLoad_; }
-
-    void shipmentIs(ShipmentPtr shipment) { shipment_ = shipment; }
-    void shipmentOrderIs(ShipmentOrder so) { shipmentOrder_ = so; }
-    void remainingLoadIs(PackageNum pn) { remainingLoad_ = pn; }
+    /* location gets shipment, which came off segment on a load picked up
+     * at tick loaded */
+    void deliveryNew(LocationPtr location, ShipmentPtr shipment, SegmentPtr segment, Activity::Tick loaded);
+    void deferredRun();
+    DeliveryLane(ManagerPtr manager) : manager_(manager), head_(0), sorted_(true) {}
 private:
-    ShipmentPtr shipment_;
-    ShipmentOrder shipmentOrder_;
-    PackageNum remainingLoad_;
+    struct Delivery {
+        Delivery(LocationPtr l, ShipmentPtr sh, SegmentPtr se, Activity::Tick t) :
+            location(l), shipment(sh), segment(se), loaded(t) {}
+        LocationPtr location;
+        ShipmentPtr shipment;
+        SegmentPtr segment;
+        Activity::Tick loaded;
+    };
+    static bool loadedEarlier(const Delivery& a, const Delivery& b);
+    ManagerPtr manager_;
+    // from head_ on; in order while sorted_
+    vector<Delivery> deliveries_;
+    size_t head_;
+    bool sorted_;
 };
 
 class Segment : public Fwk::NamedInterface {
@@ -690,6 +816,10 @@ public:
     inline Difficulty difficulty() const { return difficulty_; }
     inline TransportMode transportMode() const { return transportMode_; }
     inline CarrierNum carriersUsed() const { return carriersUsed_; }
+    /* Carriers parked until there is load for them */
+    inline uint32_t idleCarriers() const { return idleCarriers_.size(); }
+    /* Busy and idle carriers together */
+    inline uint32_t carriers() const { return carriersUsed_.value() + idleCarriers_.size(); }
     Hour carrierLatency() const;
     PackageNum carrierCapacity() const;
     Dollar carrierCost() const;
@@ -697,15 +827,45 @@ public:
     ModeCount modeCount() const;
     PathMode mode(uint16_t) const;
     SubshipmentNum subshipmentQueueSize() const { return subshipmentQueue_.size(); }
+    /* True when the two ends lie in different partitions. Such a segment
+     * hands each load to the far partition when a carrier picks it up. */
+    bool crossesPartitions() const;
     Activity::Time totalQueueTime(){ return totalQueueTime_; }
     Activity::Time queueTime(){ return queueTime_; }
 
     void shipmentIs(ShipmentPtr shipment);
-    void shipmentsReceivedInc() { shipmentsReceived_++; }
-    void shipmentsRefusedInc() { shipmentsRefused_++; }
-    void shipmentsRoutedInc(){ shipmentsRouted_++; }
-    void carriersUsedInc() { carriersUsed_ ++; }
-    void carriersUsedDec() { carriersUsed_ --; }
+    // simulation state changes are recorded for optimistic rollback
+    void shipmentsReceivedInc() {
+        Activity::Journal::save(this, shipmentsReceived_);
+        shipmentsReceived_++;
+    }
+    void shipmentsRefusedInc() {
+        Activity::Journal::save(this, shipmentsRefused_);
+        shipmentsRefused_++;
+    }
+    void shipmentsRoutedInc(){
+        Activity::Journal::save(this, shipmentsRouted_);
+        shipmentsRouted_++;
+    }
+    void carriersUsedInc() {
+        Activity::Journal::save(this, carriersUsed_);
+        carriersUsed_ ++;
+    }
+    void carriersUsedDec() {
+        Activity::Journal::save(this, carriersUsed_);
+        carriersUsed_ --;
+    }
+    void idleCarrierIs(ForwardActivityReactorPtr carrier) {
+        Activity::Journal::savePushBack(this, idleCarriers_);
+        idleCarriers_.push_back(carrier);
+    }
+    /* Take the carrier parked last */
+    ForwardActivityReactorPtr idleCarrierDel() {
+        ForwardActivityReactorPtr carrier = idleCarriers_.back();
+        Activity::Journal::savePopBack(this, idleCarriers_);
+        idleCarriers_.pop_back();
+        return carrier;
+    }
     void sourceIs(EntityID source);
     void lengthIs(Mile l);
     void capacityIs(ShipmentNum sn);
@@ -714,19 +874,57 @@ public:
     void notifieeIs(Segment::Notifiee* notifiee);
     void transportModeIs(TransportMode transportMode);
     void modeIs(PathMode mode);
-    void totalQueueTimeIs(Activity::Time t){ totalQueueTime_=t; }
+    void totalQueueTimeIs(Activity::Time t){
+        Activity::Journal::save(this, totalQueueTime_);
+        totalQueueTime_=t;
+    }
     void queueTimeIs(Activity::Time t){
+        Activity::Journal::save(this, queueTime_);
         queueTime_=t;
     }
     PathMode modeDel(PathMode mode);
-    void subshipmentEnqueue(SubshipmentPtr sp) { subshipmentQueue_.push(sp); }
-    SubshipmentPtr subshipmentDequeue(PackageNum);
+    void subshipmentEnqueue(const Subshipment& s) {
+        Activity::Journal::savePushBack(this, subshipmentQueue_);
+        subshipmentQueue_.push_back(s);
+    }
+    /* Move queued loads onto load, in order, up to capacity packages in
+     * all; the last one is split if only part of it fits */
+    void dequeueUpTo(PackageNum capacity, vector<Subshipment>& load);
 private:
     friend class ShippingNetwork;
     friend class ShippingNetworkReactor;
     friend class SegmentReactor;
     friend class ForwardActivityReactor;
-    typedef map<string,uint32_t> DeliveryMap;
+    /* Load delivered so far of each shipment under way on the segment,
+     * by shipment id. An open addressing table: a segment carries few
+     * shipments at once, and looking one up is on every pickup and
+     * drop-off. Id 0 marks an empty slot. Has the map operations the
+     * journal uses. */
+    class DeliveryMap {
+    public:
+        typedef uint64_t key_type;
+        typedef uint32_t mapped_type;
+        typedef std::pair<uint64_t, uint32_t> value_type;
+        typedef value_type* iterator;
+
+        DeliveryMap() : size_(0) {}
+        inline size_t size() const { return size_; }
+        inline iterator end() { return NULL; }
+        iterator find(uint64_t id);
+        uint32_t& operator[](uint64_t id);
+        void erase(uint64_t id);
+        void clear();
+        /* Slots in table order, for walking the entries; empty ones have
+         * id 0 */
+        inline size_t slots() const { return slot_.size(); }
+        inline const value_type& slot(size_t i) const { return slot_[i]; }
+    private:
+        size_t home(uint64_t id) const;
+        void slotsIs(size_t slots);
+
+        vector<value_type> slot_;
+        size_t size_;
+    };
     DeliveryMap deliveryMap_;
 
     Segment(ShippingNetworkPtrConst network, EntityID name, TransportMode transportMode, PathMode mode) : 
@@ -755,9 +953,34 @@ private:
 
     // for activity forwarding
     CarrierNum carriersUsed_;
+    vector<ForwardActivityReactorPtr> idleCarriers_;
     ShipmentNum shipmentsReceived_;
     ShipmentNum shipmentsRefused_;
-    typedef queue<SubshipmentPtr> SubshipmentQueue;
+    /* Loads waiting for a carrier: a ring buffer of subshipments, which
+     * only allocates when it grows. Has the deque operations the journal
+     * uses. */
+    class SubshipmentQueue {
+    public:
+        typedef Subshipment value_type;
+
+        SubshipmentQueue() : head_(0), size_(0) {}
+        inline size_t size() const { return size_; }
+        inline bool empty() const { return size_ == 0; }
+        inline Subshipment& front() { return slot_[head_]; }
+        inline Subshipment& back() { return slot_[(head_ + size_ - 1) & (slot_.size() - 1)]; }
+        inline const Subshipment& operator[](size_t i) const { return slot_[(head_ + i) & (slot_.size() - 1)]; }
+        void push_back(const Subshipment& s);
+        void push_front(const Subshipment& s);
+        void pop_front();
+        void pop_back();
+        void clear();
+    private:
+        void slotsIs(size_t slots);
+
+        vector<Subshipment> slot_;
+        size_t head_;
+        size_t size_;
+    };
     SubshipmentQueue subshipmentQueue_;
 };
 
@@ -1031,12 +1254,12 @@ private:
     };
     class MinTimeTraversal : public TraversalOrder{
     public:
-        MinTimeTraversal(FleetPtr fleet) : fleet_(fleet) {}
+        MinTimeTraversal(FleetPtr fleet, Random* random) : fleet_(fleet), random_(random) {}
         virtual bool compare(PathPtr a, PathPtr b) const {
             double wA = weight(a);
             double wB = weight(b);
             if(wA == wB){
-                return (rand()%10)>4;
+                return (random_->value()%10)>4;
             }
             return wA>wB;
         }
@@ -1046,7 +1269,7 @@ private:
             for(uint32_t i = 0; i < p->pathElementCount().value(); i++){
                 SegmentPtr s = p->pathElement(i)->segment();
                 if(s->shipmentsReceived() > 0){
-                    double randomFactor = ((double)(rand()%1000))/1000.0;
+                    double randomFactor = ((double)(random_->value()%1000))/1000.0;
                     retval += randomFactor*s->queueTime().value();
                 }
                 retval += s->length().value() / fleet_->speed(s->transportMode()).value();
@@ -1054,6 +1277,7 @@ private:
             return retval;
         }
         FleetPtr fleet_;
+        Random* random_;
     };
 
     Conn(std::string name,ShippingNetworkPtrConst shippingNetwork) : NamedInterface(name), shippingNetwork_(shippingNetwork), routingAlgorithm_(none_){}
@@ -1153,6 +1377,8 @@ public:
     typedef Fwk::Ptr<ShippingNetwork::Notifiee const> NotifieePtrConst;
 
     ManagerPtr manager() const { return manager_; }
+    /* Manager running the given partition */
+    ManagerPtr manager(uint32_t partition) const;
     SegmentPtr segment(EntityID name) const; 
     LocationPtr location(EntityID name) const;
     LocationNum locationCount() const;
@@ -1162,6 +1388,8 @@ public:
     StatsPtrConst stats(EntityID name) const; 
     FleetPtr fleet(EntityID name) const;
     FleetPtr activeFleet() const { return fleetPtr_; }
+    /* Random numbers of the simulation, seeded with 1 by default */
+    inline Random& random() { return random_; }
     SegmentPtr SegmentNew(EntityID name, TransportMode mode, PathMode pathMode); 
     SegmentPtr segmentDel(EntityID name);
     LocationPtr LocationNew(EntityID name, Location::EntityType entityType);
@@ -1174,6 +1402,28 @@ public:
     FleetPtr fleetDel(EntityID name);
     void activeFleetIs(FleetPtr fleet);
     void notifieeIs(ShippingNetwork::NotifieePtr notifiee);
+    /* Parallel manager running the partitions, NULL when not partitioned */
+    ParallelManagerPtr parallelManager() const { return parallelManager_; }
+    /* Lane of the given partition's manager for deliveries within it */
+    DeliveryLane* deliveryLane(uint32_t partition) const { return deliveryLanes_[partition].ptr(); }
+    /* Slab of the shipments the given partition injects */
+    ShipmentSlab* shipmentSlab(uint32_t partition) const { return shipmentSlabs_[partition].ptr(); }
+    /* Shortest time any fleet takes over a segment crossing partitions,
+     * infinite when none does */
+    Hour lookahead() const;
+    /* Split the locations into partitions of connected, equally sized
+     * regions, each run by its own manager; one or zero undoes the split.
+     * Only allowed before the simulation starts. Locations created later
+     * join partition 0. */
+    void partitionsIs(uint32_t partitions);
+    /* Write the simulation to out in binary: the entities, the routing
+     * table, the activities waiting to run and the shipments under way.
+     * Partitioned networks cannot be checkpointed. */
+    void checkpointIs(std::ostream& out);
+    /* Continue the simulation written to in, creating the entities this
+     * network lacks. The manager must not have run or scheduled anything
+     * yet; it is moved to the time of the checkpoint. */
+    void restoreIs(std::istream& in);
     static ShippingNetworkPtr ShippingNetworkIs(EntityID name, ManagerPtr manager);
 
 private:
@@ -1181,8 +1431,15 @@ private:
     ShippingNetwork(EntityID name, ManagerPtr manager) : Fwk::NamedInterface(name){
         manager_=manager;
         locationIteratorPos_=-1;
+        deliveryLanes_.push_back(new DeliveryLane(manager));
+        shipmentSlabs_.push_back(ShipmentSlab::ShipmentSlabNew());
     }
+    void locationManagerIs(LocationPtr location);
     ManagerPtr manager_;
+    ParallelManagerPtr parallelManager_;
+    // by partition
+    vector<DeliveryLanePtr> deliveryLanes_;
+    vector<ShipmentSlabPtr> shipmentSlabs_;
     typedef std::map<EntityID, LocationPtr> LocationMap;
     LocationMap locationMap_;
     LocationMap::const_iterator locationIterator_;
@@ -1198,6 +1455,7 @@ private:
     typedef std::map<EntityID,StatsPtr> StatMap;
     StatMap stat_;
     StatsPtr statPtr_;
+    Random random_;
     // notifiees
     typedef std::vector<ShippingNetwork::NotifieePtr> NotifieeList;
     NotifieeList notifieeList_;
@@ -1232,12 +1490,21 @@ public:
     void onMode(PathMode mode);
     void onModeDel(PathMode mode);
     void onShipment(ShipmentPtr shipment);
+    /* Retire idle carriers beyond the capacity, and start new ones up
+     * to it; those without load park */
     void onCapacity();
 private:
     // Factory Class
     friend class ShippingNetwork;
     SegmentReactor(ShippingNetworkPtr network,StatsPtr stats);
+    /* Set up a busy carrier for each queued load, waking idle ones
+     * first */
     void startupFAR();
+    void carrierNew();
+    void idleCarrierDel();
+    /* Carriers run on the source's partition manager; idle ones are
+     * rebuilt on a new one */
+    void managerIs(ManagerPtr manager);
     LocationPtr currentSource_;
     SegmentPtr  currentReturnSegment_;
     ShippingNetworkPtr network_;
@@ -2,6 +2,8 @@
 #define INSTANCE_H
 
 #include <string>
+#include <vector>
+#include <limits>
 #include "fwk/Ptr.h"
 #include "fwk/PtrInterface.h"
 #include "activity/Activity.h"
@@ -59,7 +61,97 @@ private:
 class Instance::SimulationManager : public Fwk::PtrInterface<Instance::SimulationManager>{
 public:
     virtual void timeIs(Activity::Time t)=0;
+    ///
+    /// Advances like timeIs(t), but returns early once the simulation has
+    /// run maxEvents activities, or once the wall clock passes deadline.
+    /// Returns the simulation time reached; call again to go further.
+    /// Each call makes some progress, and may overshoot its bound by the
+    /// activities of one time step.
+    ///
+    virtual Activity::Time timeIs(Activity::Time t, uint64_t maxEvents)=0;
+    virtual Activity::Time timeIs(Activity::Time t, Activity::WallTime deadline)=0;
     virtual void virtualTimeIs(Activity::Time t)=0;
+    ///
+    /// Dispatches the activities sharing a time and priority as one batch.
+    ///
+    virtual void batchDispatchIs(bool batchDispatch)=0;
+    ///
+    /// Splits the network into the given number of partitions, each
+    /// simulated by its own manager, synchronized conservatively across
+    /// the segments that join them. Must be called before simulation
+    /// time advances; 1 returns to a single manager.
+    ///
+    virtual void partitionsIs(uint32_t partitions)=0;
+    ///
+    /// Lets partitions run this far ahead of each other, undoing work
+    /// invalidated by shipments from another partition. Zero, the default,
+    /// keeps them within the shortest trip between partitions.
+    ///
+    virtual void optimisticWindowIs(Activity::Time window)=0;
+    ///
+    /// Seeds the random numbers that minTime routing breaks ties with.
+    /// The same seed and the same calls give the same run; the seed is
+    /// 1 by default, as for rand().
+    ///
+    virtual void randomSeedIs(uint32_t seed)=0;
+    ///
+    /// Scheduler counters summed over every manager of the simulation.
+    /// Zero unless the activity library is built with ACTIVITY_TELEMETRY;
+    /// a "Telemetry" instance reads them as attributes.
+    ///
+    virtual Activity::Telemetry telemetry()=0;
+    ///
+    /// Simulated hours timeIs() runs per wall clock second, 50 by default.
+    /// Each hour is held to a deadline counted from where the call started,
+    /// so time spent running activities does not accumulate. unpaced()
+    /// runs as fast as possible.
+    ///
+    virtual void paceIs(double hoursPerSecond)=0;
+    static double unpaced() { return std::numeric_limits<double>::infinity(); }
+    ///
+    /// The most wall clock seconds the simulation has fallen behind its
+    /// pace since the last paceIs(); also the "pace lag" attribute of a
+    /// "Telemetry" instance.
+    ///
+    virtual double paceLag()=0;
+    ///
+    /// Runs the simulation on its own thread: timeIs(t) then returns at
+    /// once, and attribute reads answer from the latest snapshot of the
+    /// customer and segment counters instead of waiting for it. Other
+    /// calls wait for the current step. false waits for the last target.
+    /// Needs a build with FWK_ATOMIC_REFS; otherwise true prints an error
+    /// to std::cerr and the simulation stays in the foreground.
+    ///
+    virtual void backgroundIs(bool background)=0;
+    ///
+    /// Simulation time between snapshots in the background; 1 by default.
+    ///
+    virtual void snapshotIntervalIs(Activity::Time interval)=0;
+    ///
+    /// Simulation time of the counters that attribute reads return.
+    ///
+    virtual Activity::Time snapshotTime()=0;
+    ///
+    /// Forks the process at the current simulation time into a branch for
+    /// a what-if scenario; the branch shares the warmed-up simulation with
+    /// this process, copy-on-write. Returns the branch's number, counting
+    /// from 1, in the branch and 0 here. A branch changes its instances,
+    /// runs to its horizon and ends with branchResultIs(), so that
+    /// branches started together run side by side. Not available in the
+    /// background or when partitioned; then returns 0 without forking.
+    ///
+    virtual uint32_t branch()=0;
+    ///
+    /// In a branch, sends result to the process that started it and ends
+    /// the branch.
+    ///
+    virtual void branchResultIs(const string& result)=0;
+    ///
+    /// Waits for the branches started since the last call and returns
+    /// their results by branch number; a branch that ended without one
+    /// gives the empty string.
+    ///
+    virtual std::vector<string> branchResults()=0;
 };
 
 ///
@@ -95,6 +187,25 @@ public:
     virtual void instanceDel(const string& name) = 0;
 
     virtual Ptr<SimulationManager> simulationManager() const = 0;
+
+    ///
+    /// Writes the instances and the state of the simulation, including
+    /// its scheduled activities and the shipments under way, to the named
+    /// file in a binary format. shippingInstanceManager(file) continues
+    /// the simulation from there. Partitioned simulations cannot be
+    /// checkpointed.
+    ///
+    virtual void checkpointIs(const string& file) = 0;
+
+    ///
+    /// Logs every change made through this manager, its instances and
+    /// its simulation manager to the named file, each at the simulation
+    /// time it was made, so that shippingInstanceManagerReplay() can
+    /// repeat the run without the client. Recording starts on a new
+    /// manager and stops with the empty string or the manager's end.
+    /// Pacing and background simulation are not recorded.
+    ///
+    virtual void recordIs(const string& file) = 0;
 };
 
 ///
@@ -184,4 +295,27 @@ public:
 ///
 extern Ptr<Instance::Manager> shippingInstanceManager();
 
+///
+/// Return an instance manager whose simulation keeps its scheduled
+/// activities in the given queue (heap, radix heap or calendar queue).
+/// Activities run in (time, priority) order under every policy; only the
+/// scheduling cost differs.
+///
+extern Ptr<Instance::Manager> shippingInstanceManager(Activity::Manager::QueuePolicy policy);
+
+///
+/// Return an instance manager restored from a file written by
+/// checkpointIs(), at the simulation time of the checkpoint, or null if
+/// the file cannot be read. The restored simulation runs on as the
+/// original would have.
+///
+extern Ptr<Instance::Manager> shippingInstanceManager(const string& checkpoint);
+
+///
+/// Return an instance manager that has replayed a log written through
+/// recordIs(), as fast as possible, or null if the log cannot be read.
+/// It ends where the recording stopped, as the recorded run did.
+///
+extern Ptr<Instance::Manager> shippingInstanceManagerReplay(const string& log);
+
 #endif
@@ -59,12 +59,20 @@ void assigninjectionparams(Ptr<Instance::Manager> manager, uint32_t start,uint32
 
 int main(int argc, char *argv[]) {
 
-    if(argc != 2){
-        std::cout << "adaptive <minHops|minDistance|minTime>\n";
+    if(argc < 2){
+        std::cout << "adaptive <minHops|minDistance|minTime> [partitions n] [optimistic hours]\n";
         return 1;
     }
 
     std::string routing = argv[1];
+    uint32_t partitions = 1;
+    double optimistic = 0;
+    for(int i = 2; i < argc; i++){
+        if(string(argv[i]) == "partitions" && i + 1 < argc)
+            partitions = atoi(argv[++i]);
+        else if(string(argv[i]) == "optimistic" && i + 1 < argc)
+            optimistic = atof(argv[++i]);
+    }
 
     Ptr<Instance::Manager> manager = shippingInstanceManager();
 
@@ -114,6 +122,9 @@ int main(int argc, char *argv[]) {
     conn->attributeIs("routing", routing);
 
     assigninjectionparams(manager,1,200,"c", "root", 24, 10);
+    if(partitions > 1)
+        manager->simulationManager()->partitionsIs(partitions);
+    manager->simulationManager()->optimisticWindowIs(optimistic);
 
     std::cout << std::endl << "Run network for 30hrs" << std::endl;
 
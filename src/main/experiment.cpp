@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <string>
 #include <ostream>
 #include <iostream>
@@ -57,14 +58,7 @@ void assigninjectionparams(Ptr<Instance::Manager> manager, uint32_t start,uint32
     }
 }
 
-int main(int argc, char *argv[]) {
-
-    bool random = false;
-    if(argc > 1 && string(argv[1]) == "random") 
-        random = true;
-
-    Ptr<Instance::Manager> manager = shippingInstanceManager();
-
+void buildnetwork(Ptr<Instance::Manager> manager, bool random){
     // L1
     buildnwaytree(manager,1, 10, "Customer","c","Truck terminal","t-1","Truck segment","1");
     buildnwaytree(manager,11,20, "Customer","c","Truck terminal","t-2","Truck segment","1");
@@ -81,7 +75,7 @@ int main(int argc, char *argv[]) {
     buildnwaytree(manager,1, 10, "Truck terminal","t","Truck terminal","t","Truck segment","10");
 
     // L3
-    Ptr<Instance> root = manager->instanceNew("root","Customer");
+    manager->instanceNew("root","Customer");
     Ptr<Instance> seg = manager->instanceNew("t->root","Truck segment");
     Ptr<Instance> segr = manager->instanceNew("root->t","Truck segment");
     seg->attributeIs("source","t");
@@ -103,19 +97,99 @@ int main(int argc, char *argv[]) {
         assigninjectionparams(manager,1,100,"c", "root", 160, 100);
     else
         assigninjectionparams(manager,1,100,"c", "root", 160, 1,1000);
+}
+
+/* Advance the simulation to t, at most events activities per call when
+ * events is nonzero, polling its snapshots when it runs in the background */
+void timeIs(Ptr<Instance::SimulationManager> simulation, Activity::Time t, uint64_t events, bool background){
+    if(background){
+        simulation->timeIs(t);
+        while(simulation->snapshotTime() < t)
+            usleep(1000);
+        return;
+    }
+    if(events == 0){
+        simulation->timeIs(t);
+        return;
+    }
+    while(simulation->timeIs(t, events) < t);
+}
+
+int main(int argc, char *argv[]) {
 
-    manager->simulationManager()->timeIs(30);
-    std::cout << "@30 Shipments Received: " << root->attribute("Shipments Received") << ", Average Latency: " << root->attribute("Average Latency") << std::endl;
-    manager->simulationManager()->timeIs(60);
-    std::cout << "@60 Shipments Received: " << root->attribute("Shipments Received") << ", Average Latency: " << root->attribute("Average Latency") << std::endl;
-    manager->simulationManager()->timeIs(90);
-    std::cout << "@90 Shipments Received: " << root->attribute("Shipments Received") << ", Average Latency: " << root->attribute("Average Latency") << std::endl;
-    manager->simulationManager()->timeIs(120);
-    std::cout << "@120 Shipments Received: " << root->attribute("Shipments Received") << ", Average Latency: " << root->attribute("Average Latency") << std::endl;
-    manager->simulationManager()->timeIs(150);
-    std::cout << "@150 Shipments Received: " << root->attribute("Shipments Received") << ", Average Latency: " << root->attribute("Average Latency") << std::endl;
-    manager->simulationManager()->timeIs(180);
-    std::cout << "@180 Shipments Received: " << root->attribute("Shipments Received") << ", Average Latency: " << root->attribute("Average Latency") << std::endl;
+    bool random = false;
+    bool batch = false;
+    uint32_t partitions = 1;
+    double optimistic = 0;
+    uint64_t events = 0;
+    bool background = false;
+    double pace = 0;
+    // the state @90 is written to checkpoint, or read back from restore
+    string checkpoint;
+    string restore;
+    // log of the run for replay
+    string record;
+    uint32_t seed = 1;
+    Activity::Manager::QueuePolicy policy = Activity::Manager::heap();
+    for(int i = 1; i < argc; i++){
+        if(string(argv[i]) == "random")
+            random = true;
+        else if(string(argv[i]) == "batch")
+            batch = true;
+        else if(string(argv[i]) == "radixHeap")
+            policy = Activity::Manager::radixHeap();
+        else if(string(argv[i]) == "calendarQueue")
+            policy = Activity::Manager::calendarQueue();
+        else if(string(argv[i]) == "partitions" && i + 1 < argc)
+            partitions = atoi(argv[++i]);
+        else if(string(argv[i]) == "optimistic" && i + 1 < argc)
+            optimistic = atof(argv[++i]);
+        else if(string(argv[i]) == "events" && i + 1 < argc)
+            events = strtoull(argv[++i], NULL, 10);
+        else if(string(argv[i]) == "background")
+            background = true;
+        else if(string(argv[i]) == "pace" && i + 1 < argc)
+            pace = atof(argv[++i]);
+        else if(string(argv[i]) == "checkpoint" && i + 1 < argc)
+            checkpoint = argv[++i];
+        else if(string(argv[i]) == "restore" && i + 1 < argc)
+            restore = argv[++i];
+        else if(string(argv[i]) == "record" && i + 1 < argc)
+            record = argv[++i];
+        else if(string(argv[i]) == "seed" && i + 1 < argc)
+            seed = strtoul(argv[++i], NULL, 10);
+    }
+    srand(seed);
+
+    Ptr<Instance::Manager> manager;
+    uint32_t start = 30;
+    if(restore.empty()){
+        manager = shippingInstanceManager(policy);
+        if(!record.empty())
+            manager->recordIs(record);
+        manager->simulationManager()->randomSeedIs(seed);
+        manager->simulationManager()->batchDispatchIs(batch);
+        buildnetwork(manager, random);
+    } else {
+        manager = shippingInstanceManager(restore);
+        if(!manager)
+            return 1;
+        start = 120;
+    }
+    Ptr<Instance> root = manager->instance("root");
+    if(partitions > 1)
+        manager->simulationManager()->partitionsIs(partitions);
+    manager->simulationManager()->optimisticWindowIs(optimistic);
+    if(pace > 0)
+        manager->simulationManager()->paceIs(pace);
+    manager->simulationManager()->backgroundIs(background);
+
+    for(uint32_t hour = start; hour <= 180; hour += 30){
+        timeIs(manager->simulationManager(), hour, events, background);
+        std::cout << "@" << hour << " Shipments Received: " << root->attribute("Shipments Received") << ", Average Latency: " << root->attribute("Average Latency") << std::endl;
+        if(hour == 90 && !checkpoint.empty())
+            manager->checkpointIs(checkpoint);
+    }
 
     std::cout << std::endl;
     
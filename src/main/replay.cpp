@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <sys/time.h>
+#include <string>
+#include <iostream>
+#include "Instance.h"
+
+using namespace std;
+
+/* Replays a log written by recordIs(), then prints how long that took, the
+ * simulation time reached and the attributes named by "instance:attribute"
+ * arguments */
+int main(int argc, char *argv[]) {
+    if(argc < 2){
+        cerr << "usage: " << argv[0] << " log [instance:attribute ...]" << endl;
+        return 1;
+    }
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    Ptr<Instance::Manager> manager = shippingInstanceManagerReplay(argv[1]);
+    if(!manager)
+        return 1;
+    gettimeofday(&end, NULL);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    cout << "Replayed in " << elapsed << "s to @" << manager->simulationManager()->snapshotTime().value() << endl;
+
+    for(int i = 2; i < argc; i++){
+        string arg = argv[i];
+        string::size_type colon = arg.find(':');
+        Ptr<Instance> instance = manager->instance(arg.substr(0, colon));
+        if(colon == string::npos || !instance){
+            cerr << "No instance attribute " << arg << endl;
+            continue;
+        }
+        cout << arg << " = " << instance->attribute(arg.substr(colon + 1)) << endl;
+    }
+}
@@ -3,9 +3,20 @@
 #include <iostream>
 #include <map>
 #include <vector>
+#include <algorithm>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <fstream>
 #include "rep/Instance.h"
 #include "engine/Engine.h"
 #include "logging.h"
+#ifdef FWK_ATOMIC_REFS
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace Shipping {
 
@@ -35,80 +46,178 @@ static const string shipmentsRefusedStr = "Shipments Refused";
 static const string capacityStr2 = "Capacity";
 static const string startTimeStr = "Start Time";
 static const int segmentStrlen = segmentStr.length();
+static const string statsStr = "Stats";
+static const string connStr = "Conn";
+static const string fleetStr = "Fleet";
+static const string telemetryStr = "Telemetry";
+static const char checkpointMagic[8] = {'S','H','I','P','I','N','S','T'};
+static const char recordMagic[8] = {'S','H','I','P','R','C','R','D'};
 
 class StatsRep;
+class TelemetryRep;
 class ConnRep;
 class FleetRep;
 
 class ManagerImpl;
+class Recorder;
+
+/* Counters of the customers and segments at one simulation time. The
+ * simulation thread publishes a new one every snapshot interval; readers
+ * keep the one they hold while it moves on. */
+class Snapshot : public Fwk::PtrInterface<Snapshot> {
+public:
+    struct CustomerCounts {
+        CustomerCounts(ShipmentNum r, Hour l, Dollar c) : received(r), latency(l), cost(c) {}
+        ShipmentNum received;
+        Hour latency;
+        Dollar cost;
+    };
+    struct SegmentCounts {
+        SegmentCounts(ShipmentNum r, ShipmentNum f, ShipmentNum o) : received(r), refused(f), routed(o) {}
+        ShipmentNum received;
+        ShipmentNum refused;
+        ShipmentNum routed;
+    };
+    Snapshot(Activity::Time t) : time(t) {}
+    Activity::Time time;
+    map<string, CustomerCounts> customers;
+    map<string, SegmentCounts> segments;
+};
 
 class SimulationManagerImpl : public Instance::SimulationManager{
 public:
-    SimulationManagerImpl();
+    /* Holds the simulation thread between steps while the engine is used
+     * from the client thread; does nothing in the foreground */
+    class Lock {
+    public:
+        Lock(SimulationManagerImpl* simulation);
+        ~Lock();
+    private:
+        SimulationManagerImpl* simulation_;
+    };
+
+    SimulationManagerImpl(Activity::Manager::QueuePolicy policy);
+    ~SimulationManagerImpl();
     void timeIs(Activity::Time t);
+    Activity::Time timeIs(Activity::Time t, uint64_t maxEvents){
+        return boundedTimeIs(t, maxEvents, Activity::WallTime::never());
+    }
+    Activity::Time timeIs(Activity::Time t, Activity::WallTime deadline){
+        return boundedTimeIs(t, ~(uint64_t)0, deadline);
+    }
     void virtualTimeIs(Activity::Time t);
+    void batchDispatchIs(bool batchDispatch);
+    void partitionsIs(uint32_t partitions);
+    void optimisticWindowIs(Activity::Time window);
+    void randomSeedIs(uint32_t seed);
+    Activity::Telemetry telemetry();
+    void paceIs(double hoursPerSecond);
+    double paceLag(){
+        Lock lock(this);
+        return paceLag_;
+    }
+    void backgroundIs(bool background);
+    void snapshotIntervalIs(Activity::Time interval);
+    Activity::Time snapshotTime();
+    /* Simulation time between steps */
+    Activity::Time now(){
+        return virtualTimeManager_->now();
+    }
+    uint32_t branch();
+    void branchResultIs(const string& result);
+    vector<string> branchResults();
+    /* Optimistic windows partly undone so far, 0 unless partitioned */
+    uint64_t rollbacks();
+    /* Snapshot attributes are read from, NULL unless simulating in the
+     * background */
+    Ptr<Snapshot> snapshot();
     void connIs(Ptr<ConnRep> connRep){
         connRep_=connRep;
     }
+    void managerIs(ManagerImpl* manager){
+        manager_=manager;
+    }
+    void networkIs(ShippingNetworkPtr network){
+        network_=network;
+    }
 private:
 
     friend class ManagerImpl;
+    friend class Recorder;
 
-    class RealToVirtualTimeActivity : public Activity::Activity::Notifiee{
+    /* Holds the simulation to its pace between time steps */
+    class PaceGate : public Activity::PaceGate {
     public:
         // public constructor ok in private class
-        RealToVirtualTimeActivity(Activity::ManagerPtr realManager, Activity::ManagerPtr virtualManager, uint64_t usPerHour):
-            Activity::Activity::Notifiee(), realManager_(realManager), virtualManager_(virtualManager), usPerHour_(usPerHour)
-        {}
-        // use to execute when 
-        virtual void onStatus(){
-            Activity::Activity::Status status = notifier_->status();
-            if(status == Activity::Activity::executing()){
-                if(realManager_->now() > virtualManager_->now()){
-                    
-                    // sleep for the required time
-                    usleep(usPerHour_);
-                    // execute the virtual manager at correct time
-                    virtualManager_->nowIs(notifier_->nextTime());
-                }
-            }
-            if(status == Activity::Activity::free()){
-                // reschedule notifying activity for next hour
-                notifier_->statusIs(Activity::Activity::nextTimeScheduled());
-                notifier_->nextTimeIs(notifier_->nextTime().value()+1.0);
-                realManager_->lastActivityIs(notifier_);
-            }
+        PaceGate(SimulationManagerImpl* simulation) : simulation_(simulation) {}
+        void timeIs(Activity::Time t){
+            simulation_->paceWait(t);
         }
     private:
-        Activity::ManagerPtr realManager_;
-        Activity::ManagerPtr virtualManager_;
-        uint64_t usPerHour_;
+        // owns this gate
+        SimulationManagerImpl* simulation_;
     };
-    typedef Fwk::Ptr<RealToVirtualTimeActivity> R2VTimeActivityPtr;
 
-    Activity::ManagerPtr realTimeManager(){
-        return realTimeManager_;
-    }
     Activity::ManagerPtr virtualTimeManager(){
         return virtualTimeManager_;
     }
+    void virtualNowIs(Activity::Time t);
+    Activity::Time boundedTimeIs(Activity::Time t, uint64_t maxEvents, Activity::WallTime deadline);
+    void boundUse(uint64_t events, bool stopped);
+    void paceWait(Activity::Time t);
+    void paceGateUse();
+    void restoreIs(std::istream& in);
+    void snapshotPublish();
+    void backgroundDel();
+    /* Log of the manager's changes, NULL unless recording */
+    Recorder* recorder();
+    void timeRecord();
+
+    class Background;
+
+    /* A branch started by this process, and what it has sent so far */
+    struct Branch {
+        pid_t pid;
+        // read end of its pipe, -1 once closed
+        int fd;
+        string result;
+    };
 
-    Activity::ManagerPtr realTimeManager_;
     Activity::ManagerPtr virtualTimeManager_;
-    R2VTimeActivityPtr r2vTimeActivity_;
+    Activity::PaceGatePtr paceGate_;
     Ptr<ConnRep> connRep_;
+    ShippingNetworkPtr network_;
+    Activity::Time optimisticWindow_;
+    // bounds of the timeIs() under way, if any; maxEvents_ counts down
+    bool bounded_;
+    bool boundReached_;
+    uint64_t maxEvents_;
+    Activity::WallTime deadline_;
+    // simulated hours per second; paceEpoch_ is the wall time virtual
+    // time was at paceEpochTime_, re-anchored when pacing resumes
+    double pace_;
+    bool paceAnchored_;
+    Activity::WallTime paceEpoch_;
+    Activity::Time paceEpochTime_;
+    // seconds
+    double paceLag_;
+    // owns this
+    ManagerImpl* manager_;
+    Activity::Time snapshotInterval_;
+    // simulation thread, NULL unless simulating in the background
+    Background* background_;
+    vector<Branch> branches_;
+    // write end of the pipe to the parent, -1 unless this is a branch
+    int branchFd_;
 };
 
-SimulationManagerImpl::SimulationManagerImpl(){
-    virtualTimeManager_ = Activity::Manager::ManagerIs();
-    realTimeManager_ = Activity::Manager::ManagerIs();
-    r2vTimeActivity_ = new RealToVirtualTimeActivity(realTimeManager_,virtualTimeManager_,20000);
-    // Setup activity
-    Activity::ActivityPtr activityPtr = realTimeManager_->activityNew("r2vtime_activity");
-    activityPtr->nextTimeIs(0.0);
-    activityPtr->statusIs(Activity::Activity::nextTimeScheduled());
-    activityPtr->lastNotifieeIs(r2vTimeActivity_.ptr());
-    realTimeManager_->lastActivityIs(activityPtr);
+SimulationManagerImpl::SimulationManagerImpl(Activity::Manager::QueuePolicy policy) :
+    optimisticWindow_(0), bounded_(false), boundReached_(false), maxEvents_(0),
+    deadline_(Activity::WallTime::never()), pace_(50.0), paceAnchored_(false), paceEpoch_(0),
+    paceEpochTime_(0), paceLag_(0), manager_(NULL), snapshotInterval_(1.0), background_(NULL), branchFd_(-1){
+    virtualTimeManager_ = Activity::Manager::ManagerIs(policy);
+    paceGate_ = new PaceGate(this);
+    virtualTimeManager_->paceGateIs(paceGate_.ptr());
     connRep_=NULL;
 }
 
@@ -126,6 +235,7 @@ public:
         stats_,
         conn_,
         fleet_,
+        telemetry_,
     };
 
     static inline InstanceType customer() { return customer_; }
@@ -139,25 +249,89 @@ public:
     static inline InstanceType stats() { return stats_; }
     static inline InstanceType conn() { return conn_; }
     static inline InstanceType fleet() { return fleet_; }
-
-    ManagerImpl();
+    static inline InstanceType telemetry() { return telemetry_; }
+
+    ManagerImpl(Activity::Manager::QueuePolicy policy);
+    ~ManagerImpl();
+    /* Manager continuing the checkpoint in file, NULL if it cannot */
+    static Ptr<ManagerImpl> checkpointRestore(const string& file);
+    /* Manager that has replayed the log in file, NULL if it cannot */
+    static Ptr<ManagerImpl> replay(const string& file);
     Ptr<Instance> instanceNew(const string& name, const string& type);
     Ptr<Instance> instance(const string& name);
     Ptr<Instance::SimulationManager> simulationManager() const { return simulationManager_; }
+    SimulationManagerImpl* simulation() const { return simulationManager_.ptr(); }
     void instanceDel(const string& name);
+    void checkpointIs(const string& file);
+    void recordIs(const string& file);
+    Recorder* recorder() const { return recorder_; }
     ShippingNetworkPtr shippingNetwork()
         { return shippingNetwork_; }
 private:
+    friend class SimulationManagerImpl;
+
+    /* instanceNew() spec of each instance type */
+    static const string& spec(InstanceType type);
 
     Ptr<SimulationManagerImpl> simulationManager_;
     Ptr<ConnRep> connInstance_;
     Ptr<StatsRep> statsInstance_;
+    Ptr<TelemetryRep> telemetryInstance_;
     typedef struct InstanceMapElem_t {
         InstanceType type;
         Ptr<Instance> ptr;
     } InstanceMapElem;
     map<string, InstanceMapElem> instance_;
     ShippingNetworkPtr shippingNetwork_;
+    // owned, NULL unless recording
+    Recorder* recorder_;
+};
+
+/* Log of the changes clients make, for replay. Each change follows the
+ * simulation time it was made at, whenever that has moved on since the
+ * last one; strings are written in full once, then by number. Every
+ * entry is flushed, since clients often never release their manager. */
+class Recorder {
+public:
+    enum Command {
+        time_ = 0,
+        instanceNew_,
+        instanceDel_,
+        attribute_,
+        batchDispatch_,
+        partitions_,
+        optimisticWindow_,
+        randomSeed_,
+    };
+
+    /* Starts the log with the settings of simulation */
+    Recorder(const string& file, SimulationManagerImpl* simulation);
+    /* Ends the log with the time reached */
+    ~Recorder();
+    bool ok() const { return out_.good(); }
+    /* Lets go of the log without ending it, in a branch that shares it
+     * with the parent */
+    void detach();
+    void timeIs(Activity::Time t);
+    void instanceNewIs(const string& name, const string& spec);
+    void instanceDelIs(const string& name);
+    void attributeIs(const string& instance, const string& name, const string& value);
+    void batchDispatchIs(bool batchDispatch);
+    void partitionsIs(uint32_t partitions);
+    void optimisticWindowIs(Activity::Time window);
+    void randomSeedIs(uint32_t seed);
+    /* Next string of a log, numbered as it was written */
+    static string stringRead(std::istream& in, vector<string>& strings);
+private:
+    void commandIs(Command command);
+    void stringIs(const string& value);
+
+    std::ofstream out_;
+    // owns the manager that owns this
+    SimulationManagerImpl* simulation_;
+    // time of the last change
+    Activity::Time recorded_;
+    map<string, uint32_t> strings_;
 };
 
 Ptr<Instance> ManagerImpl::instance(const string& name) {
@@ -171,6 +345,13 @@ class BaseRep : public Instance {
 public:
     string attribute(const string& name){
         try{
+            // counters come from the snapshot while simulating in the
+            // background, everything else from the engine between steps
+            Ptr<Snapshot> snapshot = manager_->simulation()->snapshot();
+            string value;
+            if (snapshot && snapshotAttributeImpl(snapshot.ptr(), name, value))
+                return value;
+            SimulationManagerImpl::Lock lock(manager_->simulation());
             return attributeImpl(name);
         }
         catch(Fwk::Exception e){
@@ -183,6 +364,9 @@ public:
     }
     void attributeIs(const string& name, const string& v){
         try{
+            SimulationManagerImpl::Lock lock(manager_->simulation());
+            if (manager_->recorder())
+                manager_->recorder()->attributeIs(this->name(), name, v);
             attributeIsImpl(name,v);
         }
         catch(Fwk::Exception e){
@@ -194,15 +378,20 @@ public:
     }
     virtual string attributeImpl(const string& name)=0;
     virtual void attributeIsImpl(const string& name, const string& v)=0;
-    BaseRep(const string& name) : Instance(name){}
+    /* Set value to the attribute as of snapshot, if it is kept there */
+    virtual bool snapshotAttributeImpl(Snapshot*, const string&, string&){
+        return false;
+    }
+    BaseRep(const string& name, ManagerImpl* manager) : Instance(name), manager_(manager){}
+protected:
+    Ptr<ManagerImpl> manager_;
 };
 
 class LocationRep : public BaseRep {
 public:
 
     LocationRep(const string& name, ManagerImpl* manager) :
-        BaseRep(name), manager_(manager) {
-        manager_ = manager;
+        BaseRep(name, manager) {
     }
 
     // Instance method
@@ -212,7 +401,6 @@ public:
     }
     void attributeIsImpl(const string& name, const string& v) {}
 protected:
-    Ptr<ManagerImpl> manager_;
     LocationPtr representee_;
     string lookupSegment(const string& name) {
         if (name.substr(0, segmentStrlen) == segmentStr) {
@@ -260,6 +448,17 @@ public:
 };
 
 
+static string averageLatency(ShipmentNum shipments, Hour latency) {
+    double result = 0.0;
+    if (shipments.value() > 0) {
+        result = latency.value() / (double) shipments.value();
+    }
+    stringstream s;
+    s.precision(2);
+    s << fixed << result;
+    return s.str();
+}
+
 class CustomerRep : public LocationRep {
 public:
     CustomerRep(const string& name, ManagerImpl *manager) :
@@ -281,20 +480,28 @@ public:
         } else if (name == shipmentsReceivedStr) {
             return cust->shipmentsReceived().str();
         } else if (name == averageLatencyStr) {
-            double result = 0.0;
-            double numShipments = (double) cust->shipmentsReceived().value();
-            if (numShipments > 0) {
-                result = cust->totalLatency().value() / numShipments;
-            }
-            stringstream s;
-            s.precision(2);
-            s << fixed << result;
-            return s.str();
+            return averageLatency(cust->shipmentsReceived(), cust->totalLatency());
         } else if (name == totalCostStr) {
             return cust->totalCost().str();
         }
         return lookupSegment(name);
     }
+    bool snapshotAttributeImpl(Snapshot* snapshot, const string& name, string& value) {
+        map<string, Snapshot::CustomerCounts>::const_iterator it = snapshot->customers.find(this->name());
+        // customers created since the snapshot are read from the engine
+        if (it == snapshot->customers.end()) return false;
+        Snapshot::CustomerCounts counts = it->second;
+        if (name == shipmentsReceivedStr) {
+            value = counts.received.str();
+        } else if (name == averageLatencyStr) {
+            value = averageLatency(counts.received, counts.latency);
+        } else if (name == totalCostStr) {
+            value = counts.cost.str();
+        } else {
+            return false;
+        }
+        return true;
+    }
     void attributeIsImpl(const string& name, const string& v) {
         Customer* cust = dynamic_cast<Customer*> (representee_.ptr());
 
@@ -327,8 +534,7 @@ public:
 class SegmentRep : public BaseRep {
 public:
     SegmentRep(const string& name, ManagerImpl* manager) :
-        BaseRep(name), manager_(manager) {
-        manager_ = manager;
+        BaseRep(name, manager) {
     }
 
     // Instance method
@@ -362,6 +568,21 @@ public:
         fprintf(stderr, "Invalid attribute input: %s.\n", name.data());
         return "";
     }
+    bool snapshotAttributeImpl(Snapshot* snapshot, const string& name, string& value) {
+        map<string, Snapshot::SegmentCounts>::const_iterator it = snapshot->segments.find(this->name());
+        if (it == snapshot->segments.end()) return false;
+        Snapshot::SegmentCounts counts = it->second;
+        if (name == shipmentsReceivedStr) {
+            value = counts.received.str();
+        } else if (name == shipmentsRefusedStr) {
+            value = counts.refused.str();
+        } else if (name == shipmentsRoutedStr) {
+            value = counts.routed.str();
+        } else {
+            return false;
+        }
+        return true;
+    }
     void attributeIsImpl(const string& name, const string& v) {
         if (name == "source") {
             // remove source if string is empty
@@ -412,7 +633,6 @@ public:
     }
 protected:
     virtual bool sourceOK(Location::EntityType et) = 0;
-    Ptr<ManagerImpl> manager_;
     int segmentNumber(const string& name);
     SegmentPtr representee_;
 };
@@ -476,8 +696,7 @@ protected:
 class FleetRep : public BaseRep {
 public:
     FleetRep(const string& name, ManagerImpl* manager) :
-        BaseRep(name), manager_(manager) {
-        manager_ = manager;
+        BaseRep(name, manager) {
         fleet_ = manager->shippingNetwork()->FleetNew(name);
         fleet_->costMultiplierIs(PathMode::unexpedited(),1.0);
         fleet_->speedMultiplierIs(PathMode::unexpedited(),1.0);
@@ -544,7 +763,6 @@ private:
         delete tokenString;
         return result;
     }
-    Ptr<ManagerImpl> manager_;
     FleetPtr fleet_;
 };
 
@@ -552,8 +770,7 @@ private:
 class StatsRep : public BaseRep {
 public:
     StatsRep(const string& name, ManagerImpl* manager) :
-        BaseRep(name), manager_(manager) {
-        manager_ = manager;
+        BaseRep(name, manager) {
         stats_ = manager->shippingNetwork()->StatsNew(name);
     }
 
@@ -612,19 +829,79 @@ public:
     void attributeIsImpl(const string& name, const string& v) {
     }
 private:
-    Ptr<ManagerImpl> manager_;
     StatsPtr stats_;
 };
 
+class TelemetryRep : public BaseRep {
+public:
+    TelemetryRep(const string& name, ManagerImpl* manager) :
+        BaseRep(name, manager) {
+    }
+
+    // Instance method
+    string attributeImpl(const string& name) {
+        std::stringstream ss;
+        Activity::Telemetry telemetry = manager_->simulationManager()->telemetry();
+
+        if (name == "events") {
+            ss << telemetry.events;
+        } else if (name == "hours per second") {
+            ss.precision(2);
+            ss << fixed << telemetry.hoursPerSecond();
+        } else if (name == "pace lag") {
+            ss.precision(3);
+            ss << fixed << manager_->simulationManager()->paceLag();
+        } else if (name == "rollbacks") {
+            ss << manager_->simulation()->rollbacks();
+        }
+
+        // nonzero buckets as <smallest depth>:<activities run>
+        else if (name == "queue depth") {
+            for (uint32_t i = 0; i < Activity::Telemetry::depthBuckets; i++) {
+                if (telemetry.depth[i] == 0) continue;
+                if (ss.tellp() > 0) ss << " ";
+                ss << (i == 0 ? 0 : 1ULL << (i - 1)) << ":" << telemetry.depth[i];
+            }
+        }
+
+        // per reactor counts, by class name
+        else if (name == "reactors") {
+            map<string, Activity::Telemetry::Reactor>::const_iterator it;
+            for (it = telemetry.reactors.begin(); it != telemetry.reactors.end(); ++it) {
+                if (it != telemetry.reactors.begin()) ss << " ";
+                ss << it->first;
+            }
+        } else if (endsWith(name, " events")) {
+            ss << reactor(telemetry, name.substr(0, name.size() - 7)).events;
+        } else if (endsWith(name, " ns")) {
+            ss << reactor(telemetry, name.substr(0, name.size() - 3)).nanoseconds;
+        }
+
+        else {
+            fprintf(stderr, "Invalid telemetry attribute input.\n");
+        }
+
+        return ss.str();
+    }
+    void attributeIsImpl(const string& name, const string& v) {
+    }
+private:
+    static bool endsWith(const string& s, const string& suffix) {
+        return s.size() > suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+    static Activity::Telemetry::Reactor reactor(const Activity::Telemetry& telemetry, const string& name) {
+        map<string, Activity::Telemetry::Reactor>::const_iterator it = telemetry.reactors.find(name);
+        return it == telemetry.reactors.end() ? Activity::Telemetry::Reactor() : it->second;
+    }
+};
+
 class ConnRep : public BaseRep {
 public:
     ConnRep(const string& name, ManagerImpl* manager) :
-        BaseRep(name), manager_(manager) {
-        manager_ = manager;
+        BaseRep(name, manager) {
         conn_ = manager->shippingNetwork()->ConnNew(name);
         conn_->supportedRouteModeIs(0,PathMode::unexpedited());
         conn_->endLocationTypeIs(Location::customer());
-        routingAlgorithm_ = Conn::none();
     }
 
     // Instance method
@@ -763,12 +1040,12 @@ public:
                 algo = Conn::minTime();
             }
             conn_->routingIs(algo);
-            routingAlgorithm_ = algo;
         }
     }
     void resetRouting(){
+        Conn::RoutingAlgorithm algo = conn_->routing();
         conn_->routingIs(Conn::none());
-        conn_->routingIs(routingAlgorithm_);
+        conn_->routingIs(algo);
     }
 
 private:
@@ -796,20 +1073,31 @@ private:
         }
         return result;
     }
-    Ptr<ManagerImpl> manager_;
     ConnPtr conn_;
-    Conn::RoutingAlgorithm routingAlgorithm_;
 };
 
-ManagerImpl::ManagerImpl() {
+ManagerImpl::ManagerImpl(Activity::Manager::QueuePolicy policy) {
+    recorder_ = NULL;
     connInstance_ = NULL;
     statsInstance_ = NULL;
-    simulationManager_ = new SimulationManagerImpl();
+    telemetryInstance_ = NULL;
+    simulationManager_ = new SimulationManagerImpl(policy);
     shippingNetwork_ = ShippingNetwork::ShippingNetworkIs("ShippingNetwork",simulationManager_->virtualTimeManager());
+    simulationManager_->networkIs(shippingNetwork_);
+    simulationManager_->managerIs(this);
+}
+
+ManagerImpl::~ManagerImpl() {
+    // the simulation thread reads the instances
+    simulationManager_->backgroundDel();
+    delete recorder_;
+    simulationManager_->managerIs(NULL);
 }
 
 Ptr<Instance> ManagerImpl::instanceNew(const string& name,
     const string& type) {
+    SimulationManagerImpl::Lock lock(simulation());
+    if (recorder_) recorder_->instanceNewIs(name, type);
     try {
         // do not name anything the empty string
         if (name == "") {
@@ -857,7 +1145,7 @@ Ptr<Instance> ManagerImpl::instanceNew(const string& name,
         }
 
         // Conn Type
-        else if (type == "Conn") {
+        else if (type == connStr) {
             if (connInstance_) return connInstance_;
             connInstance_ = new ConnRep(name, this);
             inst = connInstance_;
@@ -867,20 +1155,28 @@ Ptr<Instance> ManagerImpl::instanceNew(const string& name,
         }
 
         // Fleet Type
-        else if (type == "Fleet") {
+        else if (type == fleetStr) {
             // not unique
             inst = new FleetRep(name, this);
             instType = fleet_;
         }
 
         // Stats Type
-        else if (type == "Stats") {
+        else if (type == statsStr) {
             if (statsInstance_) return statsInstance_;
             statsInstance_ = new StatsRep(name, this);
             inst = statsInstance_;
             instType = stats_;
         }
 
+        // Telemetry Type
+        else if (type == telemetryStr) {
+            if (telemetryInstance_) return telemetryInstance_;
+            telemetryInstance_ = new TelemetryRep(name, this);
+            inst = telemetryInstance_;
+            instType = telemetry_;
+        }
+
         else {
             fprintf(stderr, "Invalid instance new.\n");
             return NULL;
@@ -902,6 +1198,8 @@ Ptr<Instance> ManagerImpl::instanceNew(const string& name,
 }
 
 void ManagerImpl::instanceDel(const string& name) {
+    SimulationManagerImpl::Lock lock(simulation());
+    if (recorder_) recorder_->instanceDelIs(name);
     try {
         map<string,InstanceMapElem>::const_iterator t = instance_.find(name);
         if (t == instance_.end()) {
@@ -929,14 +1227,814 @@ void ManagerImpl::instanceDel(const string& name) {
     }
 }
 
+const string& ManagerImpl::spec(InstanceType type) {
+    static const string* specs[] = {
+        &customerStr, &portStr, &truckTerminalStr, &boatTerminalStr, &planeTerminalStr,
+        &truckSegmentStr, &boatSegmentStr, &planeSegmentStr,
+        &statsStr, &connStr, &fleetStr, &telemetryStr
+    };
+    return *specs[type];
+}
+
+template <class T> static void checkpointWrite(std::ostream& out, T value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <class T> static T checkpointRead(std::istream& in) {
+    T value;
+    in.read(reinterpret_cast<char*>(&value), sizeof(value));
+    if (!in) throw Fwk::InternalException("File is truncated.");
+    return value;
+}
+
+/* The file holds the instances and simulation settings, then the
+ * engine's checkpoint of the network */
+void ManagerImpl::checkpointIs(const string& file) {
+    SimulationManagerImpl::Lock lock(simulation());
+    std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        fprintf(stderr, "Cannot write checkpoint %s.\n", file.data());
+        return;
+    }
+    try {
+        out.write(checkpointMagic, sizeof(checkpointMagic));
+        Activity::ManagerPtr manager = simulationManager_->virtualTimeManager();
+        checkpointWrite<uint8_t>(out, manager->queuePolicy());
+        checkpointWrite<uint8_t>(out, manager->batchDispatch());
+        checkpointWrite(out, simulationManager_->pace_);
+        checkpointWrite(out, simulationManager_->optimisticWindow_.value());
+        checkpointWrite<uint32_t>(out, instance_.size());
+        map<string,InstanceMapElem>::const_iterator it;
+        for (it = instance_.begin(); it != instance_.end(); it++) {
+            checkpointWrite<uint8_t>(out, it->second.type);
+            checkpointWrite<uint32_t>(out, it->first.size());
+            out.write(it->first.data(), it->first.size());
+        }
+        shippingNetwork_->checkpointIs(out);
+    }
+    catch(const Fwk::Exception& e){
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+Ptr<ManagerImpl> ManagerImpl::checkpointRestore(const string& file) {
+    std::ifstream in(file.c_str(), std::ios::binary);
+    if (!in) {
+        fprintf(stderr, "Cannot read checkpoint %s.\n", file.data());
+        return NULL;
+    }
+    try {
+        char magic[sizeof(checkpointMagic)];
+        in.read(magic, sizeof(magic));
+        if (!in || !std::equal(magic, magic + sizeof(magic), checkpointMagic))
+            throw Fwk::InternalException("Not a checkpoint.");
+        Activity::Manager::QueuePolicy policy =
+            static_cast<Activity::Manager::QueuePolicy>(checkpointRead<uint8_t>(in));
+        Ptr<ManagerImpl> manager = new ManagerImpl(policy);
+        manager->simulationManager_->batchDispatchIs(checkpointRead<uint8_t>(in));
+        double pace = checkpointRead<double>(in);
+        manager->simulationManager_->optimisticWindowIs(checkpointRead<double>(in));
+        // recreate the instances, then let the engine fill them in
+        for (uint32_t count = checkpointRead<uint32_t>(in); count > 0; count--) {
+            InstanceType type = static_cast<InstanceType>(checkpointRead<uint8_t>(in));
+            if (type > telemetry_) throw Fwk::InternalException("Checkpoint is corrupt.");
+            string name(checkpointRead<uint32_t>(in), '\0');
+            if (!name.empty()) in.read(&name[0], name.size());
+            if (!in || !manager->instanceNew(name, spec(type)))
+                throw Fwk::InternalException("Checkpoint instance " + name + " cannot be created.");
+        }
+        manager->simulationManager_->restoreIs(in);
+        manager->simulationManager_->paceIs(pace);
+        return manager;
+    }
+    catch(const Fwk::Exception& e){
+        std::cerr << e.what() << std::endl;
+        return NULL;
+    }
+}
+
+Recorder::Recorder(const string& file, SimulationManagerImpl* simulation) :
+    out_(file.c_str(), std::ios::binary | std::ios::trunc), simulation_(simulation),
+    recorded_(simulation->now()) {
+    Activity::ManagerPtr manager = simulation->virtualTimeManager();
+    out_.write(recordMagic, sizeof(recordMagic));
+    checkpointWrite<uint8_t>(out_, manager->queuePolicy());
+    checkpointWrite<uint8_t>(out_, manager->batchDispatch());
+    checkpointWrite(out_, simulation->optimisticWindow_.value());
+    checkpointWrite(out_, simulation->network_->random().seed());
+    out_.flush();
+}
+
+Recorder::~Recorder() {
+    if (out_.is_open()) timeIs(simulation_->now());
+}
+
+/* Every entry has been flushed, so closing writes nothing */
+void Recorder::detach() {
+    out_.close();
+}
+
+void Recorder::timeIs(Activity::Time t) {
+    if (t == recorded_) return;
+    recorded_ = t;
+    checkpointWrite<uint8_t>(out_, time_);
+    checkpointWrite(out_, t.value());
+    out_.flush();
+}
+
+void Recorder::commandIs(Command command) {
+    timeIs(simulation_->now());
+    checkpointWrite<uint8_t>(out_, command);
+}
+
+void Recorder::stringIs(const string& value) {
+    map<string, uint32_t>::const_iterator it = strings_.find(value);
+    if (it != strings_.end()) {
+        checkpointWrite(out_, it->second);
+        return;
+    }
+    uint32_t index = strings_.size();
+    strings_.insert(make_pair(value, index));
+    checkpointWrite(out_, index);
+    checkpointWrite<uint32_t>(out_, value.size());
+    out_.write(value.data(), value.size());
+}
+
+string Recorder::stringRead(std::istream& in, vector<string>& strings) {
+    uint32_t index = checkpointRead<uint32_t>(in);
+    if (index < strings.size()) return strings[index];
+    if (index > strings.size()) throw Fwk::InternalException("Log is corrupt.");
+    string value(checkpointRead<uint32_t>(in), '\0');
+    if (!value.empty()) in.read(&value[0], value.size());
+    if (!in) throw Fwk::InternalException("Log is truncated.");
+    strings.push_back(value);
+    return value;
+}
+
+void Recorder::instanceNewIs(const string& name, const string& spec) {
+    commandIs(instanceNew_);
+    stringIs(name);
+    stringIs(spec);
+    out_.flush();
+}
+
+void Recorder::instanceDelIs(const string& name) {
+    commandIs(instanceDel_);
+    stringIs(name);
+    out_.flush();
+}
+
+void Recorder::attributeIs(const string& instance, const string& name, const string& value) {
+    commandIs(attribute_);
+    stringIs(instance);
+    stringIs(name);
+    stringIs(value);
+    out_.flush();
+}
+
+void Recorder::batchDispatchIs(bool batchDispatch) {
+    commandIs(batchDispatch_);
+    checkpointWrite<uint8_t>(out_, batchDispatch);
+    out_.flush();
+}
+
+void Recorder::partitionsIs(uint32_t partitions) {
+    commandIs(partitions_);
+    checkpointWrite(out_, partitions);
+    out_.flush();
+}
+
+void Recorder::optimisticWindowIs(Activity::Time window) {
+    commandIs(optimisticWindow_);
+    checkpointWrite(out_, window.value());
+    out_.flush();
+}
+
+void Recorder::randomSeedIs(uint32_t seed) {
+    commandIs(randomSeed_);
+    checkpointWrite(out_, seed);
+    out_.flush();
+}
+
+/* A replay has to follow the same changes from the same start, so the
+ * log begins with a manager that has not changed yet */
+void ManagerImpl::recordIs(const string& file) {
+    SimulationManagerImpl::Lock lock(simulation());
+    if (file.empty()) {
+        delete recorder_;
+        recorder_ = NULL;
+        return;
+    }
+    if (recorder_ || !instance_.empty() || simulationManager_->now() > 0 ||
+        shippingNetwork_->parallelManager()) {
+        fprintf(stderr, "Recording must start on a new manager.\n");
+        return;
+    }
+    Recorder* recorder = new Recorder(file, simulationManager_.ptr());
+    if (!recorder->ok()) {
+        fprintf(stderr, "Cannot write log %s.\n", file.data());
+        delete recorder;
+        return;
+    }
+    recorder_ = recorder;
+}
+
+Ptr<ManagerImpl> ManagerImpl::replay(const string& file) {
+    std::ifstream in(file.c_str(), std::ios::binary);
+    if (!in) {
+        fprintf(stderr, "Cannot read log %s.\n", file.data());
+        return NULL;
+    }
+    try {
+        char magic[sizeof(recordMagic)];
+        in.read(magic, sizeof(magic));
+        if (!in || !std::equal(magic, magic + sizeof(magic), recordMagic))
+            throw Fwk::InternalException("Not a log.");
+        Activity::Manager::QueuePolicy policy =
+            static_cast<Activity::Manager::QueuePolicy>(checkpointRead<uint8_t>(in));
+        Ptr<ManagerImpl> manager = new ManagerImpl(policy);
+        SimulationManagerImpl* simulation = manager->simulation();
+        simulation->paceIs(Instance::SimulationManager::unpaced());
+        simulation->batchDispatchIs(checkpointRead<uint8_t>(in));
+        simulation->optimisticWindowIs(checkpointRead<double>(in));
+        simulation->randomSeedIs(checkpointRead<uint32_t>(in));
+        // clients may go on setting attributes of an instance they hold
+        // after deleting it, so instances are kept by name here
+        map<string, Ptr<Instance> > instances;
+        vector<string> strings;
+        while (in.peek() != EOF) {
+            switch (checkpointRead<uint8_t>(in)) {
+            case Recorder::time_:
+                simulation->timeIs(checkpointRead<double>(in));
+                break;
+            case Recorder::instanceNew_: {
+                string name = Recorder::stringRead(in, strings);
+                string spec = Recorder::stringRead(in, strings);
+                Ptr<Instance> inst = manager->instanceNew(name, spec);
+                if (inst) instances[inst->name()] = inst;
+                break;
+            }
+            case Recorder::instanceDel_:
+                manager->instanceDel(Recorder::stringRead(in, strings));
+                break;
+            case Recorder::attribute_: {
+                string name = Recorder::stringRead(in, strings);
+                string attribute = Recorder::stringRead(in, strings);
+                string value = Recorder::stringRead(in, strings);
+                map<string, Ptr<Instance> >::iterator it = instances.find(name);
+                if (it == instances.end())
+                    throw Fwk::InternalException("Log sets attributes of unknown instance " + name + ".");
+                it->second->attributeIs(attribute, value);
+                break;
+            }
+            case Recorder::batchDispatch_:
+                simulation->batchDispatchIs(checkpointRead<uint8_t>(in));
+                break;
+            case Recorder::partitions_:
+                simulation->partitionsIs(checkpointRead<uint32_t>(in));
+                break;
+            case Recorder::optimisticWindow_:
+                simulation->optimisticWindowIs(checkpointRead<double>(in));
+                break;
+            case Recorder::randomSeed_:
+                simulation->randomSeedIs(checkpointRead<uint32_t>(in));
+                break;
+            default:
+                throw Fwk::InternalException("Log is corrupt.");
+            }
+        }
+        return manager;
+    }
+    catch(const Fwk::Exception& e){
+        std::cerr << e.what() << std::endl;
+        return NULL;
+    }
+}
+
+#ifdef FWK_ATOMIC_REFS
+/* The simulation thread. It advances real time toward the latest target a
+ * snapshot interval at a time, holding mutex_ for each step and publishing
+ * a snapshot after it. Clients take mutex_ through Lock, which the thread
+ * yields to between steps. */
+class SimulationManagerImpl::Background {
+public:
+    Background(SimulationManagerImpl* owner) :
+        owner_(owner), target_(owner->virtualTimeManager_->now()), stop_(false), waiting_(0) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        // the engine calls back into locked client code
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&mutex_, &attr);
+        pthread_mutexattr_destroy(&attr);
+        pthread_mutex_init(&snapshotMutex_, NULL);
+        pthread_cond_init(&changed_, NULL);
+        pthread_create(&thread_, NULL, &Background::run, this);
+    }
+    ~Background() {
+        lock();
+        stop_ = true;
+        pthread_cond_broadcast(&changed_);
+        unlock();
+        pthread_join(thread_, NULL);
+        pthread_cond_destroy(&changed_);
+        pthread_mutex_destroy(&snapshotMutex_);
+        pthread_mutex_destroy(&mutex_);
+    }
+    void lock() {
+        __sync_fetch_and_add(&waiting_, 1);
+        pthread_mutex_lock(&mutex_);
+        __sync_fetch_and_sub(&waiting_, 1);
+    }
+    void unlock() { pthread_mutex_unlock(&mutex_); }
+    void targetIs(Activity::Time t) {
+        lock();
+        if (t > target_) target_ = t;
+        pthread_cond_broadcast(&changed_);
+        unlock();
+    }
+    /* Wait for the thread to reach its target */
+    void targetWait() {
+        lock();
+        while (target_ > owner_->virtualTimeManager_->now()) pthread_cond_wait(&changed_, &mutex_);
+        unlock();
+    }
+    Ptr<Snapshot> snapshot() {
+        pthread_mutex_lock(&snapshotMutex_);
+        Ptr<Snapshot> snapshot = snapshot_;
+        pthread_mutex_unlock(&snapshotMutex_);
+        return snapshot;
+    }
+    void snapshotIs(Ptr<Snapshot> snapshot) {
+        pthread_mutex_lock(&snapshotMutex_);
+        snapshot_ = snapshot;
+        pthread_mutex_unlock(&snapshotMutex_);
+    }
+private:
+    static void* run(void* arg) {
+        ((Background*)arg)->loop();
+        return NULL;
+    }
+    void loop() {
+        pthread_mutex_lock(&mutex_);
+        while (true) {
+            if (!(target_ > owner_->virtualTimeManager_->now())) {
+                while (!stop_ && !(target_ > owner_->virtualTimeManager_->now()))
+                    pthread_cond_wait(&changed_, &mutex_);
+                // the time spent idle is not lag
+                owner_->paceAnchored_ = false;
+            }
+            if (stop_) break;
+            Activity::Time step = owner_->virtualTimeManager_->now().value() + owner_->snapshotInterval_.value();
+            if (step > target_) step = target_;
+            try {
+                owner_->virtualNowIs(step);
+            }
+            catch(const Fwk::Exception& e){
+                std::cerr << e.what() << std::endl;
+                target_ = owner_->virtualTimeManager_->now();
+            }
+            catch(...){
+                std::cerr << "Error caught in simulation thread" << std::endl;
+                target_ = owner_->virtualTimeManager_->now();
+            }
+            owner_->snapshotPublish();
+            pthread_cond_broadcast(&changed_);
+            // let clients waiting for the engine in before the next step
+            while (__atomic_load_n(&waiting_, __ATOMIC_RELAXED) > 0) {
+                pthread_mutex_unlock(&mutex_);
+                sched_yield();
+                pthread_mutex_lock(&mutex_);
+            }
+        }
+        pthread_mutex_unlock(&mutex_);
+    }
+    SimulationManagerImpl* owner_;
+    Activity::Time target_;
+    bool stop_;
+    // clients blocked in lock()
+    int waiting_;
+    pthread_t thread_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t changed_;
+    pthread_mutex_t snapshotMutex_;
+    Ptr<Snapshot> snapshot_;
+};
+
+SimulationManagerImpl::Lock::Lock(SimulationManagerImpl* simulation) :
+    simulation_(simulation->background_ ? simulation : NULL) {
+    if (simulation_) simulation_->background_->lock();
+}
+
+SimulationManagerImpl::Lock::~Lock() {
+    if (simulation_) simulation_->background_->unlock();
+}
+#else
+SimulationManagerImpl::Lock::Lock(SimulationManagerImpl*) : simulation_(NULL) {}
+
+SimulationManagerImpl::Lock::~Lock() {}
+#endif
+
+SimulationManagerImpl::~SimulationManagerImpl(){
+    backgroundDel();
+}
+
+void SimulationManagerImpl::backgroundIs(bool background){
+#ifdef FWK_ATOMIC_REFS
+    if(background && !background_){
+        background_ = new Background(this);
+        Lock lock(this);
+        snapshotPublish();
+    } else if(!background && background_){
+        background_->targetWait();
+        backgroundDel();
+    }
+#else
+    if(background)
+        std::cerr << "Simulating in the background needs a build with FWK_ATOMIC_REFS." << std::endl;
+#endif
+}
+
+/* Stop the simulation thread where it is */
+void SimulationManagerImpl::backgroundDel(){
+#ifdef FWK_ATOMIC_REFS
+    delete background_;
+    background_ = NULL;
+#endif
+}
+
+void SimulationManagerImpl::snapshotIntervalIs(Activity::Time interval){
+    Lock lock(this);
+    if(interval > 0)
+        snapshotInterval_=interval;
+}
+
+Activity::Time SimulationManagerImpl::snapshotTime(){
+    Ptr<Snapshot> current = snapshot();
+    if(current)
+        return current->time;
+    return virtualTimeManager_->now();
+}
+
+Ptr<Snapshot> SimulationManagerImpl::snapshot(){
+#ifdef FWK_ATOMIC_REFS
+    if(background_)
+        return background_->snapshot();
+#endif
+    return NULL;
+}
+
+/* Record the counters of every customer and segment; called with the
+ * simulation between steps */
+void SimulationManagerImpl::snapshotPublish(){
+#ifdef FWK_ATOMIC_REFS
+    if(!background_ || !manager_) return;
+    Ptr<Snapshot> snapshot = new Snapshot(virtualTimeManager_->now());
+    map<string, ManagerImpl::InstanceMapElem>::const_iterator it;
+    for(it = manager_->instance_.begin(); it != manager_->instance_.end(); it++){
+        ManagerImpl::InstanceType type = it->second.type;
+        if(type == ManagerImpl::customer()){
+            LocationRep* rep = dynamic_cast<LocationRep*>(it->second.ptr.ptr());
+            Customer* cust = dynamic_cast<Customer*>(rep->representee().ptr());
+            snapshot->customers.insert(make_pair(it->first, Snapshot::CustomerCounts(
+                cust->shipmentsReceived(), cust->totalLatency(), cust->totalCost())));
+        } else if(type == ManagerImpl::truckSegment() || type == ManagerImpl::boatSegment() ||
+                  type == ManagerImpl::planeSegment()){
+            SegmentPtr segment = dynamic_cast<SegmentRep*>(it->second.ptr.ptr())->representee();
+            snapshot->segments.insert(make_pair(it->first, Snapshot::SegmentCounts(
+                segment->shipmentsReceived(), segment->shipmentsRefused(), segment->shipmentsRouted())));
+        }
+    }
+    background_->snapshotIs(snapshot);
+#endif
+}
+
 void SimulationManagerImpl::timeIs(Activity::Time t){
-    if(t > realTimeManager_->now())
-        realTimeManager_->nowIs(t);
+#ifdef FWK_ATOMIC_REFS
+    if(background_){
+        background_->targetIs(t);
+        return;
+    }
+#endif
+    paceAnchored_=false;
+    if(t > virtualTimeManager_->now())
+        virtualNowIs(t);
+    timeRecord();
 }
 
 void SimulationManagerImpl::virtualTimeIs(Activity::Time t){
-    if(t > virtualTimeManager_->now())
-        virtualTimeManager_->nowIs(t);
+    Lock lock(this);
+    // as fast as possible
+    virtualTimeManager_->paceGateIs(NULL);
+    try {
+        if(t > virtualTimeManager_->now())
+            virtualNowIs(t);
+    }
+    catch(...){
+        paceGateUse();
+        throw;
+    }
+    paceGateUse();
+    timeRecord();
+    snapshotPublish();
+}
+
+Activity::Time SimulationManagerImpl::boundedTimeIs(Activity::Time t, uint64_t maxEvents, Activity::WallTime deadline){
+    Lock lock(this);
+    bounded_=true;
+    boundReached_=false;
+    paceAnchored_=false;
+    maxEvents_=maxEvents;
+    deadline_=deadline;
+    try {
+        if(t > virtualTimeManager_->now())
+            virtualNowIs(t);
+    }
+    catch(...){
+        bounded_=false;
+        throw;
+    }
+    bounded_=false;
+    timeRecord();
+    snapshotPublish();
+    return boundReached_ ? virtualTimeManager_->now() : t;
+}
+
+void SimulationManagerImpl::virtualNowIs(Activity::Time t){
+    Activity::ParallelManagerPtr parallel = network_->parallelManager();
+    if(!parallel){
+        if(!bounded_){
+            virtualTimeManager_->nowIs(t);
+            return;
+        }
+        uint64_t events = virtualTimeManager_->events();
+        Activity::Time reached = virtualTimeManager_->nowIs(t, maxEvents_, deadline_);
+        boundUse(virtualTimeManager_->events() - events, reached < t);
+        return;
+    }
+    // fleets may have changed since the last step
+    parallel->lookaheadIs(network_->lookahead().value());
+    parallel->optimisticWindowIs(optimisticWindow_);
+    if(!bounded_){
+        parallel->nowIs(t);
+        return;
+    }
+    uint64_t events = parallel->events();
+    Activity::Time reached = parallel->nowIs(t, maxEvents_, deadline_);
+    boundUse(parallel->events() - events, reached < t);
+}
+
+void SimulationManagerImpl::boundUse(uint64_t events, bool stopped){
+    maxEvents_ = events < maxEvents_ ? maxEvents_ - events : 0;
+    if(stopped || maxEvents_ == 0 ||
+       (deadline_ < Activity::WallTime::never() && Activity::WallTime::now() >= deadline_))
+        boundReached_=true;
+}
+
+void SimulationManagerImpl::paceIs(double hoursPerSecond){
+    Lock lock(this);
+    if(!(hoursPerSecond > 0)){
+        std::cerr << "Pace must be positive." << std::endl;
+        return;
+    }
+    pace_=hoursPerSecond;
+    paceAnchored_=false;
+    paceLag_=0;
+    paceGateUse();
+}
+
+/* Unpaced runs leave the manager without a gate */
+void SimulationManagerImpl::paceGateUse(){
+    if(pace_ == Instance::SimulationManager::unpaced())
+        virtualTimeManager_->paceGateIs(NULL);
+    else
+        virtualTimeManager_->paceGateIs(paceGate_.ptr());
+}
+
+/* Sleep until the wall clock deadline of virtual time t, measured from
+ * the epoch rather than the last hour so time spent running activities
+ * does not add up. A deadline already passed is recorded as lag. */
+void SimulationManagerImpl::paceWait(Activity::Time t){
+    if(!paceAnchored_){
+        paceEpoch_=Activity::WallTime::now();
+        paceEpochTime_=virtualTimeManager_->now();
+        paceAnchored_=true;
+    }
+    double seconds = (t.value() - paceEpochTime_.value()) / pace_;
+    if(!(seconds > 0))
+        return;
+    uint64_t deadline = paceEpoch_.value() + (uint64_t)(seconds * 1e9);
+    uint64_t now = Activity::WallTime::now().value();
+    if(now >= deadline){
+        double lag = (now - deadline) / 1e9;
+        if(lag > paceLag_)
+            paceLag_=lag;
+        return;
+    }
+    timespec wake;
+    wake.tv_sec = deadline / 1000000000ULL;
+    wake.tv_nsec = deadline % 1000000000ULL;
+    // WallTime counts CLOCK_MONOTONIC nanoseconds
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+}
+
+Activity::Telemetry SimulationManagerImpl::telemetry(){
+    Lock lock(this);
+    Activity::ParallelManagerPtr parallel = network_->parallelManager();
+    return parallel ? parallel->telemetry() : virtualTimeManager_->telemetry();
+}
+
+uint64_t SimulationManagerImpl::rollbacks(){
+    Lock lock(this);
+    Activity::ParallelManagerPtr parallel = network_->parallelManager();
+    return parallel ? parallel->rollbacks() : 0;
+}
+
+/* Restoring moves the clock to the checkpoint without pacing */
+void SimulationManagerImpl::restoreIs(std::istream& in){
+    Lock lock(this);
+    virtualTimeManager_->paceGateIs(NULL);
+    try {
+        network_->restoreIs(in);
+    }
+    catch(...){
+        paceGateUse();
+        throw;
+    }
+    paceGateUse();
+}
+
+/* Threads do not survive fork(), so neither the simulation thread nor the
+ * partitions' workers can be branched */
+uint32_t SimulationManagerImpl::branch(){
+    Lock lock(this);
+    if(background_){
+        std::cerr << "Cannot branch while simulating in the background." << std::endl;
+        return 0;
+    }
+    if(network_->parallelManager()){
+        std::cerr << "Partitioned simulations cannot branch." << std::endl;
+        return 0;
+    }
+    int fds[2];
+    if(pipe(fds) != 0){
+        std::cerr << "Cannot create a pipe for the branch." << std::endl;
+        return 0;
+    }
+    // buffered output would otherwise be written by both processes
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(NULL);
+    pid_t pid = fork();
+    if(pid < 0){
+        close(fds[0]);
+        close(fds[1]);
+        std::cerr << "Cannot fork a branch." << std::endl;
+        return 0;
+    }
+    if(pid == 0){
+        close(fds[0]);
+        uint32_t number = branches_.size() + 1;
+        // the earlier branches belong to the parent
+        for(size_t i = 0; i < branches_.size(); i++)
+            close(branches_[i].fd);
+        branches_.clear();
+        // what the branch changes must not reach the parent's log
+        if(manager_->recorder_){
+            manager_->recorder_->detach();
+            delete manager_->recorder_;
+            manager_->recorder_ = NULL;
+        }
+        branchFd_=fds[1];
+        return number;
+    }
+    close(fds[1]);
+    Branch branch;
+    branch.pid=pid;
+    branch.fd=fds[0];
+    branches_.push_back(branch);
+    return 0;
+}
+
+void SimulationManagerImpl::branchResultIs(const string& result){
+    if(branchFd_ < 0){
+        std::cerr << "Only a branch has a result." << std::endl;
+        return;
+    }
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(NULL);
+    const char* data = result.data();
+    size_t left = result.size();
+    while(left > 0){
+        ssize_t written = write(branchFd_, data, left);
+        if(written < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        data += written;
+        left -= written;
+    }
+    close(branchFd_);
+    // the parent's exit handlers and destructors are not the branch's
+    _exit(left == 0 ? 0 : 1);
+}
+
+/* Reads every pipe as its branch writes, so that no branch blocks on a
+ * full one while another is being read */
+vector<string> SimulationManagerImpl::branchResults(){
+    size_t reading = branches_.size();
+    while(reading > 0){
+        vector<pollfd> fds;
+        vector<size_t> index;
+        for(size_t i = 0; i < branches_.size(); i++){
+            if(branches_[i].fd < 0) continue;
+            pollfd p;
+            p.fd=branches_[i].fd;
+            p.events=POLLIN;
+            p.revents=0;
+            fds.push_back(p);
+            index.push_back(i);
+        }
+        if(poll(&fds[0], fds.size(), -1) < 0){
+            if(errno == EINTR) continue;
+            std::cerr << "Cannot read branch results." << std::endl;
+            break;
+        }
+        for(size_t i = 0; i < fds.size(); i++){
+            if(!fds[i].revents) continue;
+            Branch& branch = branches_[index[i]];
+            char buffer[4096];
+            ssize_t count = read(branch.fd, buffer, sizeof(buffer));
+            if(count > 0){
+                branch.result.append(buffer, count);
+            } else if(count == 0 || errno != EINTR){
+                close(branch.fd);
+                branch.fd=-1;
+                reading--;
+            }
+        }
+    }
+    vector<string> results;
+    for(size_t i = 0; i < branches_.size(); i++){
+        if(branches_[i].fd >= 0)
+            close(branches_[i].fd);
+        int status = 0;
+        while(waitpid(branches_[i].pid, &status, 0) < 0 && errno == EINTR);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            std::cerr << "Branch " << i + 1 << " failed." << std::endl;
+            branches_[i].result.clear();
+        }
+        results.push_back(branches_[i].result);
+    }
+    branches_.clear();
+    return results;
+}
+
+Recorder* SimulationManagerImpl::recorder(){
+    return manager_ ? manager_->recorder() : NULL;
+}
+
+/* The time a step reached; in the background the next change records
+ * where the simulation thread had got to */
+void SimulationManagerImpl::timeRecord(){
+    if(recorder())
+        recorder()->timeIs(virtualTimeManager_->now());
+}
+
+void SimulationManagerImpl::batchDispatchIs(bool batchDispatch){
+    Lock lock(this);
+    if(recorder())
+        recorder()->batchDispatchIs(batchDispatch);
+    if(network_ && network_->parallelManager())
+        network_->parallelManager()->batchDispatchIs(batchDispatch);
+    else
+        virtualTimeManager_->batchDispatchIs(batchDispatch);
+}
+
+void SimulationManagerImpl::optimisticWindowIs(Activity::Time window){
+    Lock lock(this);
+    if(recorder())
+        recorder()->optimisticWindowIs(window);
+    optimisticWindow_=window;
+}
+
+void SimulationManagerImpl::randomSeedIs(uint32_t seed){
+    Lock lock(this);
+    if(recorder())
+        recorder()->randomSeedIs(seed);
+    network_->random().seedIs(seed);
+}
+
+void SimulationManagerImpl::partitionsIs(uint32_t partitions){
+    Lock lock(this);
+    if(recorder())
+        recorder()->partitionsIs(partitions);
+    try {
+        network_->partitionsIs(partitions);
+    }
+    catch(const Fwk::Exception& e){
+        std::cerr << e.what() << std::endl;
+    }
 }
 
 
@@ -950,6 +2048,18 @@ void SimulationManagerImpl::virtualTimeIs(Activity::Time t){
  * in turn interact with the engine layer).
  */
 Ptr<Instance::Manager> shippingInstanceManager() {
-    return new Shipping::ManagerImpl();
+    return new Shipping::ManagerImpl(Activity::Manager::heap());
+}
+
+Ptr<Instance::Manager> shippingInstanceManager(Activity::Manager::QueuePolicy policy) {
+    return new Shipping::ManagerImpl(policy);
+}
+
+Ptr<Instance::Manager> shippingInstanceManager(const string& checkpoint) {
+    return Shipping::ManagerImpl::checkpointRestore(checkpoint).ptr();
+}
+
+Ptr<Instance::Manager> shippingInstanceManagerReplay(const string& log) {
+    return Shipping::ManagerImpl::replay(log).ptr();
 }
 
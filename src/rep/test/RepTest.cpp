@@ -141,6 +141,24 @@ TEST(Activity, ScheduledFleets) {
         conn->attribute("connect loc1 : loc2"));
 }
 
+TEST(Instance, TelemetryTest) {
+    Ptr<Instance::Manager> m = shippingInstanceManager();
+    ASSERT_TRUE(m);
+    Ptr<Instance> telemetry = m->instanceNew("telemetry", "Telemetry");
+    ASSERT_TRUE(telemetry);
+
+    // nothing has run yet
+    EXPECT_EQ(telemetry->attribute("events"), "0");
+    EXPECT_EQ(telemetry->attribute("hours per second"), "0.00");
+    EXPECT_EQ(telemetry->attribute("queue depth"), "");
+    EXPECT_EQ(telemetry->attribute("ForwardActivityReactor events"), "0");
+    EXPECT_EQ(telemetry->attribute("ForwardActivityReactor ns"), "0");
+
+    // a second telemetry instance is the same one
+    Ptr<Instance> telemetry2 = m->instanceNew("telemetry2", "Telemetry");
+    EXPECT_EQ(telemetry, telemetry2);
+}
+
 TEST(Activity, BasicShipments) {
     Ptr<Instance::Manager> m = shippingInstanceManager();
     ASSERT_TRUE(m);
@@ -229,6 +247,494 @@ TEST(Activity, BasicShipments) {
 
 }
 
+TEST(Activity, BoundedTime) {
+    Ptr<Instance::Manager> m = shippingInstanceManager();
+    Ptr<Instance> fleet = m->instanceNew("fleet", "Fleet");
+    fleet->attributeIs("Truck, speed", "1");
+    fleet->attributeIs("Truck, capacity", "10");
+    fleet->attributeIs("Truck, cost", "100");
+    Ptr<Instance> loc1 = m->instanceNew("loc1", "Customer");
+    Ptr<Instance> loc2 = m->instanceNew("loc2", "Customer");
+    Ptr<Instance> seg1 = m->instanceNew("seg1", "Truck segment");
+    Ptr<Instance> seg2 = m->instanceNew("seg2", "Truck segment");
+    seg1->attributeIs("source", "loc1");
+    seg1->attributeIs("length", "1.0");
+    seg1->attributeIs("return segment", "seg2");
+    seg2->attributeIs("source", "loc2");
+    seg2->attributeIs("length", "1.5");
+    Ptr<Instance> conn = m->instanceNew("conn", "Conn");
+    conn->attributeIs("routing", "minHops");
+    loc1->attributeIs("Transfer Rate", "8");
+    loc1->attributeIs("Shipment Size", "10");
+    loc1->attributeIs("Destination", "loc2");
+
+    // a few activities at a time, always making progress
+    Activity::Time reached = 0;
+    uint32_t calls = 0;
+    while (reached < 7) {
+        Activity::Time next = m->simulationManager()->timeIs(7, 1);
+        ASSERT_TRUE(next > reached);
+        ASSERT_TRUE(next <= 7);
+        reached = next;
+        calls++;
+    }
+    EXPECT_LT(1u, calls);
+    EXPECT_EQ("2", loc2->attribute("Shipments Received"));
+    EXPECT_EQ("1.00", loc2->attribute("Average Latency"));
+
+    // a deadline already passed still runs one step
+    reached = m->simulationManager()->timeIs(25, Activity::WallTime::now());
+    EXPECT_TRUE(reached > 7);
+    EXPECT_TRUE(reached < 25);
+
+    // an unbounded call picks up where the bounded ones stopped
+    m->simulationManager()->timeIs(25);
+    loc1->attributeIs("Transfer Rate", "0");
+    m->simulationManager()->timeIs(28);
+    EXPECT_EQ("8", seg1->attribute("Shipments Received"));
+    EXPECT_EQ(Activity::Time(28), m->simulationManager()->timeIs(28, Activity::WallTime::nowPlus(60)));
+}
+
+TEST(Activity, Pace) {
+    Ptr<Instance::Manager> m = shippingInstanceManager();
+    Ptr<Instance> fleet = m->instanceNew("fleet", "Fleet");
+    fleet->attributeIs("Truck, speed", "1");
+    fleet->attributeIs("Truck, capacity", "10");
+    Ptr<Instance> loc1 = m->instanceNew("loc1", "Customer");
+    Ptr<Instance> loc2 = m->instanceNew("loc2", "Customer");
+    Ptr<Instance> seg1 = m->instanceNew("seg1", "Truck segment");
+    Ptr<Instance> seg2 = m->instanceNew("seg2", "Truck segment");
+    seg1->attributeIs("source", "loc1");
+    seg1->attributeIs("length", "1.0");
+    seg1->attributeIs("return segment", "seg2");
+    seg2->attributeIs("source", "loc2");
+    Ptr<Instance> conn = m->instanceNew("conn", "Conn");
+    conn->attributeIs("routing", "minHops");
+    loc1->attributeIs("Transfer Rate", "8");
+    loc1->attributeIs("Shipment Size", "10");
+    loc1->attributeIs("Destination", "loc2");
+    Ptr<Instance::SimulationManager> simulation = m->simulationManager();
+
+    // 10 hours at 100 per second
+    simulation->paceIs(100);
+    Activity::WallTime start = Activity::WallTime::now();
+    simulation->timeIs(10);
+    double seconds = (Activity::WallTime::now().value() - start.value()) / 1e9;
+    EXPECT_LE(0.09, seconds);
+    EXPECT_GT(0.5, seconds);
+
+    // no pace, no waiting
+    simulation->paceIs(Instance::SimulationManager::unpaced());
+    start = Activity::WallTime::now();
+    simulation->timeIs(1000);
+    seconds = (Activity::WallTime::now().value() - start.value()) / 1e9;
+    EXPECT_GT(0.5, seconds);
+    EXPECT_EQ(0.0, simulation->paceLag());
+    EXPECT_LT(100, atoi(loc2->attribute("Shipments Received").c_str()));
+}
+
+TEST(Activity, BackgroundSimulation) {
+    Ptr<Instance::Manager> m = shippingInstanceManager();
+    Ptr<Instance> fleet = m->instanceNew("fleet", "Fleet");
+    fleet->attributeIs("Truck, speed", "1");
+    fleet->attributeIs("Truck, capacity", "10");
+    fleet->attributeIs("Truck, cost", "100");
+    Ptr<Instance> loc1 = m->instanceNew("loc1", "Customer");
+    Ptr<Instance> loc2 = m->instanceNew("loc2", "Customer");
+    Ptr<Instance> seg1 = m->instanceNew("seg1", "Truck segment");
+    Ptr<Instance> seg2 = m->instanceNew("seg2", "Truck segment");
+    seg1->attributeIs("source", "loc1");
+    seg1->attributeIs("length", "1.0");
+    seg1->attributeIs("return segment", "seg2");
+    seg2->attributeIs("source", "loc2");
+    seg2->attributeIs("length", "1.5");
+    Ptr<Instance> conn = m->instanceNew("conn", "Conn");
+    conn->attributeIs("routing", "minHops");
+    loc1->attributeIs("Transfer Rate", "8");
+    loc1->attributeIs("Shipment Size", "10");
+    loc1->attributeIs("Destination", "loc2");
+
+    // without FWK_ATOMIC_REFS this runs in the foreground
+    Ptr<Instance::SimulationManager> simulation = m->simulationManager();
+    simulation->snapshotIntervalIs(0.5);
+    simulation->backgroundIs(true);
+    simulation->timeIs(7);
+    while (simulation->snapshotTime() < 7) usleep(1000);
+    EXPECT_EQ("2", loc2->attribute("Shipments Received"));
+    EXPECT_EQ("1.00", loc2->attribute("Average Latency"));
+
+    // writes wait for the current step
+    simulation->timeIs(25);
+    loc1->attributeIs("Transfer Rate", "0");
+    simulation->backgroundIs(false);
+    EXPECT_EQ(Activity::Time(25), simulation->snapshotTime());
+    std::string received = seg1->attribute("Shipments Received");
+    simulation->timeIs(28);
+    EXPECT_EQ(received, seg1->attribute("Shipments Received"));
+}
+
+TEST(Activity, Checkpoint) {
+    Ptr<Instance::Manager> m = shippingInstanceManager();
+    Ptr<Instance> fleet = m->instanceNew("fleet", "Fleet");
+    fleet->attributeIs("Truck, speed", "1");
+    fleet->attributeIs("Truck, capacity", "4");
+    fleet->attributeIs("Truck, cost", "100");
+    Ptr<Instance> loc1 = m->instanceNew("loc1", "Customer");
+    Ptr<Instance> loc2 = m->instanceNew("loc2", "Customer");
+    Ptr<Instance> seg1 = m->instanceNew("seg1", "Truck segment");
+    Ptr<Instance> seg2 = m->instanceNew("seg2", "Truck segment");
+    seg1->attributeIs("source", "loc1");
+    seg1->attributeIs("length", "3.0");
+    seg1->attributeIs("Capacity", "2");
+    seg1->attributeIs("return segment", "seg2");
+    seg2->attributeIs("source", "loc2");
+    Ptr<Instance> conn = m->instanceNew("conn", "Conn");
+    conn->attributeIs("routing", "minHops");
+    loc1->attributeIs("Transfer Rate", "12");
+    loc1->attributeIs("Shipment Size", "10");
+    loc1->attributeIs("Destination", "loc2");
+    m->simulationManager()->paceIs(Instance::SimulationManager::unpaced());
+
+    // carriers are under way and loads queued at the checkpoint
+    m->simulationManager()->timeIs(5.5);
+    std::stringstream file;
+    file << "/tmp/RepTest.checkpoint." << getpid();
+    m->checkpointIs(file.str());
+    m->simulationManager()->timeIs(40);
+
+    Ptr<Instance::Manager> r = shippingInstanceManager(file.str());
+    unlink(file.str().c_str());
+    ASSERT_TRUE(r);
+    EXPECT_EQ("minHops", r->instance("conn")->attribute("routing"));
+    r->simulationManager()->timeIs(40);
+    EXPECT_LT(0, atoi(loc2->attribute("Shipments Received").c_str()));
+    EXPECT_EQ(loc2->attribute("Shipments Received"), r->instance("loc2")->attribute("Shipments Received"));
+    EXPECT_EQ(loc2->attribute("Average Latency"), r->instance("loc2")->attribute("Average Latency"));
+    EXPECT_EQ(loc2->attribute("Total Cost"), r->instance("loc2")->attribute("Total Cost"));
+    EXPECT_EQ(seg1->attribute("Shipments Received"), r->instance("seg1")->attribute("Shipments Received"));
+    EXPECT_EQ(seg1->attribute("Shipments Refused"), r->instance("seg1")->attribute("Shipments Refused"));
+
+    EXPECT_FALSE(shippingInstanceManager(file.str()));
+}
+
+TEST(Activity, Branch) {
+    Ptr<Instance::Manager> m = shippingInstanceManager();
+    Ptr<Instance> fleet = m->instanceNew("fleet", "Fleet");
+    fleet->attributeIs("Truck, speed", "1");
+    fleet->attributeIs("Truck, capacity", "4");
+    Ptr<Instance> loc1 = m->instanceNew("loc1", "Customer");
+    Ptr<Instance> loc2 = m->instanceNew("loc2", "Customer");
+    Ptr<Instance> seg1 = m->instanceNew("seg1", "Truck segment");
+    Ptr<Instance> seg2 = m->instanceNew("seg2", "Truck segment");
+    seg1->attributeIs("source", "loc1");
+    seg1->attributeIs("length", "3.0");
+    seg1->attributeIs("Capacity", "1");
+    seg1->attributeIs("return segment", "seg2");
+    seg2->attributeIs("source", "loc2");
+    Ptr<Instance> conn = m->instanceNew("conn", "Conn");
+    conn->attributeIs("routing", "minHops");
+    loc1->attributeIs("Transfer Rate", "12");
+    loc1->attributeIs("Shipment Size", "10");
+    loc1->attributeIs("Destination", "loc2");
+    Ptr<Instance::SimulationManager> simulation = m->simulationManager();
+    simulation->paceIs(Instance::SimulationManager::unpaced());
+    simulation->timeIs(10);
+
+    // each branch adds carriers to the warmed-up segment
+    for(uint32_t i = 0; i < 3; i++){
+        uint32_t branch = simulation->branch();
+        if(branch == 0) continue;
+        seg1->attributeIs("Capacity", boost::lexical_cast<string>(branch + 1));
+        simulation->timeIs(40);
+        simulation->branchResultIs(loc2->attribute("Shipments Received"));
+    }
+    std::vector<string> results = simulation->branchResults();
+    ASSERT_EQ(3u, results.size());
+    EXPECT_EQ("1", seg1->attribute("Capacity"));
+    EXPECT_TRUE(simulation->branchResults().empty());
+
+    // the third branch ran what this process runs now
+    seg1->attributeIs("Capacity", "4");
+    simulation->timeIs(40);
+    EXPECT_EQ(loc2->attribute("Shipments Received"), results[2]);
+    EXPECT_LT(atoi(results[0].c_str()), atoi(results[2].c_str()));
+}
+
+TEST(Activity, RecordReplay) {
+    std::stringstream file;
+    file << "/tmp/RepTest.log." << getpid();
+    Ptr<Instance::Manager> m = shippingInstanceManager();
+    m->recordIs(file.str());
+    m->simulationManager()->randomSeedIs(7);
+    m->simulationManager()->paceIs(Instance::SimulationManager::unpaced());
+    Ptr<Instance> fleet = m->instanceNew("fleet", "Fleet");
+    fleet->attributeIs("Truck, speed", "1");
+    fleet->attributeIs("Truck, capacity", "4");
+    Ptr<Instance> loc1 = m->instanceNew("loc1", "Customer");
+    Ptr<Instance> loc2 = m->instanceNew("loc2", "Customer");
+    m->instanceNew("term", "Truck terminal");
+    m->instanceNew("loc3", "Customer");
+    const char* segs[][3] = {
+        {"loc1->loc2", "loc1", "loc2->loc1"},
+        {"loc2->loc1", "loc2", NULL},
+        {"loc1->term", "loc1", "term->loc1"},
+        {"term->loc1", "term", NULL},
+        {"term->loc2", "term", "loc2->term"},
+        {"loc2->term", "loc2", NULL},
+    };
+    for (uint32_t i = 0; i < 6; i++) {
+        Ptr<Instance> seg = m->instanceNew(segs[i][0], "Truck segment");
+        seg->attributeIs("source", segs[i][1]);
+        seg->attributeIs("length", "1.0");
+        seg->attributeIs("Capacity", "2");
+    }
+    for (uint32_t i = 0; i < 6; i += 2)
+        m->instance(segs[i][0])->attributeIs("return segment", segs[i][2]);
+    m->instance("loc1->loc2")->attributeIs("length", "2.0");
+    Ptr<Instance> conn = m->instanceNew("conn", "Conn");
+    conn->attributeIs("routing", "minTime");
+    loc1->attributeIs("Transfer Rate", "24");
+    loc1->attributeIs("Shipment Size", "10");
+    loc1->attributeIs("Destination", "loc2");
+
+    // the two routes take as long, so routing breaks the tie with the
+    // seeded random numbers
+    m->simulationManager()->timeIs(10);
+    loc1->attributeIs("Shipment Size", "30");
+    m->simulationManager()->timeIs(20, (uint64_t)50);
+    m->instanceDel("loc3");
+    m->simulationManager()->timeIs(30);
+    m->recordIs("");
+    m->simulationManager()->timeIs(40);
+
+    Ptr<Instance::Manager> r = shippingInstanceManagerReplay(file.str());
+    unlink(file.str().c_str());
+    ASSERT_TRUE(r);
+    EXPECT_EQ(30, r->simulationManager()->snapshotTime().value());
+    EXPECT_FALSE(r->instance("loc3"));
+    r->simulationManager()->timeIs(40);
+    EXPECT_LT(0, atoi(loc2->attribute("Shipments Received").c_str()));
+    EXPECT_EQ(loc2->attribute("Shipments Received"), r->instance("loc2")->attribute("Shipments Received"));
+    EXPECT_EQ(loc2->attribute("Average Latency"), r->instance("loc2")->attribute("Average Latency"));
+    EXPECT_EQ(m->instance("loc1->loc2")->attribute("Shipments Received"),
+              r->instance("loc1->loc2")->attribute("Shipments Received"));
+
+    // only a new manager records
+    m->recordIs(file.str());
+    EXPECT_FALSE(shippingInstanceManagerReplay(file.str()));
+}
+
+TEST(Activity, RecordBranch) {
+    std::stringstream file;
+    file << "/tmp/RepTest.branchLog." << getpid();
+    Ptr<Instance::Manager> m = shippingInstanceManager();
+    m->recordIs(file.str());
+    Ptr<Instance::SimulationManager> simulation = m->simulationManager();
+    simulation->paceIs(Instance::SimulationManager::unpaced());
+    Ptr<Instance> fleet = m->instanceNew("fleet", "Fleet");
+    fleet->attributeIs("Truck, speed", "1");
+    fleet->attributeIs("Truck, capacity", "4");
+    Ptr<Instance> loc1 = m->instanceNew("loc1", "Customer");
+    Ptr<Instance> loc2 = m->instanceNew("loc2", "Customer");
+    Ptr<Instance> seg1 = m->instanceNew("seg1", "Truck segment");
+    Ptr<Instance> seg2 = m->instanceNew("seg2", "Truck segment");
+    seg1->attributeIs("source", "loc1");
+    seg1->attributeIs("length", "3.0");
+    seg1->attributeIs("Capacity", "1");
+    seg1->attributeIs("return segment", "seg2");
+    seg2->attributeIs("source", "loc2");
+    loc1->attributeIs("Transfer Rate", "12");
+    loc1->attributeIs("Shipment Size", "10");
+    loc1->attributeIs("Destination", "loc2");
+    simulation->timeIs(10);
+
+    // what the branch changes stays out of the log
+    if(simulation->branch() != 0){
+        m->instanceNew("onlyInBranch", "Customer");
+        seg1->attributeIs("Capacity", "3");
+        simulation->timeIs(40);
+        simulation->branchResultIs(loc2->attribute("Shipments Received"));
+    }
+    ASSERT_EQ(1u, simulation->branchResults().size());
+    simulation->timeIs(20);
+    m->recordIs("");
+
+    Ptr<Instance::Manager> r = shippingInstanceManagerReplay(file.str());
+    unlink(file.str().c_str());
+    ASSERT_TRUE(r);
+    EXPECT_EQ(20, r->simulationManager()->snapshotTime().value());
+    EXPECT_FALSE(r->instance("onlyInBranch"));
+    EXPECT_EQ("1", r->instance("seg1")->attribute("Capacity"));
+    EXPECT_EQ(loc2->attribute("Shipments Received"), r->instance("loc2")->attribute("Shipments Received"));
+}
+
+/* Two customers trading shipments through a pair of terminals, which a
+ * split in two puts in different partitions */
+static Ptr<Instance::Manager> twoRegionNetwork(){
+    Ptr<Instance::Manager> m = shippingInstanceManager();
+    Ptr<Instance> fleet = m->instanceNew("fleet", "Fleet");
+    fleet->attributeIs("Truck, speed", "1");
+    fleet->attributeIs("Truck, capacity", "4");
+    fleet->attributeIs("Truck, cost", "10");
+    m->instanceNew("c1", "Customer");
+    m->instanceNew("c2", "Customer");
+    m->instanceNew("t1", "Truck terminal");
+    m->instanceNew("t2", "Truck terminal");
+    const char* segs[][4] = {
+        {"c1->t1", "c1", "t1->c1", "1.0"},
+        {"t1->c1", "t1", NULL, "1.0"},
+        {"t1->t2", "t1", "t2->t1", "3.0"},
+        {"t2->t1", "t2", NULL, "3.0"},
+        {"t2->c2", "t2", "c2->t2", "2.0"},
+        {"c2->t2", "c2", NULL, "2.0"},
+    };
+    for (uint32_t i = 0; i < 6; i++) {
+        Ptr<Instance> seg = m->instanceNew(segs[i][0], "Truck segment");
+        seg->attributeIs("source", segs[i][1]);
+        seg->attributeIs("length", segs[i][3]);
+        seg->attributeIs("Capacity", "1");
+    }
+    for (uint32_t i = 0; i < 6; i += 2)
+        m->instance(segs[i][0])->attributeIs("return segment", segs[i][2]);
+    m->instanceNew("conn", "Conn")->attributeIs("routing", "minHops");
+    m->simulationManager()->paceIs(Instance::SimulationManager::unpaced());
+    return m;
+}
+
+/* Counters of every customer and segment of a twoRegionNetwork() */
+static string twoRegionCounters(Ptr<Instance::Manager> m){
+    std::stringstream counters;
+    const char* customers[] = { "c1", "c2" };
+    for (uint32_t i = 0; i < 2; i++) {
+        Ptr<Instance> c = m->instance(customers[i]);
+        counters << c->name() << " " << c->attribute("Shipments Received") << " "
+                 << c->attribute("Average Latency") << " " << c->attribute("Total Cost") << "\n";
+    }
+    const char* segs[] = { "c1->t1", "t1->c1", "t1->t2", "t2->t1", "t2->c2", "c2->t2" };
+    for (uint32_t i = 0; i < 6; i++) {
+        Ptr<Instance> seg = m->instance(segs[i]);
+        counters << seg->name() << " " << seg->attribute("Shipments Received") << " "
+                 << seg->attribute("Shipments Refused") << "\n";
+    }
+    return counters.str();
+}
+
+/* Runs twoRegionNetwork() in the given number of partitions to time 60,
+ * the customers sending to each other at different rates and sizes; an
+ * optimistic window, if any, lets the partitions run that far ahead */
+static string twoRegionRun(uint32_t partitions, double window = 0, string* rollbacks = NULL){
+    Ptr<Instance::Manager> m = twoRegionNetwork();
+    Ptr<Instance> telemetry = m->instanceNew("telemetry", "Telemetry");
+    m->simulationManager()->partitionsIs(partitions);
+    m->simulationManager()->optimisticWindowIs(window);
+    Ptr<Instance> c1 = m->instance("c1");
+    Ptr<Instance> c2 = m->instance("c2");
+    c1->attributeIs("Transfer Rate", "12");
+    c1->attributeIs("Shipment Size", "10");
+    c1->attributeIs("Destination", "c2");
+    c2->attributeIs("Transfer Rate", "5");
+    c2->attributeIs("Shipment Size", "6");
+    c2->attributeIs("Destination", "c1");
+    m->simulationManager()->timeIs(60);
+    if (rollbacks) *rollbacks = telemetry->attribute("rollbacks");
+    return twoRegionCounters(m);
+}
+
+TEST(Activity, Partitions) {
+    // each partition runs one terminal and the customer behind it; the
+    // shipments crossing between them give the same counters
+    string single = twoRegionRun(1);
+    EXPECT_EQ(single, twoRegionRun(2));
+    EXPECT_EQ(single, twoRegionRun(4));
+    EXPECT_NE(string::npos, single.find("t1->t2 "));
+    EXPECT_EQ(string::npos, single.find("c1 0 "));
+    EXPECT_EQ(string::npos, single.find("c2 0 "));
+}
+
+TEST(Activity, OptimisticPartitions) {
+    string single = twoRegionRun(1);
+    string rollbacks;
+    // a window within the three hour trip between the terminals never
+    // sees a shipment from the other partition arrive in its past
+    EXPECT_EQ(single, twoRegionRun(2, 2.5, &rollbacks));
+    EXPECT_EQ("0", rollbacks);
+    // a ten hour window does, and is rolled back to the straggler
+    EXPECT_EQ(single, twoRegionRun(2, 10, &rollbacks));
+    EXPECT_LT(0, atoi(rollbacks.c_str()));
+    EXPECT_EQ(single, twoRegionRun(4, 10, &rollbacks));
+    EXPECT_LT(0, atoi(rollbacks.c_str()));
+}
+
+/* Three customers sending to a fourth, each through its own terminal and
+ * a hub; their carriers reach the hub together, from different partitions
+ * once it is split, and queue for the one segment on to the receiver */
+static string hubRun(uint32_t partitions, double window = 0){
+    Ptr<Instance::Manager> m = shippingInstanceManager();
+    Ptr<Instance> fleet = m->instanceNew("fleet", "Fleet");
+    fleet->attributeIs("Truck, speed", "1");
+    fleet->attributeIs("Truck, capacity", "4");
+    fleet->attributeIs("Truck, cost", "10");
+    m->instanceNew("hub", "Truck terminal");
+    const char* sizes[] = { "5", "7", "6", "9" };
+    for (uint32_t i = 0; i < 4; i++) {
+        std::stringstream c, t;
+        c << "c" << i;
+        t << "t" << i;
+        m->instanceNew(c.str(), "Customer");
+        m->instanceNew(t.str(), "Truck terminal");
+        const string ends[][3] = {
+            { c.str(), t.str(), "1.0" },
+            { t.str(), "hub", "3.0" },
+        };
+        for (uint32_t j = 0; j < 2; j++) {
+            Ptr<Instance> there = m->instanceNew(ends[j][0] + "->" + ends[j][1], "Truck segment");
+            Ptr<Instance> back = m->instanceNew(ends[j][1] + "->" + ends[j][0], "Truck segment");
+            there->attributeIs("source", ends[j][0]);
+            back->attributeIs("source", ends[j][1]);
+            there->attributeIs("length", ends[j][2]);
+            back->attributeIs("length", ends[j][2]);
+            back->attributeIs("Capacity", "1");
+            there->attributeIs("return segment", back->name());
+        }
+    }
+    m->instanceNew("conn", "Conn")->attributeIs("routing", "minHops");
+    m->simulationManager()->paceIs(Instance::SimulationManager::unpaced());
+    m->simulationManager()->partitionsIs(partitions);
+    m->simulationManager()->optimisticWindowIs(window);
+    for (uint32_t i = 0; i < 4; i++) {
+        std::stringstream c;
+        c << "c" << i;
+        Ptr<Instance> customer = m->instance(c.str());
+        customer->attributeIs("Transfer Rate", "8");
+        customer->attributeIs("Shipment Size", sizes[i]);
+        customer->attributeIs("Destination", i == 3 ? "c0" : "c3");
+    }
+    m->simulationManager()->timeIs(60);
+    std::stringstream counters;
+    for (uint32_t i = 0; i < 4; i++) {
+        std::stringstream c, t;
+        c << "c" << i;
+        t << "hub->t" << i;
+        Ptr<Instance> customer = m->instance(c.str());
+        Ptr<Instance> seg = m->instance(t.str());
+        counters << customer->name() << " " << customer->attribute("Shipments Received") << " "
+                 << customer->attribute("Average Latency") << " " << customer->attribute("Total Cost") << "\n"
+                 << seg->name() << " " << seg->attribute("Shipments Received") << " "
+                 << seg->attribute("Shipments Refused") << "\n";
+    }
+    return counters.str();
+}
+
+TEST(Activity, PartitionsSameTime) {
+    // the hub hands the shipments arriving together to hub->t3 in the
+    // same order whichever partitions they come from
+    string single = hubRun(1);
+    EXPECT_EQ(single, hubRun(2));
+    EXPECT_EQ(single, hubRun(4));
+    EXPECT_EQ(single, hubRun(4, 10));
+    EXPECT_EQ(string::npos, single.find("c3 0 "));
+}
+
 TEST(Activity, ShipThroughTerminal) {
     Ptr<Instance::Manager> m = shippingInstanceManager();
     ASSERT_TRUE(m);
@@ -428,10 +934,11 @@ TEST(Activity, HighRate) {
     m->simulationManager()->timeIs(25);
 
     // check that one shipment has arrived
-    // this actually depends on a float comparison, so it can vary
-    EXPECT_EQ("49", loc2->attribute("Shipments Received"));
+    // activity times are compared in whole ticks, so the shipment injected
+    // at hour 24 arrives at exactly hour 25 and is counted
+    EXPECT_EQ("50", loc2->attribute("Shipments Received"));
     EXPECT_EQ("1.00", loc2->attribute("Average Latency"));
-    EXPECT_EQ("4900.00", loc2->attribute("Total Cost"));
+    EXPECT_EQ("5000.00", loc2->attribute("Total Cost"));
 
     // Not sure how many extra shipments should be received. Probably 2.
     EXPECT_EQ("52", seg1->attribute("Shipments Received"));